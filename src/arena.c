@@ -0,0 +1,280 @@
+/*
+ * arena.c -- preallocated blocks for short-lived allocations
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <openssl/crypto.h>
+
+#include "arena.h"
+#include "log.h"
+
+#define HEAP_CLASS	ARENA_CLASSES
+
+/* Ahead of every block, keeping what follows aligned */
+union arena_header {
+	struct {
+		unsigned int cls;	/* HEAP_CLASS if from the heap */
+		size_t size;		/* heap blocks only */
+	} h;
+	max_align_t align;
+};
+
+static unsigned char *base, *top, *end;
+static void *free_lists[ARENA_CLASSES];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long heap_allocs;
+
+const char *arena_memory_modes[3] = { "pageable", "locked", "huge" };
+
+static int memory_mode = ARENA_PAGEABLE;
+static size_t huge_bytes, locked_bytes;
+static int warned_huge, warned_lock;
+
+static size_t class_size(int cls)
+{
+  return (size_t)ARENA_MIN << cls;
+}
+
+int arena_parse_memory(const char *name)
+{
+  int i;
+
+  for (i = 0; i < 3; i++)
+    if (!strcmp(name, arena_memory_modes[i]))
+      return i;
+  return -1;
+}
+
+void arena_lock(void *p, size_t bytes)
+{
+  if (memory_mode == ARENA_PAGEABLE || p == NULL)
+    return;
+  if (mlock(p, bytes)) {
+    if (!__atomic_exchange_n(&warned_lock, 1, __ATOMIC_RELAXED))
+      log_line(LOG_INFO, "WARNING: Couldn't lock buffers in memory, RLIMIT_MEMLOCK may be too low");
+    return;
+  }
+  __atomic_add_fetch(&locked_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void arena_unlock(void *p, size_t bytes)
+{
+  if (memory_mode == ARENA_PAGEABLE || p == NULL)
+    return;
+  if (!munlock(p, bytes))
+    __atomic_sub_fetch(&locked_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* Rounded up to what arena_map() actually maps */
+static size_t map_size(size_t bytes)
+{
+  size_t page = bytes >= ARENA_HUGE_PAGE && memory_mode == ARENA_HUGE ? ARENA_HUGE_PAGE : 4096;
+
+  return (bytes + page - 1) & ~(page - 1);
+}
+
+void *arena_map(size_t bytes)
+{
+  void *p = MAP_FAILED;
+
+  bytes = map_size(bytes);
+  if (bytes >= ARENA_HUGE_PAGE && memory_mode == ARENA_HUGE) {
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+	     -1, 0);
+#endif
+    if (p == MAP_FAILED && !__atomic_exchange_n(&warned_huge, 1, __ATOMIC_RELAXED))
+      log_line(LOG_INFO, "WARNING: No huge pages reserved, asking for transparent ones");
+  }
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return NULL;
+#ifdef MADV_HUGEPAGE
+    if (bytes >= ARENA_HUGE_PAGE && memory_mode == ARENA_HUGE)
+      madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+  }
+  if (bytes >= ARENA_HUGE_PAGE && memory_mode == ARENA_HUGE)
+    __atomic_add_fetch(&huge_bytes, bytes, __ATOMIC_RELAXED);
+  arena_lock(p, bytes);
+  return p;
+}
+
+void arena_unmap(void *p, size_t bytes)
+{
+  if (p == NULL)
+    return;
+  bytes = map_size(bytes);
+  arena_unlock(p, bytes);
+  if (bytes >= ARENA_HUGE_PAGE && memory_mode == ARENA_HUGE)
+    __atomic_sub_fetch(&huge_bytes, bytes, __ATOMIC_RELAXED);
+  munmap(p, bytes);
+}
+
+size_t arena_huge_bytes(void)
+{
+  return __atomic_load_n(&huge_bytes, __ATOMIC_RELAXED);
+}
+
+size_t arena_locked_bytes(void)
+{
+  return __atomic_load_n(&locked_bytes, __ATOMIC_RELAXED);
+}
+
+int arena_init(size_t bytes, int mode)
+{
+  memory_mode = mode;
+  base = arena_map(bytes);
+  if (base == NULL)
+    return -1;
+  top = base;
+  end = base + bytes;
+  return 0;
+}
+
+static void *heap_alloc(size_t n)
+{
+  union arena_header *hdr;
+
+  __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+  hdr = malloc(sizeof(*hdr) + n);
+  if (hdr == NULL)
+    return NULL;
+  hdr->h.cls = HEAP_CLASS;
+  hdr->h.size = n;
+  return hdr + 1;
+}
+
+void *arena_alloc(size_t n)
+{
+  union arena_header *hdr = NULL;
+  size_t want = sizeof(*hdr) + n;
+  int cls;
+
+  for (cls = 0; cls < ARENA_CLASSES && class_size(cls) < want; cls++)
+    ;
+  if (cls == ARENA_CLASSES)
+    return heap_alloc(n);
+
+  pthread_mutex_lock(&lock);
+  if (free_lists[cls]) {
+    hdr = free_lists[cls];
+    free_lists[cls] = *(void **)(hdr + 1);
+  } else if (top && top + class_size(cls) <= end) {
+    hdr = (union arena_header *)top;
+    top += class_size(cls);
+  }
+  pthread_mutex_unlock(&lock);
+  if (hdr == NULL)
+    return heap_alloc(n);
+  hdr->h.cls = cls;
+  return hdr + 1;
+}
+
+void arena_free(void *p)
+{
+  union arena_header *hdr;
+
+  if (p == NULL)
+    return;
+  hdr = (union arena_header *)p - 1;
+  if (hdr->h.cls == HEAP_CLASS) {
+    free(hdr);
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  *(void **)p = free_lists[hdr->h.cls];
+  free_lists[hdr->h.cls] = hdr;
+  pthread_mutex_unlock(&lock);
+}
+
+void *arena_realloc(void *p, size_t n)
+{
+  union arena_header *hdr;
+  size_t have;
+  void *q;
+
+  if (p == NULL)
+    return arena_alloc(n);
+  if (n == 0) {
+    arena_free(p);
+    return NULL;
+  }
+  hdr = (union arena_header *)p - 1;
+  if (hdr->h.cls == HEAP_CLASS)
+    have = hdr->h.size;
+  else
+    have = class_size(hdr->h.cls) - sizeof(*hdr);
+  if (n <= have && hdr->h.cls != HEAP_CLASS)
+    return p;
+  q = arena_alloc(n);
+  if (q == NULL)
+    return NULL;
+  memcpy(q, p, n < have ? n : have);
+  arena_free(p);
+  return q;
+}
+
+unsigned long arena_heap_allocs(void)
+{
+  return __atomic_load_n(&heap_allocs, __ATOMIC_RELAXED);
+}
+
+static void *openssl_malloc(size_t n, const char *file, int line)
+{
+  (void)file;
+  (void)line;
+  return arena_alloc(n);
+}
+
+static void *openssl_realloc(void *p, size_t n, const char *file, int line)
+{
+  (void)file;
+  (void)line;
+  return arena_realloc(p, n);
+}
+
+static void openssl_free(void *p, const char *file, int line)
+{
+  (void)file;
+  (void)line;
+  arena_free(p);
+}
+
+int arena_hook_openssl(void)
+{
+  return CRYPTO_set_mem_functions(openssl_malloc, openssl_realloc, openssl_free) ? 0 : -1;
+}
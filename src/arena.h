@@ -0,0 +1,91 @@
+/*
+ * arena.h -- preallocated blocks for short-lived allocations
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef ARENA__H
+#define ARENA__H
+
+#include <stddef.h>
+
+/*
+ * A fixed arena carved, at startup, into blocks of ARENA_CLASSES power
+ * of two sizes, from ARENA_MIN bytes up.  Freed blocks go on a free
+ * list for their size and are handed out again, so code that allocates
+ * and frees the same things every block (OpenSSL's contexts, mostly)
+ * stops reaching the heap once the lists have filled.  Anything too
+ * big, or asked for once the arena is used up, comes from the heap and
+ * is counted.
+ */
+#define ARENA_MIN	32
+#define ARENA_CLASSES	8	/* 32 bytes to 4 KB */
+#define ARENA_BYTES	(4 << 20)
+#define ARENA_HUGE_PAGE	(2 << 20)
+
+/*
+ * Where the arena and the big buffers live: ordinary pages, pages
+ * locked in memory so key material and output never reach swap, or
+ * locked huge pages, which also spare the TLB at high sample rates.
+ */
+#define ARENA_PAGEABLE	0
+#define ARENA_LOCKED	1
+#define ARENA_HUGE	2
+
+extern const char *arena_memory_modes[3];
+
+/* Returns the mode called name, or -1 */
+extern int arena_parse_memory(const char *name);
+/* Returns 0 on success.  Not getting huge or locked pages only warns. */
+extern int arena_init(size_t bytes, int mode);
+/*
+ * Page backed buffers for acquisition and blocks, huge pages if they
+ * are at least ARENA_HUGE_PAGE and the mode asks.  NULL on failure.
+ */
+extern void *arena_map(size_t bytes);
+extern void arena_unmap(void *p, size_t bytes);
+/* Locks memory allocated elsewhere, if the mode asks */
+extern void arena_lock(void *p, size_t bytes);
+extern void arena_unlock(void *p, size_t bytes);
+/* Bytes currently in huge pages, and locked */
+extern size_t arena_huge_bytes(void);
+extern size_t arena_locked_bytes(void);
+extern void *arena_alloc(size_t n);
+extern void *arena_realloc(void *p, size_t n);
+extern void arena_free(void *p);
+/* Allocations the arena couldn't serve, since startup */
+extern unsigned long arena_heap_allocs(void);
+
+/*
+ * Routes OpenSSL's allocations through the arena.  Has to come before
+ * anything else uses OpenSSL; returns 0 on success.
+ */
+extern int arena_hook_openssl(void);
+
+#endif /* ARENA__H */
@@ -0,0 +1,370 @@
+/*
+ * bitstats.c -- per bit plane bias and correlation statistics
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bitstats.h"
+#include "log.h"
+#include "metrics.h"
+
+/*
+ * The counters work on 64 bit words of samples at a time.  Every
+ * plane's bit is masked down to the bottom of its lane and added into
+ * a per plane accumulator, so each accumulator holds a small counter
+ * per lane and all the planes are counted with a handful of shifts,
+ * ands and adds.  The loops over planes vectorize.  The lanes get
+ * summed up before they can overflow.
+ *
+ * Lanes are laid out little endian, I first.  Other hosts take the
+ * plain per sample path.
+ */
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define BITSTATS_SWAR 1
+#endif
+
+struct swar {
+  uint64_t ones[2][BITSTATS_PLANES];
+  uint64_t both[2][BITSTATS_PLANES];
+  uint64_t iq[BITSTATS_PLANES];
+};
+
+void bitstats_reset(struct bitstats *bs)
+{
+  memset(bs, 0, sizeof(*bs));
+}
+
+/* Counts one I/Q pair the slow way */
+static void add_pair(struct bitstats *bs, uint16_t i, uint16_t q, int planes)
+{
+  uint16_t bi = i & bs->last[BITSTATS_I], bq = q & bs->last[BITSTATS_Q];
+  uint16_t iq = i & q;
+  int k;
+
+  for (k = 0; k < planes; k++) {
+    bs->ones[BITSTATS_I][k] += (i >> k) & 1;
+    bs->ones[BITSTATS_Q][k] += (q >> k) & 1;
+    bs->both[BITSTATS_I][k] += (bi >> k) & 1;
+    bs->both[BITSTATS_Q][k] += (bq >> k) & 1;
+    bs->iq[k] += (iq >> k) & 1;
+  }
+  bs->last[BITSTATS_I] = i;
+  bs->last[BITSTATS_Q] = q;
+  bs->samples += 2;
+}
+
+#ifdef BITSTATS_SWAR
+/* Adds up the lanes of every accumulator into bs, lane is the lane
+ * width in bits */
+static void swar_flush(struct bitstats *bs, struct swar *acc, int planes, int lane)
+{
+  uint64_t lmask = (lane == 64) ? ~0ULL : ((1ULL << lane) - 1);
+  int c, k, l;
+
+  for (k = 0; k < planes; k++) {
+    for (l = 0; l < 64; l += lane) {
+      for (c = 0; c < 2; c++) {
+	bs->ones[c][k] += (acc->ones[c][k] >> l) & lmask;
+	bs->both[c][k] += (acc->both[c][k] >> l) & lmask;
+      }
+      bs->iq[k] += (acc->iq[k] >> l) & lmask;
+    }
+  }
+  memset(acc, 0, sizeof(*acc));
+}
+
+/*
+ * Counts nwords words of interleaved I/Q samples, each width bits.
+ * Every word holds whole I/Q pairs.  Counter lanes are two samples
+ * wide, with the I bit at the bottom.
+ */
+static void swar_count(struct swar *acc, const uint64_t *w, uint64_t prev,
+		       size_t nwords, int width, int planes)
+{
+  const int pair = 2 * width;
+  uint64_t m = 0, x, lag, both, iq;
+  size_t n;
+  int k;
+
+  for (k = 0; k < 64; k += pair)
+    m |= 1ULL << k;
+
+  for (n = 0; n < nwords; n++) {
+    x = w[n];
+    /* the same channel, one pair earlier */
+    lag = (x << pair) | (prev >> (64 - pair));
+    both = x & lag;
+    iq = x & (x >> width);
+    for (k = 0; k < planes; k++) {
+      acc->ones[BITSTATS_I][k] += (x >> k) & m;
+      acc->ones[BITSTATS_Q][k] += (x >> (k + width)) & m;
+      acc->both[BITSTATS_I][k] += (both >> k) & m;
+      acc->both[BITSTATS_Q][k] += (both >> (k + width)) & m;
+      acc->iq[k] += (iq >> k) & m;
+    }
+    prev = x;
+  }
+}
+
+/* Counts samples in words, leaving the tail to add_pair() */
+static size_t swar_add(struct bitstats *bs, const void *samples, size_t n,
+		       int width, int planes)
+{
+  struct swar acc;
+  uint64_t words[256], prev;
+  const unsigned char *p = samples;
+  const size_t per_word = 64 / width, bytes = width / 8;
+  /* lanes are at least 16 bits, and get at most one per word */
+  const size_t limit = 65535;
+  size_t nw, done = 0, since = 0;
+
+  if (n < per_word)
+    return 0;
+  memset(&acc, 0, sizeof(acc));
+  if (width == 8)
+    prev = ((uint64_t)bs->last[BITSTATS_Q] << 56) | ((uint64_t)(bs->last[BITSTATS_I] & 0xff) << 48);
+  else
+    prev = ((uint64_t)bs->last[BITSTATS_Q] << 48) | ((uint64_t)bs->last[BITSTATS_I] << 32);
+
+  while (n - done >= per_word) {
+    nw = (n - done) / per_word;
+    if (nw > sizeof(words) / sizeof(words[0]))
+      nw = sizeof(words) / sizeof(words[0]);
+    memcpy(words, p + done * bytes, nw * sizeof(words[0]));
+    swar_count(&acc, words, prev, nw, width, planes);
+    prev = words[nw - 1];
+    done += nw * per_word;
+    since += nw;
+    if (since + sizeof(words) / sizeof(words[0]) > limit) {
+      swar_flush(bs, &acc, planes, 2 * width);
+      since = 0;
+    }
+  }
+  swar_flush(bs, &acc, planes, 2 * width);
+
+  if (width == 8) {
+    bs->last[BITSTATS_I] = (prev >> 48) & 0xff;
+    bs->last[BITSTATS_Q] = (prev >> 56) & 0xff;
+  } else {
+    bs->last[BITSTATS_I] = (prev >> 32) & 0xffff;
+    bs->last[BITSTATS_Q] = (prev >> 48) & 0xffff;
+  }
+  bs->samples += done;
+  return done;
+}
+#endif
+
+void bitstats_add_u8(struct bitstats *bs, const uint8_t *samples, size_t n)
+{
+  size_t i = 0;
+
+#ifdef BITSTATS_SWAR
+  i = swar_add(bs, samples, n, 8, 8);
+#endif
+  for (; i + 1 < n; i += 2)
+    add_pair(bs, samples[i], samples[i + 1], 8);
+}
+
+void bitstats_add_s16(struct bitstats *bs, const int16_t *samples, size_t n)
+{
+  size_t i = 0;
+
+#ifdef BITSTATS_SWAR
+  i = swar_add(bs, samples, n, 16, BITSTATS_PLANES);
+#endif
+  for (; i + 1 < n; i += 2)
+    add_pair(bs, (uint16_t)samples[i], (uint16_t)samples[i + 1], BITSTATS_PLANES);
+}
+
+double bitstats_channel_bias(const struct bitstats *bs, int channel, int plane)
+{
+  if (bs->samples < 2)
+    return 0.5;
+  return (double)bs->ones[channel][plane] / (bs->samples / 2) - 0.5;
+}
+
+double bitstats_bias(const struct bitstats *bs, int plane)
+{
+  if (!bs->samples)
+    return 0.5;
+  return (double)(bs->ones[BITSTATS_I][plane] + bs->ones[BITSTATS_Q][plane])
+    / bs->samples - 0.5;
+}
+
+static double lag_corr(double p, double p11)
+{
+  if (p <= 0.0 || p >= 1.0)
+    return 1.0;
+  return (p11 - p * p) / (p * (1.0 - p));
+}
+
+double bitstats_channel_corr(const struct bitstats *bs, int channel, int plane)
+{
+  if (bs->samples < 4)
+    return 1.0;
+  return lag_corr(bitstats_channel_bias(bs, channel, plane) + 0.5,
+		  (double)bs->both[channel][plane] / (bs->samples / 2 - 1));
+}
+
+double bitstats_corr(const struct bitstats *bs, int plane)
+{
+  if (bs->samples < 4)
+    return 1.0;
+  return lag_corr(bitstats_bias(bs, plane) + 0.5,
+		  (double)(bs->both[BITSTATS_I][plane] + bs->both[BITSTATS_Q][plane])
+		  / (bs->samples - 2));
+}
+
+double bitstats_iq_corr(const struct bitstats *bs, int plane)
+{
+  double pi, pq, pboth, d;
+
+  if (bs->samples < 2)
+    return 1.0;
+  pi = bitstats_channel_bias(bs, BITSTATS_I, plane) + 0.5;
+  pq = bitstats_channel_bias(bs, BITSTATS_Q, plane) + 0.5;
+  pboth = (double)bs->iq[plane] / (bs->samples / 2);
+  d = sqrt(pi * (1.0 - pi) * pq * (1.0 - pq));
+  if (d <= 0.0)
+    return 1.0;
+  return (pboth - pi * pq) / d;
+}
+
+void bitstats_publish(const struct bitstats *bs, int planes)
+{
+  char labels[METRICS_LABELS_LEN];
+  int k;
+
+  for (k = 0; k < planes; k++) {
+    snprintf(labels, sizeof(labels), "plane=\"%d\",channel=\"i\"", k);
+    metrics_set("plane_ones_ratio", labels, bitstats_channel_bias(bs, BITSTATS_I, k) + 0.5);
+    metrics_set("plane_lag1_corr", labels, bitstats_channel_corr(bs, BITSTATS_I, k));
+    snprintf(labels, sizeof(labels), "plane=\"%d\",channel=\"q\"", k);
+    metrics_set("plane_ones_ratio", labels, bitstats_channel_bias(bs, BITSTATS_Q, k) + 0.5);
+    metrics_set("plane_lag1_corr", labels, bitstats_channel_corr(bs, BITSTATS_Q, k));
+    snprintf(labels, sizeof(labels), "plane=\"%d\"", k);
+    metrics_set("plane_iq_corr", labels, bitstats_iq_corr(bs, k));
+  }
+  metrics_set("profile_samples", NULL, (double)bs->samples);
+}
+
+void bitstats_log(const struct bitstats *bs, int planes)
+{
+  char bar[24];
+  double bias;
+  int k, len, over;
+
+  log_line(LOG_INFO, "Bit plane profile over %llu samples:", bs->samples);
+  log_line(LOG_INFO, "plane  ones(I)  ones(Q)  lag1(I)  lag1(Q)  IQ corr  |bias|, 1 mark per 0.001");
+  for (k = 0; k < planes; k++) {
+    bias = fabs(bitstats_bias(bs, k));
+    len = (int)(bias * 1000.0);
+    over = len > (int)sizeof(bar) - 2;
+    if (over)
+      len = sizeof(bar) - 2;
+    memset(bar, '#', len);
+    bar[len] = over ? '>' : '\0';
+    bar[len + 1] = '\0';
+    log_line(LOG_INFO, "%5d  %7.4f  %7.4f  %7.4f  %7.4f  %7.4f  %s", k,
+	     bitstats_channel_bias(bs, BITSTATS_I, k) + 0.5,
+	     bitstats_channel_bias(bs, BITSTATS_Q, k) + 0.5,
+	     bitstats_channel_corr(bs, BITSTATS_I, k),
+	     bitstats_channel_corr(bs, BITSTATS_Q, k),
+	     bitstats_iq_corr(bs, k), bar);
+  }
+}
+
+/* Bias of Von Neumann output from planes with P(1) of pa and pb */
+static double pair_bias(double pa, double pb)
+{
+  double x = pa * (1.0 - pb), y = (1.0 - pa) * pb;
+  if (x + y <= 0.0)
+    return 0.5;
+  return x / (x + y) - 0.5;
+}
+
+double bitstats_pair_bias(const struct bitstats *bs, int a, int b)
+{
+  return pair_bias(bitstats_bias(bs, a) + 0.5, bitstats_bias(bs, b) + 0.5);
+}
+
+int bitstats_select(const struct bitstats *bs, uint16_t candidates,
+		    double threshold, unsigned char *a, unsigned char *b)
+{
+  int planes[BITSTATS_PLANES];
+  double p[BITSTATS_PLANES], t;
+  int i, j, n = 0, pairs = 0, worst;
+
+  for (i = 0; i < BITSTATS_PLANES; i++) {
+    if (!(candidates & (1 << i)))
+      continue;
+    if (fabs(bitstats_bias(bs, i)) > threshold ||
+	fabs(bitstats_corr(bs, i)) > threshold)
+      continue;
+    planes[n] = i;
+    p[n] = bitstats_bias(bs, i) + 0.5;
+    n++;
+  }
+
+  /* Drop the most biased plane if there is an odd one out */
+  if (n & 1) {
+    worst = 0;
+    for (i = 1; i < n; i++) {
+      if (fabs(p[i] - 0.5) > fabs(p[worst] - 0.5))
+	worst = i;
+    }
+    for (i = worst; i < n - 1; i++) {
+      planes[i] = planes[i + 1];
+      p[i] = p[i + 1];
+    }
+    n--;
+  }
+
+  /* Sort by P(1), so neighbours make the best matched pairs */
+  for (i = 1; i < n; i++) {
+    for (j = i; j > 0 && p[j - 1] > p[j]; j--) {
+      t = p[j]; p[j] = p[j - 1]; p[j - 1] = t;
+      worst = planes[j]; planes[j] = planes[j - 1]; planes[j - 1] = worst;
+    }
+  }
+
+  for (i = 0; i + 1 < n; i += 2) {
+    if (fabs(pair_bias(p[i], p[i + 1])) > threshold)
+      continue;
+    /* keep the lower plane first, like the fixed pairings */
+    a[pairs] = planes[i] < planes[i + 1] ? planes[i] : planes[i + 1];
+    b[pairs] = planes[i] < planes[i + 1] ? planes[i + 1] : planes[i];
+    pairs++;
+  }
+  return pairs;
+}
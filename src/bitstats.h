@@ -0,0 +1,88 @@
+/*
+ * bitstats.h -- per bit plane bias and correlation statistics
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef BITSTATS__H
+#define BITSTATS__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BITSTATS_PLANES 16
+
+#define BITSTATS_I 0
+#define BITSTATS_Q 1
+
+/*
+ * Running counts for every bit plane of an interleaved I/Q sample
+ * stream.  Lag-1 is per channel, so I is compared with the previous
+ * I sample, and Q with the previous Q sample.
+ */
+struct bitstats {
+	unsigned long long samples;	/* I and Q samples together */
+	unsigned long long ones[2][BITSTATS_PLANES];
+	unsigned long long both[2][BITSTATS_PLANES]; /* set here and in the previous sample */
+	unsigned long long iq[BITSTATS_PLANES];	/* set in both I and Q */
+	uint16_t last[2];
+};
+
+extern void bitstats_reset(struct bitstats *bs);
+/* n counts I and Q samples, and should be even */
+extern void bitstats_add_u8(struct bitstats *bs, const uint8_t *samples, size_t n);
+extern void bitstats_add_s16(struct bitstats *bs, const int16_t *samples, size_t n);
+
+/* P(1) - 0.5 for a bit plane, over both channels */
+extern double bitstats_bias(const struct bitstats *bs, int plane);
+extern double bitstats_channel_bias(const struct bitstats *bs, int channel, int plane);
+/* Lag-1 autocorrelation of a bit plane */
+extern double bitstats_corr(const struct bitstats *bs, int plane);
+extern double bitstats_channel_corr(const struct bitstats *bs, int channel, int plane);
+/* Correlation between the I and Q bits of a plane */
+extern double bitstats_iq_corr(const struct bitstats *bs, int plane);
+/* Bias of Von Neumann output from debiasing plane a against plane b */
+extern double bitstats_pair_bias(const struct bitstats *bs, int a, int b);
+
+/* Publishes the profile of the low planes as metrics */
+extern void bitstats_publish(const struct bitstats *bs, int planes);
+/* Logs the profile of the low planes as a table */
+extern void bitstats_log(const struct bitstats *bs, int planes);
+
+/*
+ * Picks Von Neumann pairs from the planes set in candidates, keeping
+ * every plane's bias and lag-1 correlation within threshold, and
+ * pairing planes of similar bias so the pair output stays within
+ * threshold too.  Pairs are written to a[] and b[], which must have
+ * room for BITSTATS_PLANES / 2 entries.  Returns the number of pairs.
+ */
+extern int bitstats_select(const struct bitstats *bs, uint16_t candidates,
+			   double threshold, unsigned char *a, unsigned char *b);
+
+#endif /* BITSTATS__H */
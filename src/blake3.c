@@ -0,0 +1,233 @@
+/*
+ * blake3.c -- portable BLAKE3 hash
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <string.h>
+
+#include "blake3.h"
+
+#define CHUNK_START	(1 << 0)
+#define CHUNK_END	(1 << 1)
+#define PARENT		(1 << 2)
+#define ROOT		(1 << 3)
+
+static const uint32_t IV[8] = {
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+  0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t SCHEDULE[7][16] = {
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+  { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+  { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+  { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+  { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+  { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+  { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static inline uint32_t rotr32(uint32_t w, int c)
+{
+  return (w >> c) | (w << (32 - c));
+}
+
+static inline uint32_t load32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#define G(a, b, c, d, x, y)			\
+  do {						\
+    s[a] = s[a] + s[b] + (x);			\
+    s[d] = rotr32(s[d] ^ s[a], 16);		\
+    s[c] = s[c] + s[d];				\
+    s[b] = rotr32(s[b] ^ s[c], 12);		\
+    s[a] = s[a] + s[b] + (y);			\
+    s[d] = rotr32(s[d] ^ s[a], 8);		\
+    s[c] = s[c] + s[d];				\
+    s[b] = rotr32(s[b] ^ s[c], 7);		\
+  } while (0)
+
+static void compress(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+		     uint8_t block_len, uint64_t counter, uint8_t flags,
+		     uint32_t out[8])
+{
+  uint32_t s[16], m[16];
+  const uint8_t *r;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    m[i] = load32(block + 4 * i);
+  memcpy(s, cv, 8 * sizeof(uint32_t));
+  memcpy(s + 8, IV, 4 * sizeof(uint32_t));
+  s[12] = (uint32_t)counter;
+  s[13] = (uint32_t)(counter >> 32);
+  s[14] = block_len;
+  s[15] = flags;
+  for (i = 0; i < 7; i++) {
+    r = SCHEDULE[i];
+    G(0, 4, 8, 12, m[r[0]], m[r[1]]);
+    G(1, 5, 9, 13, m[r[2]], m[r[3]]);
+    G(2, 6, 10, 14, m[r[4]], m[r[5]]);
+    G(3, 7, 11, 15, m[r[6]], m[r[7]]);
+    G(0, 5, 10, 15, m[r[8]], m[r[9]]);
+    G(1, 6, 11, 12, m[r[10]], m[r[11]]);
+    G(2, 7, 8, 13, m[r[12]], m[r[13]]);
+    G(3, 4, 9, 14, m[r[14]], m[r[15]]);
+  }
+  for (i = 0; i < 8; i++)
+    out[i] = s[i] ^ s[i + 8];
+}
+
+static void chunk_init(struct blake3_chunk *c, uint64_t counter)
+{
+  memset(c, 0, sizeof(*c));
+  memcpy(c->cv, IV, sizeof(IV));
+  c->counter = counter;
+}
+
+static size_t chunk_len(const struct blake3_chunk *c)
+{
+  return BLAKE3_BLOCK_LEN * (size_t)c->blocks_compressed + c->block_len;
+}
+
+static void chunk_update(struct blake3_chunk *c, const uint8_t *in, size_t len)
+{
+  size_t n;
+
+  while (len > 0) {
+    if (c->block_len == BLAKE3_BLOCK_LEN) {
+      compress(c->cv, c->block, BLAKE3_BLOCK_LEN, c->counter,
+	       c->blocks_compressed == 0 ? CHUNK_START : 0, c->cv);
+      c->blocks_compressed++;
+      memset(c->block, 0, sizeof(c->block));
+      c->block_len = 0;
+    }
+    n = BLAKE3_BLOCK_LEN - c->block_len;
+    if (n > len)
+      n = len;
+    memcpy(c->block + c->block_len, in, n);
+    c->block_len += (uint8_t)n;
+    in += n;
+    len -= n;
+  }
+}
+
+/* Finishes a chunk: the last block, with the given extra flags */
+static void chunk_output(const struct blake3_chunk *c, uint8_t flags, uint32_t out[8])
+{
+  flags |= CHUNK_END;
+  if (c->blocks_compressed == 0)
+    flags |= CHUNK_START;
+  compress(c->cv, c->block, c->block_len, c->counter, flags, out);
+}
+
+static void parent_cv(const uint32_t left[8], const uint32_t right[8], uint8_t flags,
+		      uint32_t out[8])
+{
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    block[4 * i] = (uint8_t)left[i];
+    block[4 * i + 1] = (uint8_t)(left[i] >> 8);
+    block[4 * i + 2] = (uint8_t)(left[i] >> 16);
+    block[4 * i + 3] = (uint8_t)(left[i] >> 24);
+    block[32 + 4 * i] = (uint8_t)right[i];
+    block[32 + 4 * i + 1] = (uint8_t)(right[i] >> 8);
+    block[32 + 4 * i + 2] = (uint8_t)(right[i] >> 16);
+    block[32 + 4 * i + 3] = (uint8_t)(right[i] >> 24);
+  }
+  compress(IV, block, BLAKE3_BLOCK_LEN, 0, PARENT | flags, out);
+}
+
+void blake3_init(struct blake3 *h)
+{
+  chunk_init(&h->chunk, 0);
+  h->cv_stack_len = 0;
+}
+
+/* Pushes a finished chunk, merging completed subtrees, as many as
+ * there are trailing zeros in the new total of chunks */
+static void add_chunk_cv(struct blake3 *h, uint32_t cv[8], uint64_t total)
+{
+  while ((total & 1) == 0) {
+    h->cv_stack_len--;
+    parent_cv(h->cv_stack[h->cv_stack_len], cv, 0, cv);
+    total >>= 1;
+  }
+  memcpy(h->cv_stack[h->cv_stack_len], cv, 8 * sizeof(uint32_t));
+  h->cv_stack_len++;
+}
+
+void blake3_update(struct blake3 *h, const void *in, size_t len)
+{
+  const uint8_t *p = in;
+  uint32_t cv[8];
+  uint64_t total;
+  size_t n;
+
+  while (len > 0) {
+    if (chunk_len(&h->chunk) == BLAKE3_CHUNK_LEN) {
+      chunk_output(&h->chunk, 0, cv);
+      total = h->chunk.counter + 1;
+      add_chunk_cv(h, cv, total);
+      chunk_init(&h->chunk, total);
+    }
+    n = BLAKE3_CHUNK_LEN - chunk_len(&h->chunk);
+    if (n > len)
+      n = len;
+    chunk_update(&h->chunk, p, n);
+    p += n;
+    len -= n;
+  }
+}
+
+void blake3_final(const struct blake3 *h, uint8_t out[BLAKE3_OUT_LEN])
+{
+  uint32_t cv[8];
+  int i;
+
+  if (h->cv_stack_len == 0) {
+    chunk_output(&h->chunk, ROOT, cv);
+  } else {
+    chunk_output(&h->chunk, 0, cv);
+    for (i = h->cv_stack_len - 1; i >= 0; i--)
+      parent_cv(h->cv_stack[i], cv, i == 0 ? ROOT : 0, cv);
+  }
+  for (i = 0; i < 8; i++) {
+    out[4 * i] = (uint8_t)cv[i];
+    out[4 * i + 1] = (uint8_t)(cv[i] >> 8);
+    out[4 * i + 2] = (uint8_t)(cv[i] >> 16);
+    out[4 * i + 3] = (uint8_t)(cv[i] >> 24);
+  }
+}
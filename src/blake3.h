@@ -0,0 +1,63 @@
+/*
+ * blake3.h -- portable BLAKE3 hash
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef BLAKE3__H
+#define BLAKE3__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLAKE3_OUT_LEN		32
+#define BLAKE3_BLOCK_LEN	64
+#define BLAKE3_CHUNK_LEN	1024
+#define BLAKE3_MAX_DEPTH	54
+
+struct blake3_chunk {
+	uint32_t cv[8];
+	uint64_t counter;
+	uint8_t block[BLAKE3_BLOCK_LEN];
+	uint8_t block_len;
+	uint8_t blocks_compressed;
+};
+
+/* Plain (unkeyed) BLAKE3, 32 byte output only */
+struct blake3 {
+	struct blake3_chunk chunk;
+	uint32_t cv_stack[BLAKE3_MAX_DEPTH][8];
+	uint8_t cv_stack_len;
+};
+
+extern void blake3_init(struct blake3 *h);
+extern void blake3_update(struct blake3 *h, const void *in, size_t len);
+extern void blake3_final(const struct blake3 *h, uint8_t out[BLAKE3_OUT_LEN]);
+
+#endif /* BLAKE3__H */
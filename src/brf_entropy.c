@@ -61,6 +61,18 @@
 #include <pthread.h>
 #include <libbladeRF.h>
 #include "fips.h"
+#include "estimate.h"
+#include "extract.h"
+#include "metrics.h"
+#include "cache.h"
+#include "condition.h"
+#include "arena.h"
+#include "cpu.h"
+#include "drbg.h"
+#include "duty.h"
+#include "govern.h"
+#include "pool.h"
+#include "state.h"
 #include "util.h"
 #include "log.h"
 #include "defines.h"
@@ -68,6 +80,26 @@
 /*  Globals. */
 static int do_exit = 0;
 static fips_ctx_t fipsctx;
+static struct estimator estimator;
+static struct extract_plan plan;
+static struct extractor extractor;
+static struct conditioner conditioner;
+static unsigned char *condition_buffer;
+static struct drbg_feed drbg_feed;
+static struct drbg_writers drbg_writers;
+static struct pool pool;
+static struct pool_reader pool_reader;
+static int pool_source;
+static double estimated_h = -1;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bitstats planestats;
+static struct bitstats profilestats;
+static time_t next_profile, next_metrics, next_state;
+static struct governor governor;	/* Sample rate for -G */
+static struct duty duty;		/* Pauses the stream for -y */
+static const uint32_t govern_rates[] = {
+  1000000, 2000000, 4000000, 8000000, 10000000, 20000000, 30720000, 40000000
+};
 
 /* bladerf bits */
 uint32_t samp_rate = 40000000;
@@ -77,11 +109,58 @@ float gain = 1000.0;
 struct bladerf *dev;
 pthread_t rx_task;
 struct bladerf_stream *rx_stream;
+char *device_id = NULL;		/* NULL opens the first bladeRF found */
+char *standby_id = NULL;
+unsigned long stream_buffers;	/* since the last open */
+int samples_per_buffer = 65536, num_buffers = 32, num_transfers = 32;
+char *tune_name = NULL;		/* Stream tuning cache, -T */
+char tuned_serial[BLADERF_SERIAL_LENGTH];
+unsigned long calibrate_left;	/* buffers left in a calibration window */
+double calibrate_busy;		/* seconds spent in the callback */
+struct timespec calibrate_first, calibrate_last;	/* window's first and last buffers */
+int sync_mode = 0;		/* -i sync: libbladeRF's sync interface */
+unsigned int sync_batch = SYNC_BATCH;
+double target_rate = 0;		/* -G: output bytes/s to govern the sample rate to */
+volatile int retune;		/* stream ended for the governor's new sample rate */
+double duty_high = 0, duty_low;	/* -y: reservoir fill to pause at, and resume below */
+unsigned long warmup_left;	/* buffers to discard after a pause */
+
+/*
+ * Sync interface batches, filled by the RX thread and handed to the
+ * pipeline thread in order.  head and tail only ever count up.
+ */
+struct sync_buffer {
+	int16_t *samples;
+	size_t count;
+	struct bladerf_metadata meta;
+};
+static struct sync_buffer sync_pool[SYNC_POOL_BUFFERS];
+static unsigned long sync_head, sync_tail;
+static int sync_done;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
 
 /* flags */
 int opt = 0;
 int redirect_output = 0;
 int gflags_encryption = 0;
+int estimate_interval = 0;
+uint16_t bit_mask = 0x3ff;
+double adapt_threshold = 0;
+int profile_interval = 0;
+char *metrics_name = NULL;
+int extract_method = EXTRACTOR_VN;
+int condition_type = CONDITIONER_XOR;
+size_t toeplitz_in = TOEPLITZ_IN, toeplitz_out = TOEPLITZ_OUT;
+double min_entropy = 0;
+int drbg_type = -1;
+int drbg_threads = 1;
+size_t drbg_reseed_bytes = DRBG_RESEED;
+int pool_mode = -1;
+int cpu_choice = CPU_AUTO;
+int memory_mode = ARENA_PAGEABLE;
+char *state_name = NULL;
+int warm_start;			/* bitbuffer_old restored, not yet streamed */
 int output_ready;
 
 /* daemon */
@@ -94,26 +173,60 @@ FILE *output = NULL;
 unsigned char bitbuffer[BUFFER_SIZE] = {0};
 unsigned char bitbuffer_old[BUFFER_SIZE] = {0};
 void **buffers;
+int stream_nbuffers;
+size_t stream_buffer_bytes;
 
 /* Counters */
+unsigned int bitacc = 0;
 unsigned int bitcounter = 0;
 unsigned int buffercounter = 0;
 
+/* Stream continuity, from the metadata */
+uint64_t next_timestamp;
+int have_timestamp;
+/* Without metadata, the samples since the first buffer against the clock */
+struct timespec clock_start;
+uint64_t clock_samples;
+unsigned long buffers_seen, overruns_seen;	/* since the last metrics write */
+unsigned long gaps_total;
+
 /* Other bits */
 AES_KEY wctx;
 EVP_CIPHER_CTX *en;
+static unsigned char ciphertext[BUFFER_SIZE + AES_BLOCK_SIZE];
 
 void usage(void) {
   fprintf(stderr,
 	  "brf_entropy, a high quality entropy source using RTL2832 based DVB-T receivers\n\n"
 	  "Usage: brf_entropy [options]\n"
 	  "\t-a Set gain (default: 1000)\n"
-	  "\t-d Device index (default: 0)\n"
+	  "\t-A Pick bit planes on the fly, keeping bias and correlation under [] (default: off)\n"
+	  "\t-B Mix output into an entropy pool, and read it blocking or nonblocking (default: off)\n"
+	  "\t-C Conditioner: xor, aes, toeplitz, sha256, sha512, blake2b or blake3 (default: xor)\n"
+	  "\t-d Device identifier, as libbladeRF takes them (default: the first found)\n"
+	  "\t-D Stretch output with a DRBG seeded from it: ctr or chacha20 (default: off)\n"
 	  "\t-e Encrypt output\n"
+	  "\t-E Estimate min-entropy every [] seconds (default: off)\n"
 	  "\t-f Set frequency to listen (default: 434MHz )\n"
-	  "\t-s Samplerate (default: 40 MHz)\n");
+	  "\t-G Step the sample rate to deliver [] bytes/s with the least CPU (default: off)\n"
+	  "\t-H Buffers in pageable, locked or huge (and locked) pages (default: pageable)\n"
+	  "\t-i Read with the stream or sync interface, sync:[] reading [] samples at a time (default: stream)\n"
+	  "\t-j DRBG threads, each with its own generator (default: 1)\n"
+	  "\t-k Instruction set for the kernels: scalar, sse4.2, avx2, avx512, or auto to benchmark (default: auto)\n"
+	  "\t-m Bit planes of each sample to debias (default: 0x3ff)\n"
+	  "\t-M Write metrics to this file every 10 seconds (default: off)\n"
+	  "\t-R Min-entropy per bit to assume when sizing hash input (default: estimate with -E, else 0.5)\n"
+	  "\t-s Samplerate (default: 40 MHz)\n"
+	  "\t-S Standby device identifier, to fail over to (default: none)\n"
+	  "\t-T Calibrate stream buffers and transfers, caching the result in this file (default: off)\n"
+	  "\t-W Save state here every 60 seconds and on exit, to start from on restart (default: off)\n"
+	  "\t-t Toeplitz conditioner block, in:out bytes, implies -C toeplitz (default: 64:32)\n"
+	  "\t-X DRBG output between reseeds, 0 reseeds every request (default: 1M)\n"
+	  "\t-x Debiasing extractor: vn, peres or elias (default: vn)\n"
+	  "\t-y Pause the stream while the pool, DRBG feed or output pipe is over high%% full, until under low%%, as high:low (default: off)\n");
   fprintf(stderr,
 	  "\t-o Output file (default: STDOUT, /var/run/rtl_entropy.fifo for daemon mode (-b))\n"
+	  "\t-P Profile bias and correlation of every bit plane, every [] seconds (default: off)\n"
 #if !(defined(__APPLE__) || defined(__FreeBSD__))
 	  "\t-p PID file (default: /var/run/rtl_entropy.pid)\n"
 	  "\t-b Daemonize\n"
@@ -126,7 +239,7 @@ void usage(void) {
 
 
 void parse_args(int argc, char ** argv) {
-  char *arg_string= "a:d:ef:g:o:p:s:u:hb";
+  char *arg_string= "a:A:B:C:d:D:eE:f:g:G:H:i:j:k:m:M:o:p:P:R:s:S:t:T:u:W:x:X:y:hb";
     
   opt = getopt(argc, argv, arg_string);
   while (opt != -1) {
@@ -135,17 +248,43 @@ void parse_args(int argc, char ** argv) {
       gain = (int)(atof(optarg) * 10);
       break;
 
+    case 'A':
+      adapt_threshold = atof(optarg);
+      break;
+
     case 'b':
       gflags_detach = 1;
       break;
       
+    case 'B':
+      pool_mode = pool_parse_mode(optarg);
+      if (pool_mode < 0)
+	suicide("Pool mode should be blocking or nonblocking, not %s", optarg);
+      break;
+
+    case 'C':
+      condition_type = conditioner_parse(optarg);
+      if (condition_type < 0)
+	suicide("Unknown conditioner %s", optarg);
+      break;
+
+    case 'D':
+      drbg_type = drbg_parse(optarg);
+      if (drbg_type < 0)
+	suicide("Unknown DRBG %s", optarg);
+      break;
+
     case 'd':
-      /* dev_index = atoi(optarg); */
+      device_id = strdup(optarg);
       break;
 
     case 'e':
       gflags_encryption = 1;
       break;
+
+    case 'E':
+      estimate_interval = atoi(optarg);
+      break;
       
     case 'f':
       frequency = (uint32_t)atofs(optarg);
@@ -154,10 +293,50 @@ void parse_args(int argc, char ** argv) {
     case 'g':
       gid = parse_group(optarg);
       break;
+
+    case 'G':
+      target_rate = atofs(optarg);
+      break;
       
     case 'h':
       usage();
       break;
+
+    case 'i':
+      if (!strncmp(optarg, "sync", 4) && (optarg[4] == '\0' || optarg[4] == ':')) {
+	sync_mode = 1;
+	if (optarg[4] == ':')
+	  sync_batch = (unsigned int)atofs(optarg + 5);
+	if (sync_batch < 1024)
+	  suicide("Sync reads should be at least 1024 samples");
+      } else if (strcmp(optarg, "stream")) {
+	suicide("Unknown interface %s", optarg);
+      }
+      break;
+
+    case 'j':
+      drbg_threads = atoi(optarg);
+      break;
+
+    case 'H':
+      memory_mode = arena_parse_memory(optarg);
+      if (memory_mode < 0)
+	suicide("Unknown memory mode %s", optarg);
+      break;
+
+    case 'k':
+      cpu_choice = cpu_parse_level(optarg);
+      if (cpu_choice < CPU_AUTO)
+	suicide("Unknown instruction set %s", optarg);
+      break;
+
+    case 'm':
+      bit_mask = (uint16_t)strtol(optarg, NULL, 0) & 0x0fff;
+      break;
+
+    case 'M':
+      metrics_name = strdup(optarg);
+      break;
       
     case 'o':
       redirect_output = 1;
@@ -171,14 +350,55 @@ void parse_args(int argc, char ** argv) {
     case 'p':
       pidfile_path = strdup(optarg);
       break;
+
+    case 'P':
+      profile_interval = atoi(optarg);
+      break;
       
+    case 'R':
+      min_entropy = atof(optarg);
+      break;
+
     case 's':
       samp_rate = (uint32_t)atofs(optarg);
       break;
+
+    case 'S':
+      standby_id = strdup(optarg);
+      break;
+
+    case 'T':
+      tune_name = strdup(optarg);
+      break;
       
+    case 't':
+      if (toeplitz_parse(optarg, &toeplitz_in, &toeplitz_out))
+	suicide("Toeplitz sizes should be in:out bytes, multiples of 8, out no more than in");
+      condition_type = CONDITIONER_TOEPLITZ;
+      break;
+
     case 'u':
       uid = parse_user(optarg, &gid);
       break;
+
+    case 'W':
+      state_name = strdup(optarg);
+      break;
+
+    case 'X':
+      drbg_reseed_bytes = (size_t)atofs(optarg);
+      break;
+
+    case 'x':
+      extract_method = extractor_parse(optarg);
+      if (extract_method < 0)
+	suicide("Unknown extractor %s", optarg);
+      break;
+
+    case 'y':
+      if (duty_parse(optarg, &duty_high, &duty_low))
+	suicide("Duty cycle should be high:low percentages, low under high");
+      break;
       
     default:
       usage();
@@ -229,162 +449,542 @@ void route_output(void) {
   }
 }
 
-static void *rx_stream_callback(struct bladerf *dev,
-				struct bladerf_stream *stream,
-				struct bladerf_metadata *meta,
-				void *samples,
-				size_t num_samples,
-				void *user_data)
+static void publish_pool(void)
 {
-  int i ,j;
-  int16_t *sample = (int16_t *)samples;
-  int ch, ch2;
-  int bufsize = num_samples/2;
-  uint8_t *ciphertext;
+  char labels[METRICS_LABELS_LEN];
+  int i;
+
+  metrics_set("pool_entropy_bits", NULL, pool_entropy(&pool));
+  metrics_set("pool_extracted_bytes_total", NULL, pool.extracted);
+  for (i = 0; i < pool.nsources; i++) {
+    snprintf(labels, sizeof(labels), "source=\"%s\"", pool.sources[i].name);
+    metrics_set("pool_mixed_bytes_total", labels, pool.sources[i].bytes);
+    metrics_set("pool_credited_bits_total", labels,
+		(double)pool.sources[i].credited / (1 << POOL_FRAC_BITS));
+  }
+}
+
+/*
+ * Saves what a restart needs to produce output straight away: the
+ * discard ring, the block being accumulated, the FIPS continuous test
+ * word, and the DRBG feed and pool.
+ */
+static void save_state(void)
+{
+  unsigned char feed[STATE_FEED_BYTES];
+  struct state st;
+  int r = 0;
+
+  if (state_begin(&st)) {
+    log_line(LOG_INFO, "WARNING: Couldn't start a state file");
+    return;
+  }
+  if (hash_loop)
+    r |= state_put(&st, "ring", hash_data_buffer, sizeof(hash_data_buffer));
+  if (output_ready || warm_start)
+    r |= state_put(&st, "block", bitbuffer_old, sizeof(bitbuffer_old));
+  r |= state_put(&st, "fips", &fipsctx.last32, sizeof(fipsctx.last32));
+  /* the records are expanded from what is there, so a short feed still fills one */
+  if (!r && drbg_type >= 0 && drbg_feed_peek(&drbg_feed, feed, sizeof(feed)) >= DRBG_SEED_LEN)
+    r = state_put(&st, "drbg_feed", feed, sizeof(feed));
+  if (!r && pool_mode >= 0)
+    r = state_put(&st, "pool", pool.words, sizeof(pool.words));
+  memset(feed, 0, sizeof(feed));
+  if (r) {
+    state_free(&st);
+    log_line(LOG_INFO, "WARNING: Couldn't build the state file");
+  } else if (state_commit(&st, state_name)) {
+    log_line(LOG_INFO, "WARNING: Couldn't write state to %s", state_name);
+  }
+}
+
+/* Picks up the last run's state, if there is one */
+static void load_state(void)
+{
+  const unsigned char *rec;
+  struct state st;
+  unsigned int last32;
+  int n = 0;
+
+  if (state_load(&st, state_name)) {
+    log_line(LOG_DEBUG, "No usable state in %s, starting cold", state_name);
+    return;
+  }
+  if ((rec = state_get(&st, "ring", sizeof(hash_data_buffer)))) {
+    memcpy(hash_data_buffer, rec, sizeof(hash_data_buffer));
+    hash_loop = 1;
+    n++;
+  }
+  if ((rec = state_get(&st, "block", sizeof(bitbuffer_old)))) {
+    memcpy(bitbuffer_old, rec, sizeof(bitbuffer_old));
+    warm_start = 1;
+    n++;
+  }
+  /*
+   * Like every record this is an expansion, not the last word tested,
+   * so the continuous run test starts over across a restart; it only
+   * spares the first word a comparison against zero
+   */
+  if ((rec = state_get(&st, "fips", sizeof(last32)))) {
+    memcpy(&last32, rec, sizeof(last32));
+    fips_init(&fipsctx, last32);
+  }
+  if (drbg_type >= 0 && (rec = state_get(&st, "drbg_feed", STATE_FEED_BYTES))) {
+    drbg_feed_add(&drbg_feed, rec, STATE_FEED_BYTES);
+    n++;
+  }
+  /* mixed in without credit, a blocking pool still waits for fresh entropy */
+  if (pool_mode >= 0 && (rec = state_get(&st, "pool", sizeof(pool.words)))) {
+    pool_mix(&pool, pool_add_source(&pool, "state"), rec, sizeof(pool.words), 0);
+    n++;
+  }
+  state_free(&st);
+  log_line(LOG_INFO, "Warm start from %s, %d records restored", state_name, n);
+}
+
+/* How full whatever output waits in is, 0 to 1, or -1 if there's no telling */
+static double reservoir_fill(void)
+{
+  double fill;
+
+  if (pool_mode >= 0)
+    return pool_entropy(&pool) / POOL_BITS;
+  if (drbg_type >= 0)
+    return (double)drbg_feed_fill(&drbg_feed) / DRBG_FEED_SIZE;
+  pthread_mutex_lock(&output_lock);
+  fill = duty_pipe_fill(output ? fileno(output) : -1);
+  pthread_mutex_unlock(&output_lock);
+  return fill;
+}
+
+/*
+ * Profile dumps, metrics file writes and state saves, called once per
+ * callback, and while paused
+ */
+static void periodic(void)
+{
+  time_t now = time(NULL);
+  uint32_t rate;
+  int ceiling;
+
+  if (profile_interval > 0 && now >= next_profile) {
+    if (profilestats.samples) {
+      bitstats_publish(&profilestats, 12);
+      if (!metrics_name)
+	bitstats_log(&profilestats, 12);
+    }
+    bitstats_reset(&profilestats);
+    next_profile = now + profile_interval;
+  }
+  /* the stream ends at the next buffer, and rx_task_run waits */
+  if (duty_high > 0 && duty_update(&duty, reservoir_fill()))
+    log_line(LOG_DEBUG, duty.paused ? "Sinks full, pausing the stream" : "Resuming the stream");
+  /* not while tune_stream is trying setups at this rate */
+  if (target_rate > 0 && !calibrate_left) {
+    ceiling = governor.ceiling;
+    rate = governor_check(&governor);
+    if (governor.ceiling < ceiling)
+      log_line(LOG_INFO, "WARNING: Samples dropped at %u Hz, not going above %u Hz",
+	       govern_rates[governor.ceiling + 1], govern_rates[governor.ceiling]);
+    if (rate) {
+      log_line(LOG_INFO, "Delivering %0.0f bytes/s for a target of %0.0f, sample rate now %u Hz",
+	       governor.output_rate, target_rate, rate);
+      samp_rate = rate;
+      retune = 1;
+    }
+  }
+  if (metrics_name && now >= next_metrics) {
+    if (pool_mode >= 0)
+      publish_pool();
+    metrics_set("arena_heap_allocs_total", NULL, arena_heap_allocs());
+    metrics_set("memory_huge_bytes", NULL, arena_huge_bytes());
+    metrics_set("memory_locked_bytes", NULL, arena_locked_bytes());
+    if (buffers_seen)
+      metrics_set("overrun_rate", NULL, (double)overruns_seen / buffers_seen);
+    buffers_seen = overruns_seen = 0;
+    if (duty_high > 0)
+      duty_publish(&duty);
+    if (metrics_write(metrics_name))
+      log_line(LOG_DEBUG, "WARNING: Couldn't write metrics to %s", metrics_name);
+    next_metrics = now + METRICS_INTERVAL;
+  }
+  /* here, between buffers, the block and ring are consistent */
+  if (state_name && now >= next_state) {
+    if (next_state)
+      save_state();
+    next_state = now + STATE_INTERVAL;
+  }
+}
+
+static void report_estimate(void)
+{
+  static unsigned long last_run = 0;
+  struct entropy_estimate e;
+
+  if (estimator_get(&estimator, &e) <= last_run)
+    return;
+  last_run = e.runs;
+  metrics_set("min_entropy_bits", "per=\"sample\"", e.h_sample);
+  metrics_set("min_entropy_bits", "per=\"sampled_bit\"", e.h_bit);
+  if (e.h_output >= 0) {
+    metrics_set("min_entropy_bits", "per=\"output_bit\"", e.h_output);
+    estimated_h = e.h_output;
+    /* size hash input to the estimate, unless told what to assume */
+    if (condition_type > CONDITIONER_TOEPLITZ && min_entropy <= 0)
+      conditioner_set_entropy(&conditioner, e.h_output);
+  }
+  if (e.h_output < 0)
+    log_line(LOG_INFO, "Min-entropy: %0.3f bits/sample, %0.3f bits/sampled bit",
+	     e.h_sample, e.h_bit);
+  else
+    log_line(LOG_INFO, "Min-entropy: %0.3f bits/sample, %0.3f bits/sampled bit, %0.3f bits/output bit",
+	     e.h_sample, e.h_bit, e.h_output);
+  log_line(LOG_DEBUG, "  MCV %0.3f, t-Tuple %0.3f, Collision %0.3f, Markov %0.3f, Compression %0.3f",
+	   e.mcv, e.t_tuple, e.collision, e.markov, e.compression);
+}
+
+/* Write to the output, from any thread */
+static void write_output(const unsigned char *buf, size_t len)
+{
+  struct timespec start, end;
+
+  if (target_rate > 0)
+    clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(&output_lock);
+  /* closed, when the reader went away */
+  if (!output) {
+    pthread_mutex_unlock(&output_lock);
+    return;
+  }
+  fwrite(buf,sizeof(buf[0]),len,output);
+  pthread_mutex_unlock(&output_lock);
+  metrics_add("output_bytes_total", NULL, len);
+  if (target_rate > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    governor_output(&governor, len, (end.tv_sec - start.tv_sec) * 1000000000ULL +
+		    end.tv_nsec - start.tv_nsec);
+  }
+}
+
+/* Write out, or with -D, hand to the DRBGs */
+static void deliver_output(const unsigned char *buf, size_t len)
+{
+  if (drbg_type >= 0) {
+    drbg_feed_add(&drbg_feed, buf, len);
+    metrics_add("drbg_seed_bytes_total", NULL, len);
+    return;
+  }
+  write_output(buf, len);
+}
+
+/* Min-entropy per bit of conditioned output, to credit the pool with */
+static double output_entropy_rate(void)
+{
+  double h;
+
+  h = min_entropy > 0 ? min_entropy : estimated_h >= 0 ? estimated_h : CONDITION_DEFAULT_H;
+  if (condition_type > CONDITIONER_TOEPLITZ)
+    return 1.0;	/* hash input is sized for full entropy */
+  /* less the leftover hash margin, as the hashes size their input with */
+  if (condition_type == CONDITIONER_TOEPLITZ)
+    h = (h * toeplitz_in * 8 - CONDITION_MARGIN_BITS) / (toeplitz_out * 8);
+  return h > 1.0 ? 1.0 : h < 0.0 ? 0.0 : h;
+}
+
+/* Deliver a conditioned block, or with -B, mix it into the pool */
+static void emit_output(const unsigned char *buf, size_t len)
+{
+  if (pool_mode >= 0) {
+    pool_mix(&pool, pool_source, buf, len, len * 8 * output_entropy_rate());
+    return;
+  }
+  deliver_output(buf, len);
+}
+
+/* Vet a full bitbuffer, and write it out if it passes */
+static void process_block(void)
+{
+  unsigned int j;
   int fips_result;
   int aes_len;
-  uint32_t out_block_size = MAXIMAL_BUF_LENGTH;
-  
-  for(i=0; i<num_samples * 2; i++) {
-    for (j=0; j < 10; j+= 2) {
-      ch = (*sample >> j) & 0x01;
-      ch2 = (*sample >> (j+1)) & 0x01;
-      if (ch != ch2) {
-	if (ch) {
-	  /* store a 1 in our bitbuffer */
-	  bitbuffer[buffercounter] |= 1 << bitcounter;
-	} /* else, leave the buffer alone, it's already 0 at this bit */
-	bitcounter++;
-      } else {
-	if (ch) {
-	  store_hash_data(1);
-	} else {
-	  store_hash_data(0);
-	}
+  size_t len;
+
+  /* We have 2500 bytes of entropy 
+     Can now send it to FIPS! */
+  /* put_bits() tested it byte by byte, on the way in */
+  fips_result = fips_end_block(&fipsctx);
+  metrics_add("fips_blocks_total", fips_result ? "result=\"fail\"" : "result=\"pass\"", 1);
+  if (!fips_result) {
+    if (gflags_encryption != 0) {
+      if (hash_loop) {
+	/*   /\* Get a key from disacarded bits *\/ */
+	SHA512(hash_data_buffer, sizeof(hash_data_buffer), hash_buffer);
+	/* use key to encrypt output */
+	/* AES_set_encrypt_key(hash_buffer, 128, &wctx); */
+	/* AES_encrypt(bitbuffer, bitbuffer_old, &wctx); */
+	aes_init(hash_buffer, sizeof(hash_buffer), en);
+	aes_len = aes_encrypt(en, bitbuffer, sizeof(bitbuffer), ciphertext);
+	/* yay, send it to the output! */
+	emit_output(ciphertext, aes_len);
+	/* the estimate is of the plaintext, ciphertext always looks good */
+	if (estimate_interval > 0)
+	  estimator_feed_output(&estimator, bitbuffer, BUFFER_SIZE);
       }
-      
-      /* is byte full? */
-      if (bitcounter >= sizeof(bitbuffer[0]) * 8) {
-	buffercounter++;
-	bitcounter = 0;
+    } else if (condition_type != CONDITIONER_XOR) {
+      /* Toeplitz seeds its matrix once, from discarded bits */
+      if (!conditioner.seeded && hash_loop)
+	conditioner_seed(&conditioner, hash_data_buffer, sizeof(hash_data_buffer));
+      if (conditioner.seeded) {
+	/* the estimate is of what goes in, what comes out always looks good */
+	if (estimate_interval > 0)
+	  estimator_feed_output(&estimator, bitbuffer, BUFFER_SIZE);
+	len = conditioner_absorb(&conditioner, bitbuffer, BUFFER_SIZE, condition_buffer);
+	emit_output(condition_buffer, len);
       }
-      
-      /* is buffer full? */
-      if (buffercounter >= BUFFER_SIZE) {
-	/* We have 2500 bytes of entropy 
-	   Can now send it to FIPS! */
-	fips_result = fips_run_rng_test(&fipsctx, &bitbuffer);
-	if (!fips_result) {
-	  if (gflags_encryption != 0) {
-	    if (hash_loop) {
-	      /*   /\* Get a key from disacarded bits *\/ */
-	      SHA512(hash_data_buffer, sizeof(hash_data_buffer), hash_buffer);
-	      /* use key to encrypt output */
-	      /* AES_set_encrypt_key(hash_buffer, 128, &wctx); */
-	      /* AES_encrypt(bitbuffer, bitbuffer_old, &wctx); */
-	      aes_init(hash_buffer, sizeof(hash_buffer), en);
-	      aes_len = sizeof(bitbuffer);
-	      ciphertext = aes_encrypt(en, bitbuffer, &aes_len);
-	      /* yay, send it to the output! */
-	      fwrite(ciphertext,sizeof(ciphertext[0]),aes_len,output);
-	      /* Clean up */
-	      free(ciphertext);
-	      EVP_CIPHER_CTX_cleanup(en);
-	    }
-	  } else {
-	    /* xor with old data */
-	    for (buffercounter = 0; buffercounter < BUFFER_SIZE; buffercounter++) {
-	      bitbuffer[buffercounter] = bitbuffer[buffercounter] ^ bitbuffer_old[buffercounter];
-	    }
-	    if (output_ready > 2) {
-	    fwrite(&bitbuffer_old,sizeof(bitbuffer_old[0]),BUFFER_SIZE,output);
-	    }
-	    /* swap old data */
-	    memcpy(bitbuffer_old,bitbuffer,BUFFER_SIZE);
-	  }
-	  output_ready++;
-	} else {   /* FIPS test failed */
-	  for (j=0; j< N_FIPS_TESTS; j++) {
-	    if (fips_result & fips_test_mask[j]) {
-	      if (!gflags_detach)
-		log_line(LOG_DEBUG, "Failed: %s", fips_test_names[j]);
-	    }
-	  }
-	}
-	/* reset buffers, and the counter */
-	/* memset(bitbuffer_old,0,sizeof(bitbuffer_old)); */
-	memset(bitbuffer,0,sizeof(bitbuffer));
-	buffercounter = 0;
+    } else {
+      if (output_ready > 2) {
+	emit_output(bitbuffer_old, BUFFER_SIZE);
+	if (estimate_interval > 0)
+	  estimator_feed_output(&estimator, bitbuffer_old, BUFFER_SIZE);
+      }
+      /* xor the new data into the old, which is what goes out next time */
+      cpu_xor(bitbuffer_old, bitbuffer, BUFFER_SIZE);
+    }
+    output_ready++;
+  } else {   /* FIPS test failed */
+    for (j=0; j< N_FIPS_TESTS; j++) {
+      if (fips_result & fips_test_mask[j]) {
+	if (!gflags_detach)
+	  log_line(LOG_DEBUG, "Failed: %s", fips_test_names[j]);
       }
     }
-    sample ++;
   }
+}
 
-  
+/*
+ * Append nbits debiased bits, LSB first, handing each full bitbuffer
+ * to process_block().  Bits gather in bitacc, and each byte is stored
+ * and FIPS tested once, as it completes.
+ */
+static inline void put_bits(void *arg, unsigned int bits, int nbits)
+{
+  unsigned int byte;
+
+  bitacc |= bits << bitcounter;
+  bitcounter += nbits;
+  while (bitcounter >= 8) {
+    byte = bitacc & 0xff;
+    bitacc >>= 8;
+    bitcounter -= 8;
+    bitbuffer[buffercounter++] = byte;
+    fips_add_byte(&fipsctx, byte);
+
+    /* is buffer full? */
+    if (buffercounter >= BUFFER_SIZE) {
+      process_block();
+      buffercounter = 0;
+    }
+  }
+}
+
+static inline void discard_bits(void *arg, unsigned int bits, int nbits)
+{
+  store_hash_bits(bits, nbits);
+}
+
+/* Extractor callbacks, there is only the one stream to hand bits to */
+static void emit_bit(void *arg, int bit)
+{
+  put_bits(arg, bit, 1);
+}
+
+static void discard_bit(void *arg, int bit)
+{
+  store_hash_data(bit);
+}
+
+EXTRACT_VN_KERNEL(extract_vn_s16, int16_t, void, put_bits, discard_bits)
+EXTRACT_RAW_KERNEL(extract_raw_s16, int16_t)
 
+/*
+ * Without metadata, samples are missing once fewer have arrived since
+ * the first buffer than the sample rate says there should be, by more
+ * than every stream buffer could hold while late.  Returns 1 for a
+ * gap, with the samples lost beyond that, which then count as seen.
+ */
+static int check_clock(size_t num_samples, uint64_t *lost)
+{
+  struct timespec now;
+  double expected, slack;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (!have_timestamp) {
+    clock_start = now;
+    clock_samples = 0;
+    have_timestamp = 1;
+    return 0;
+  }
+  clock_samples += num_samples;
+  expected = ((now.tv_sec - clock_start.tv_sec) + (now.tv_nsec - clock_start.tv_nsec) / 1e9) *
+    (actual_samp_rate ? (double)actual_samp_rate : samp_rate);
+  slack = (double)(stream_nbuffers + 1) * num_samples;
+  if (expected - clock_samples <= slack)
+    return 0;
+  *lost = (uint64_t)(expected - clock_samples - slack);
+  clock_samples += *lost;
+  return 1;
+}
+
+/*
+ * Checks a buffer's metadata against the one before.  After an overrun
+ * or a timestamp gap, the partial FIPS block and the extractor's
+ * waiting bits straddle the gap, so they're dropped.  libbladeRF only
+ * fills in metadata for the _META formats, which the stream interface
+ * doesn't use; without it, the samples are checked against the clock.
+ */
+static void check_continuity(const struct bladerf_metadata *meta, size_t num_samples)
+{
+  uint64_t lost = 0;
+  int gap;
+
+  buffers_seen++;
+  metrics_add("stream_buffers_total", NULL, 1);
+  if (!meta || (!meta->timestamp && !meta->status)) {
+    gap = check_clock(num_samples, &lost);
+  } else {
+    gap = (meta->status & BLADERF_META_STATUS_OVERRUN) != 0;
+    if (have_timestamp && meta->timestamp != next_timestamp) {
+      gap = 1;
+      if (meta->timestamp > next_timestamp)
+	lost = meta->timestamp - next_timestamp;
+    }
+    next_timestamp = meta->timestamp + num_samples;
+    have_timestamp = 1;
+  }
+  if (!gap)
+    return;
+
+  overruns_seen++;
+  gaps_total++;
+  /* tune_stream expects overruns from the setups too small to keep up */
+  if (target_rate > 0 && !calibrate_left)
+    governor_drop(&governor, 1);
+  metrics_add("overruns_total", NULL, 1);
+  metrics_add("lost_samples_total", NULL, lost);
+  bitacc = 0;
+  bitcounter = 0;
+  buffercounter = 0;
+  fips_end_block(&fipsctx);	/* drops the partial block */
+  extractor_reset(&extractor);
+  output_ready = 0;
+}
+
+/*
+ * Runs a buffer of samples through the pipeline.  Returns 1 when it
+ * ends a calibration window.
+ */
+static int process_samples(int16_t *sample, size_t num_samples,
+			   const struct bladerf_metadata *meta)
+{
+  struct timespec start, end;
+
+  if (warmup_left) {
+    warmup_left--;
+    return 0;
+  }
+  if (calibrate_left) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!calibrate_first.tv_sec && !calibrate_first.tv_nsec)
+      calibrate_first = start;
+    calibrate_last = start;
+  }
+  stream_buffers++;
+  metrics_add("samples_total", NULL, num_samples);
+  check_continuity(meta, num_samples);
+  if (estimate_interval > 0) {
+    estimator_feed_s16(&estimator, sample, num_samples * 2);
+    report_estimate();
+  }
+
+  if (adapt_threshold > 0) {
+    bitstats_add_s16(&planestats, sample, num_samples * 2);
+    if (planestats.samples >= ADAPT_SAMPLES &&
+	extract_plan_adapt(&plan, &planestats, 0x0fff, adapt_threshold)) {
+      log_line(LOG_INFO, "Bit planes now 0x%03x, %d pairs", plan.mask, plan.npairs);
+      metrics_set("bit_mask", NULL, plan.mask);
+      if (estimate_interval > 0)
+	estimator_set_mask(&estimator, plan.mask);
+    }
+  }
+  if (profile_interval > 0)
+    bitstats_add_s16(&profilestats, sample, num_samples * 2);
+  periodic();
   
+  if (extract_method == EXTRACTOR_VN)
+    extract_vn_s16(NULL, &plan, sample, num_samples * 2);
+  else
+    extract_raw_s16(&extractor, &plan, sample, num_samples * 2);
+
+  if (calibrate_left) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    calibrate_busy += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (!--calibrate_left)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Whether to go on reading.  A detached daemon whose reader went away
+ * waits for the next one instead of stopping.
+ */
+static int keep_reading(void)
+{
   if (!do_exit) {
-    return samples;
+    return 1;
   } else {
     if ( (do_exit == SIGPIPE) && gflags_detach) {
       log_line(LOG_DEBUG, "Reader went away, closing FIFO");
+      pthread_mutex_lock(&output_lock);
       fclose(output);
+      output = NULL;
       log_line(LOG_DEBUG, "Waiting for a Reader...");
       output = fopen(DEFAULT_OUT_FILE,"w");
+      do_exit = 0;
+      pthread_mutex_unlock(&output_lock);
       if (output == NULL) {
-	return NULL;
+	return 0;
       }
-      return samples;
+      return 1;
     } else {
-      return NULL;
+      return 0;
     }
   }
 }
 
-void * rx_task_run(void *inputs) {
-  int r;
-  r = bladerf_stream(rx_stream, BLADERF_MODULE_RX);
-  if (r < 0) {
-    log_line(LOG_DEBUG,"RX Stream failure: %s\n",bladerf_strerror(r));
-  }
-  return NULL;
+static void *rx_stream_callback(struct bladerf *dev,
+				struct bladerf_stream *stream,
+				struct bladerf_metadata *meta,
+				void *samples,
+				size_t num_samples,
+				void *user_data)
+{
+  if (process_samples(samples, num_samples, meta) || retune ||
+      (duty.paused && !calibrate_left) || !keep_reading())
+    return NULL;
+  return samples;
 }
 
-
-
-int main(int argc, char **argv) {
-  struct sigaction sigact;
-  int samples_per_buffer = 65536;
+/* Opens and tunes the device, returns 0 on success */
+static int device_open(void)
+{
   int r;
 
-  parse_args(argc, argv);
-  
-  if (gflags_detach) {
-#if !(defined(__APPLE__) || defined(__FreeBSD__))
-    daemonize();
-#endif
-  }
-  log_line(LOG_INFO,"Options parsed, continuing.");
-  
-#if !(defined(__APPLE__) || defined(__FreeBSD__))
-  if (uid != -1 && gid != -1)
-    drop_privs(uid, gid);
-#endif
-
-  /* Setup Signal handlers */
-  sigact.sa_handler = sighandler;
-  sigemptyset(&sigact.sa_mask);
-  sigact.sa_flags = 0;
-  sigaction(SIGINT, &sigact, NULL);
-  sigaction(SIGTERM, &sigact, NULL);
-  sigaction(SIGQUIT, &sigact, NULL);
-  sigaction(SIGPIPE, &sigact, NULL);
-  
   /* Open device */
-  r = bladerf_open(&dev, NULL);
+  r = bladerf_open(&dev, device_id);
   if (r < 0) {
     log_line(LOG_DEBUG,"Failed to open device: %s", bladerf_strerror(r));
-    suicide("");
+    return r;
   }
   
   /* Is FPGA ready? */
@@ -392,10 +992,11 @@ int main(int argc, char **argv) {
   if (r < 0) {
     log_line(LOG_DEBUG, "Failed to determine if FPGA is loaded: %s",
 	     bladerf_strerror(r));
-    exit(EXIT_FAILURE);
+    goto fail;
   } else if (r == 0) {
     log_line(LOG_DEBUG, "FPGA is not loaded. Aborting.");
-    exit(EXIT_FAILURE);
+    r = -1;
+    goto fail;
   }
   log_line(LOG_DEBUG, "FPGA Loaded");
 
@@ -406,7 +1007,7 @@ int main(int argc, char **argv) {
   r = bladerf_set_sample_rate(dev, BLADERF_MODULE_RX, samp_rate, &actual_samp_rate);
   if (r < 0) {
     log_line(LOG_DEBUG,"Failed to set sample rate: %s", bladerf_strerror(r));
-    exit(EXIT_FAILURE);
+    goto fail;
   }
   log_line(LOG_DEBUG, "Sample rate set to %d", actual_samp_rate);
 
@@ -414,20 +1015,20 @@ int main(int argc, char **argv) {
   r = bladerf_set_frequency(dev, BLADERF_MODULE_RX, frequency);
   if (r < 0) {
     log_line(LOG_DEBUG,"Failed to set frequency: %s", bladerf_strerror(r));
-    exit(EXIT_FAILURE);
+    goto fail;
   }  
   
   /* Set gain */
   r = bladerf_set_rxvga1(dev, gain);
   if (r < 0) {
     log_line(LOG_DEBUG,"Failed to set pre gain: %s",bladerf_strerror(r));
-    exit(EXIT_FAILURE);
+    goto fail;
   }  
 
   r = bladerf_set_rxvga2(dev, gain);
   if (r < 0) {
     log_line(LOG_DEBUG,"Failed to set post gain: %s", bladerf_strerror(r));
-    exit(EXIT_FAILURE);
+    goto fail;
   }  
   
   r = bladerf_set_lpf_mode(dev, BLADERF_MODULE_RX, BLADERF_LPF_BYPASSED);
@@ -440,51 +1041,514 @@ int main(int argc, char **argv) {
   if (r < 0) {
     log_line(LOG_DEBUG, "Failed to enable RX module: %s",
 	     bladerf_strerror(r));
-    exit(EXIT_FAILURE);
+    goto fail;
   } else {
     log_line(LOG_DEBUG,"Enabled RX module");
   }
  
-  /*  Initialise the receive stream */
+  return 0;
+
+ fail:
+  bladerf_close(dev);
+  dev = NULL;
+  return r;
+}
+
+/*  Initialise the receive stream, returns 0 on success */
+static int stream_setup(int samples, int nbuffers, int transfers)
+{
+  int i, r;
 
   r = bladerf_init_stream(&rx_stream,
 			  dev,
 			  rx_stream_callback,
 			  &buffers,
-			  32,
+			  nbuffers,
 			  BLADERF_FORMAT_SC16_Q11,
-			  samples_per_buffer,
-			  32,
+			  samples,
+			  transfers,
 			  NULL);
+  if (r < 0) {
+    log_line(LOG_DEBUG, "Failed to set up the RX stream: %s", bladerf_strerror(r));
+    rx_stream = NULL;
+    return r;
+  }
+  /* libbladeRF allocates these, so they can be locked but not made huge */
+  stream_nbuffers = nbuffers;
+  stream_buffer_bytes = (size_t)samples * 2 * sizeof(int16_t);
+  for (i = 0; i < stream_nbuffers; i++)
+    arena_lock(buffers[i], stream_buffer_bytes);
+  return r;
+}
+
+static void stream_teardown(void)
+{
+  int i;
+
+  for (i = 0; i < stream_nbuffers; i++)
+    arena_unlock(buffers[i], stream_buffer_bytes);
+  stream_nbuffers = 0;
+  bladerf_deinit_stream(rx_stream);
+  rx_stream = NULL;
+}
+
+static void device_close(void)
+{
+  if (rx_stream)
+    stream_teardown();
+  bladerf_enable_module(dev, BLADERF_MODULE_RX, false);
+  bladerf_close(dev);
+  dev = NULL;
+}
+
+/* Runs the pipeline over sync batches as the RX thread fills them */
+static void *sync_worker_run(void *arg)
+{
+  struct sync_buffer *b;
+  int stop;
+
+  for (;;) {
+    pthread_mutex_lock(&sync_lock);
+    while (sync_tail == sync_head && !sync_done)
+      pthread_cond_wait(&sync_cond, &sync_lock);
+    if (sync_tail == sync_head) {
+      pthread_mutex_unlock(&sync_lock);
+      break;
+    }
+    pthread_mutex_unlock(&sync_lock);
+
+    b = &sync_pool[sync_tail % SYNC_POOL_BUFFERS];
+    process_samples(b->samples, b->count, &b->meta);
+    stop = retune || duty.paused || !keep_reading();
+
+    pthread_mutex_lock(&sync_lock);
+    sync_tail++;
+    if (stop)
+      sync_done = 1;
+    pthread_cond_broadcast(&sync_cond);
+    pthread_mutex_unlock(&sync_lock);
+    if (stop)
+      break;
+  }
+  return NULL;
+}
+
+/*
+ * Reads with the sync interface until told to stop, or a read fails.
+ * Batches of sync_batch samples go into our own pool, whatever size
+ * libbladeRF's USB transfers are, and a second thread runs the
+ * pipeline over them, so a slow block doesn't hold up the next read.
+ * Returns 0, or the libbladeRF error.
+ */
+static int sync_stream(void)
+{
+  struct sync_buffer *b;
+  pthread_t worker;
+  int16_t *samples;
+  int i, r, done;
+
+  /* one mapping, so -H huge can back it with huge pages */
+  if (!sync_pool[0].samples) {
+    samples = arena_map((size_t)SYNC_POOL_BUFFERS * sync_batch * 2 * sizeof(int16_t));
+    if (samples == NULL)
+      suicide("Couldn't allocate the sync buffers");
+    for (i = 0; i < SYNC_POOL_BUFFERS; i++)
+      sync_pool[i].samples = samples + (size_t)i * sync_batch * 2;
+  }
+
+  /* the sync interface is set up with RX off */
+  bladerf_enable_module(dev, BLADERF_MODULE_RX, false);
+  r = bladerf_sync_config(dev, BLADERF_MODULE_RX, BLADERF_FORMAT_SC16_Q11_META,
+			  num_buffers, samples_per_buffer, num_transfers, SYNC_TIMEOUT_MS);
+  if (r < 0) {
+    log_line(LOG_DEBUG, "Failed to set up sync RX: %s", bladerf_strerror(r));
+    return r;
+  }
+  r = bladerf_enable_module(dev, BLADERF_MODULE_RX, true);
+  if (r < 0) {
+    log_line(LOG_DEBUG, "Failed to enable RX module: %s", bladerf_strerror(r));
+    return r;
+  }
+
+  sync_head = sync_tail = 0;
+  sync_done = 0;
+  if (pthread_create(&worker, NULL, sync_worker_run, NULL)) {
+    log_line(LOG_DEBUG, "pthread_create() failed");
+    return -1;
+  }
+  while (!do_exit || (do_exit == SIGPIPE && gflags_detach)) {
+    pthread_mutex_lock(&sync_lock);
+    while (sync_head - sync_tail == SYNC_POOL_BUFFERS && !sync_done)
+      pthread_cond_wait(&sync_cond, &sync_lock);
+    done = sync_done;
+    pthread_mutex_unlock(&sync_lock);
+    if (done)
+      break;
+
+    b = &sync_pool[sync_head % SYNC_POOL_BUFFERS];
+    memset(&b->meta, 0, sizeof(b->meta));
+    b->meta.flags = BLADERF_META_FLAG_RX_NOW;
+    r = bladerf_sync_rx(dev, b->samples, sync_batch, &b->meta, SYNC_TIMEOUT_MS);
+    if (r < 0)
+      break;
+    b->count = b->meta.actual_count;
+
+    pthread_mutex_lock(&sync_lock);
+    sync_head++;
+    pthread_cond_broadcast(&sync_cond);
+    pthread_mutex_unlock(&sync_lock);
+  }
+
+  pthread_mutex_lock(&sync_lock);
+  sync_done = 1;
+  pthread_cond_broadcast(&sync_cond);
+  pthread_mutex_unlock(&sync_lock);
+  pthread_join(worker, NULL);
+  return r;
+}
+
+/*
+ * With the stream ended for a pause, turns RX off until the sinks have
+ * room, then sets it up again.  Returns 0, or the libbladeRF error.
+ */
+static int stream_pause(void)
+{
+  int r;
+
+  log_line(LOG_DEBUG, "Stream paused");
+  if (rx_stream)
+    stream_teardown();
+  bladerf_enable_module(dev, BLADERF_MODULE_RX, false);
+  while (duty.paused && !do_exit) {
+    usleep(100000);
+    periodic();
+  }
+  /* sync_stream turns RX on itself */
+  if (sync_mode)
+    r = 0;
+  else if ((r = bladerf_enable_module(dev, BLADERF_MODULE_RX, true)) >= 0)
+    r = stream_setup(samples_per_buffer, num_buffers, num_transfers);
+  have_timestamp = 0;
+  warmup_left = DUTY_WARMUP_BUFFERS;
+  return r;
+}
+
+/* Stream setups to calibrate, from the least latency up */
+static const struct { int samples, transfers; } tune_candidates[] = {
+  { 4096, 4 }, { 8192, 4 }, { 8192, 8 }, { 16384, 8 },
+  { 16384, 16 }, { 32768, 16 }, { 65536, 16 }, { 65536, 32 }
+};
+#define N_TUNE_CANDIDATES (int)(sizeof(tune_candidates) / sizeof(tune_candidates[0]))
+
+/*
+ * Streams for a calibration window with one setup, through the whole
+ * pipeline.  Returns 1 if it kept up: no overruns, the samples from
+ * the first buffer to the last at least TUNE_DELIVERED of what the
+ * clock says the rate gives, and the callback busy for less than
+ * TUNE_BUSY of each buffer's worth of time.
+ */
+static int calibrate_stream(int samples, int transfers)
+{
+  double buffer_seconds, busy, elapsed, delivered;
+  unsigned long window, gaps;
+  int r;
+
+  if (stream_setup(samples, 2 * transfers, transfers) < 0)
+    return 0;
+  buffer_seconds = (double)samples / (actual_samp_rate ? (double)actual_samp_rate : samp_rate);
+  window = TUNE_SECONDS / buffer_seconds;
+  if (window < TUNE_MIN_BUFFERS)
+    window = TUNE_MIN_BUFFERS;
+  calibrate_left = window;
+  calibrate_busy = 0;
+  memset(&calibrate_first, 0, sizeof(calibrate_first));
+  have_timestamp = 0;
+  gaps = gaps_total;
+  r = bladerf_stream(rx_stream, BLADERF_MODULE_RX);
+  stream_teardown();
+  if (r < 0 || calibrate_left) {
+    calibrate_left = 0;
+    return 0;
+  }
+  busy = calibrate_busy / window / buffer_seconds;
+  /* drops show here even when they fit in the stream's slack */
+  elapsed = (calibrate_last.tv_sec - calibrate_first.tv_sec) +
+    (calibrate_last.tv_nsec - calibrate_first.tv_nsec) / 1e9;
+  delivered = elapsed > 0 ? (window - 1) * buffer_seconds / elapsed : 1;
+  log_line(LOG_DEBUG, "  %d samples x %d transfers: %lu overruns, %0.1f%% delivered, callback %0.0f%% busy",
+	   samples, transfers, gaps_total - gaps, delivered * 100, busy * 100);
+  return gaps_total == gaps && delivered >= TUNE_DELIVERED && busy < TUNE_BUSY;
+}
+
+/*
+ * Picks the stream setup for this host, device and sample rate, from
+ * the cache, or by calibrating each candidate in turn and caching the
+ * first that keeps up.
+ */
+static void tune_stream(void)
+{
+  char serial[BLADERF_SERIAL_LENGTH] = "", host[64] = "", key[160], value[64];
+  int i, samples, nbuffers, transfers, kept_up = 1;
+
+  bladerf_get_serial(dev, serial);
+  if (!strcmp(serial, tuned_serial))
+    return;
+  gethostname(host, sizeof(host) - 1);
+  snprintf(key, sizeof(key), "%s/%s/%u", host, serial, samp_rate);
+  if (!cache_lookup(tune_name, key, value, sizeof(value)) &&
+      sscanf(value, "%d %d %d", &samples, &nbuffers, &transfers) == 3) {
+    log_line(LOG_DEBUG, "Stream setup for %s from %s", key, tune_name);
+  } else {
+    log_line(LOG_INFO, "Calibrating the stream setup for %s", key);
+    for (i = 0; i < N_TUNE_CANDIDATES && !do_exit; i++)
+      if (calibrate_stream(tune_candidates[i].samples, tune_candidates[i].transfers))
+	break;
+    if (do_exit)
+      return;
+    if (i == N_TUNE_CANDIDATES) {
+      log_line(LOG_INFO, "WARNING: No stream setup kept up, using the largest");
+      kept_up = 0;
+      i--;
+    }
+    samples = tune_candidates[i].samples;
+    transfers = tune_candidates[i].transfers;
+    nbuffers = 2 * transfers;
+    snprintf(value, sizeof(value), "%d %d %d", samples, nbuffers, transfers);
+    /* don't remember a bad day */
+    if (kept_up && cache_store(tune_name, key, value))
+      log_line(LOG_INFO, "WARNING: Couldn't save the stream setup to %s", tune_name);
+  }
+  samples_per_buffer = samples;
+  num_buffers = nbuffers;
+  num_transfers = transfers;
+  snprintf(tuned_serial, sizeof(tuned_serial), "%s", serial);
+  log_line(LOG_INFO, "Streaming %d samples per buffer, %d buffers, %d transfers",
+	   samples_per_buffer, num_buffers, num_transfers);
+  metrics_set("stream_samples_per_buffer", NULL, samples_per_buffer);
+  metrics_set("stream_num_buffers", NULL, num_buffers);
+  metrics_set("stream_num_transfers", NULL, num_transfers);
+}
+
+/*
+ * Streams until told to stop.  Whatever else ends a stream (errors,
+ * including libbladeRF's transfer timeouts on a stall), the device is
+ * closed, re-opened and re-tuned after a backoff that doubles up to
+ * DEVICE_RETRY_MAX.  After DEVICE_FAILOVER_AFTER failures in a row
+ * the standby, if there is one, swaps places with it.
+ */
+void * rx_task_run(void *inputs) {
+  char labels[METRICS_LABELS_LEN], *swap;
+  const char *why;
+  int backoff = DEVICE_RETRY_MIN, failures = 0;
+  int r, wait;
+
+  while (!do_exit) {
+    if (device_open() < 0) {
+      why = "open";
+    } else if (tune_name && (tune_stream(), do_exit)) {
+      device_close();
+      break;
+    } else if (!sync_mode && stream_setup(samples_per_buffer, num_buffers, num_transfers) < 0) {
+      device_close();
+      why = "stream";
+    } else {
+      metrics_set("device_up", NULL, 1);
+      log_line(LOG_DEBUG, "Reading samples!");
+      stream_buffers = 0;
+      have_timestamp = 0;
+      /*
+       * the XOR path holds back two blocks; a warm start's restored one
+       * goes out with the first new one XORed in, never on its own
+       */
+      output_ready = warm_start ? 2 : 0;
+      warm_start = 0;
+      do {
+	if (sync_mode)
+	  r = sync_stream();
+	else
+	  r = bladerf_stream(rx_stream, BLADERF_MODULE_RX);
+      } while (r >= 0 && duty.paused && !do_exit && (r = stream_pause()) >= 0 && !do_exit);
+      if (r < 0) {
+	log_line(LOG_DEBUG,"RX Stream failure: %s\n",bladerf_strerror(r));
+      }
+      device_close();
+      metrics_set("device_up", NULL, 0);
+      if (do_exit)
+	break;
+      /* re-opened at the new rate, and re-tuned for it with -T */
+      if (retune) {
+	retune = 0;
+	tuned_serial[0] = '\0';
+	continue;
+      }
+      why = r < 0 ? "error" : "lost";
+      if (target_rate > 0)
+	governor_drop(&governor, GOVERN_DROPS);
+      /* it was working, so this is the first failure */
+      if (stream_buffers) {
+	failures = 0;
+	backoff = DEVICE_RETRY_MIN;
+      }
+    }
+    snprintf(labels, sizeof(labels), "reason=\"%s\"", why);
+    metrics_add("device_failures_total", labels, 1);
+    log_line(LOG_INFO, "WARNING: Device %s %s", device_id ? device_id : "(first found)", why);
+    /* a standby gets tried straight away */
+    if (++failures >= DEVICE_FAILOVER_AFTER && standby_id) {
+      log_line(LOG_INFO, "WARNING: Failing over to standby device %s", standby_id);
+      metrics_add("device_failovers_total", NULL, 1);
+      swap = device_id;
+      device_id = standby_id;
+      standby_id = swap;
+      failures = 0;
+      backoff = DEVICE_RETRY_MIN;
+      continue;
+    }
+    log_line(LOG_DEBUG, "Re-opening device in %d s", backoff);
+    for (wait = 0; wait < backoff * 10 && !do_exit; wait++)
+      usleep(100000);
+    backoff = backoff * 2 > DEVICE_RETRY_MAX ? DEVICE_RETRY_MAX : backoff * 2;
+  }
+  return NULL;
+}
+
+
+
+int main(int argc, char **argv) {
+  struct sigaction sigact;
+  char cpu_report[128];
+  int r;
+
+  parse_args(argc, argv);
+  
+  if (gflags_detach) {
+#if !(defined(__APPLE__) || defined(__FreeBSD__))
+    daemonize();
+#endif
+  }
+  log_line(LOG_INFO,"Options parsed, continuing.");
+  
+#if !(defined(__APPLE__) || defined(__FreeBSD__))
+  if (uid != -1 && gid != -1)
+    drop_privs(uid, gid);
+#endif
+
+  /* Setup Signal handlers */
+  sigact.sa_handler = sighandler;
+  sigemptyset(&sigact.sa_mask);
+  sigact.sa_flags = 0;
+  sigaction(SIGINT, &sigact, NULL);
+  sigaction(SIGTERM, &sigact, NULL);
+  sigaction(SIGQUIT, &sigact, NULL);
+  sigaction(SIGPIPE, &sigact, NULL);
+  
+  /* before anything sets up a kernel */
+  cpu_select(cpu_choice, cpu_report, sizeof(cpu_report));
+  log_line(LOG_INFO, "%s", cpu_report);
+  metrics_set("cpu_level", NULL, cpu_level());
+
+  /* before anything asks OpenSSL for memory */
+  if (arena_init(ARENA_BYTES, memory_mode) || arena_hook_openssl())
+    log_line(LOG_INFO, "WARNING: Failed to set up the allocation arena, using the heap");
+  /* blocks, keys and conditioned output, kept off swap if asked */
+  arena_lock(bitbuffer, sizeof(bitbuffer));
+  arena_lock(bitbuffer_old, sizeof(bitbuffer_old));
+  arena_lock(ciphertext, sizeof(ciphertext));
+  arena_lock(hash_buffer, sizeof(hash_buffer));
+  arena_lock(hash_data_buffer, sizeof(hash_data_buffer));
+  arena_lock(&drbg_feed, sizeof(drbg_feed));
+  arena_lock(&pool, sizeof(pool));
 
   log_line(LOG_DEBUG, "Doing FIPS init");
   fips_init(&fipsctx, (int)0);
 
+  extract_plan_from_mask(&plan, bit_mask);
+  if (!plan.npairs)
+    suicide("Bit mask 0x%03x has no pairs of bit planes to debias", bit_mask);
+  if (extractor_init(&extractor, extract_method, emit_bit, discard_bit, NULL))
+    suicide("Failed to set up %s extractor", extractor_names[extract_method]);
+  if (condition_type == CONDITIONER_AES)
+    gflags_encryption = 1;
+  else if (gflags_encryption && condition_type != CONDITIONER_XOR)
+    suicide("Encryption (-e) and the %s conditioner don't mix", conditioner_names[condition_type]);
+  if (gflags_encryption && !(en = aes_ctx_new()))
+    suicide("Out of memory for AES");
+  if (condition_type > CONDITIONER_AES) {
+    if (conditioner_init(&conditioner, condition_type, toeplitz_in, toeplitz_out,
+			 min_entropy > 0 ? min_entropy : CONDITION_DEFAULT_H))
+      suicide("Failed to set up the %s conditioner", conditioner_names[condition_type]);
+    condition_buffer = arena_map(conditioner_out_max(&conditioner, BUFFER_SIZE));
+    if (!condition_buffer)
+      suicide("Out of memory for the %s conditioner", conditioner_names[condition_type]);
+  }
+  bitstats_reset(&planestats);
+  bitstats_reset(&profilestats);
+  next_profile = time(NULL) + profile_interval;
+  metrics_set("bit_mask", NULL, plan.mask);
+
+  if (estimate_interval > 0) {
+    log_line(LOG_DEBUG, "Starting min-entropy estimator");
+    if (estimator_start(&estimator, plan.mask, estimate_interval))
+      log_line(LOG_INFO, "WARNING: Failed to start min-entropy estimator");
+  }
+
   if (gflags_detach)
     route_output();
   if (!redirect_output)
     output = stdout;
+
+  if (drbg_type >= 0) {
+    drbg_feed_init(&drbg_feed);
+    if (drbg_writers_start(&drbg_writers, drbg_type, drbg_threads, drbg_reseed_bytes,
+			   &drbg_feed, write_output))
+      suicide("Failed to start %d %s DRBG threads", drbg_threads, drbg_names[drbg_type]);
+  }
+  if (pool_mode >= 0) {
+    pool_init(&pool);
+    pool_source = pool_add_source(&pool, "bladerf");
+    if (pool_reader_start(&pool_reader, &pool, pool_mode, deliver_output))
+      suicide("Failed to start the pool reader");
+  }
+  if (state_name)
+    load_state();
+  if (target_rate > 0)
+    samp_rate = governor_init(&governor, target_rate, govern_rates,
+			      sizeof(govern_rates) / sizeof(govern_rates[0]), samp_rate);
+  if (duty_high > 0 && reservoir_fill() < 0) {
+    log_line(LOG_INFO, "WARNING: Output isn't a pipe, and there's no -B or -D, so no duty cycling");
+    duty_high = 0;
+  }
+  if (duty_high > 0)
+    duty_init(&duty, duty_high, duty_low);
     
-  log_line(LOG_DEBUG, "Reading samples!");
-  output_ready = 0;
   r = pthread_create(&rx_task, NULL, rx_task_run, NULL);
   if (r < 0) {
     log_line(LOG_DEBUG,"pthread_create() failed");
-    bladerf_close(dev);
-    bladerf_deinit_stream(rx_stream);
     exit(EXIT_FAILURE);
   }
 
   pthread_join(rx_task, NULL);
-  bladerf_deinit_stream(rx_stream);
-
-  if (do_exit > 0) {
-    log_line(LOG_DEBUG, "\nUser cancel, exiting...");
-  }  else {
-    log_line(LOG_DEBUG, "\nLibrary error %d, exiting...", r);
+  if (pool_mode >= 0)
+    pool_reader_stop(&pool_reader);
+  if (drbg_type >= 0)
+    drbg_writers_stop(&drbg_writers);
+  if (state_name)
+    save_state();
+  estimator_stop(&estimator);
+  extractor_free(&extractor);
+  if (condition_type > CONDITIONER_AES) {
+    arena_unmap(condition_buffer, conditioner_out_max(&conditioner, BUFFER_SIZE));
+    conditioner_free(&conditioner);
   }
+  if (metrics_name)
+    metrics_write(metrics_name);
 
-  bladerf_close(dev);
-  fclose(output);
+  log_line(LOG_DEBUG, "\nUser cancel, exiting...");
+
+  free(device_id);
+  free(standby_id);
+  free(state_name);
+  if (output)
+    fclose(output);
   return 0;
 }
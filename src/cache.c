@@ -0,0 +1,98 @@
+/*
+ * cache.c -- Small persistent key/value cache, for tuning results
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cache.h"
+
+/* If line is for key, returns where its value starts, else NULL */
+static const char *match(const char *line, const char *key)
+{
+  size_t n = strlen(key);
+
+  if (strncmp(line, key, n) || line[n] != ' ')
+    return NULL;
+  return line + n + 1;
+}
+
+int cache_lookup(const char *path, const char *key, char *value, size_t len)
+{
+  char line[CACHE_LINE_LEN];
+  const char *v;
+  FILE *fh;
+  int r = -1;
+
+  fh = fopen(path, "r");
+  if (!fh)
+    return -1;
+  while (fgets(line, sizeof(line), fh)) {
+    v = match(line, key);
+    if (!v)
+      continue;
+    snprintf(value, len, "%s", v);
+    value[strcspn(value, "\n")] = '\0';
+    r = 0;
+  }
+  fclose(fh);
+  return r;
+}
+
+int cache_store(const char *path, const char *key, const char *value)
+{
+  char line[CACHE_LINE_LEN], tmp[4096];
+  FILE *in, *out;
+  int r;
+
+  if (strchr(key, ' ') || strchr(key, '\n') || strchr(value, '\n'))
+    return -1;
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    return -1;
+  out = fopen(tmp, "w");
+  if (!out)
+    return -1;
+  /* copy every other key across, then the new value */
+  in = fopen(path, "r");
+  if (in) {
+    while (fgets(line, sizeof(line), in))
+      if (!match(line, key))
+	fputs(line, out);
+    fclose(in);
+  }
+  fprintf(out, "%s %s\n", key, value);
+  r = fclose(out);
+  if (r || rename(tmp, path)) {
+    remove(tmp);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * cache.h -- Small persistent key/value cache, for tuning results
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef CACHE__H
+#define CACHE__H
+
+#include <stddef.h>
+
+/*
+ * A text file of "key value" lines, for results that are expensive to
+ * find and specific to a host or device, keyed by whatever identifies
+ * them (e.g. host/serial/rate).  Keys have no spaces; values run to
+ * the end of the line.  Writes go through a temporary file and a
+ * rename, so readers never see half a file.
+ */
+#define CACHE_LINE_LEN	512
+
+/* Copies the value for key into value.  Returns 0 if found. */
+extern int cache_lookup(const char *path, const char *key, char *value, size_t len);
+
+/* Sets key to value, replacing any old value.  Returns 0 on success. */
+extern int cache_store(const char *path, const char *key, const char *value);
+
+#endif /* CACHE__H */
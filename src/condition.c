@@ -0,0 +1,223 @@
+/*
+ * condition.c -- conditioners for vetted output
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "condition.h"
+
+const char *conditioner_names[N_CONDITIONERS] = {
+  "xor", "aes", "toeplitz", "sha256", "sha512", "blake2b", "blake3"
+};
+
+int conditioner_parse(const char *name)
+{
+  int i;
+
+  for (i = 0; i < N_CONDITIONERS; i++) {
+    if (!strcmp(name, conditioner_names[i]))
+      return i;
+  }
+  return -1;
+}
+
+static void start_digest(struct conditioner *c)
+{
+  if (c->type == CONDITIONER_BLAKE3)
+    blake3_init(&c->b3);
+  else
+    EVP_DigestInit_ex(c->ctx, c->md, NULL);
+  c->fill = 0;
+}
+
+int conditioner_init(struct conditioner *c, int type, size_t tz_in,
+		     size_t tz_out, double h)
+{
+  memset(c, 0, sizeof(*c));
+  c->type = type;
+  switch (type) {
+  case CONDITIONER_TOEPLITZ:
+    if (toeplitz_init(&c->tz, tz_in, tz_out))
+      return -1;
+    c->in_bytes = tz_in;
+    c->out_bytes = tz_out;
+    return 0;
+  case CONDITIONER_SHA256:
+    c->md = EVP_sha256();
+    if (sha256_mb_available()) {
+      c->lanes = SHA256_MB_LANES;
+      c->batch = malloc(SHA256_MB_LANES * CONDITION_BATCH_STRIDE);
+      if (!c->batch)
+	return -1;
+    }
+    break;
+  case CONDITIONER_SHA512:
+    c->md = EVP_sha512();
+    break;
+  case CONDITIONER_BLAKE2B:
+    c->md = EVP_blake2b512();
+    break;
+  case CONDITIONER_BLAKE3:
+    break;
+  default:
+    return -1;
+  }
+  if (c->md) {
+    c->ctx = EVP_MD_CTX_new();
+    if (!c->ctx)
+      return -1;
+    c->out_bytes = EVP_MD_size(c->md);
+  } else {
+    c->out_bytes = BLAKE3_OUT_LEN;
+  }
+  c->seeded = 1;
+  conditioner_set_entropy(c, h);
+  start_digest(c);
+  return 0;
+}
+
+void conditioner_free(struct conditioner *c)
+{
+  if (c->type == CONDITIONER_TOEPLITZ)
+    toeplitz_free(&c->tz);
+  if (c->ctx)
+    EVP_MD_CTX_free(c->ctx);
+  free(c->batch);
+  memset(c, 0, sizeof(*c));
+}
+
+void conditioner_seed(struct conditioner *c, const unsigned char *key, size_t len)
+{
+  if (c->type == CONDITIONER_TOEPLITZ)
+    toeplitz_seed(&c->tz, key, len);
+  c->seeded = 1;
+}
+
+void conditioner_set_entropy(struct conditioner *c, double h)
+{
+  if (c->type == CONDITIONER_TOEPLITZ)
+    return;
+  if (!(h > CONDITION_MIN_H))
+    h = CONDITION_MIN_H;
+  if (h > 1.0)
+    h = 1.0;
+  c->h = h;
+  c->in_bytes = (size_t)ceil((c->out_bytes * 8 + CONDITION_MARGIN_BITS) / h / 8);
+}
+
+size_t conditioner_out_max(const struct conditioner *c, size_t len)
+{
+  if (c->type == CONDITIONER_TOEPLITZ)
+    return toeplitz_out_max(&c->tz, len);
+  /* full entropy input still takes more than out_bytes per digest */
+  return (len / c->out_bytes + 1) * c->out_bytes;
+}
+
+/* Hashes the queued messages, moving a partly filled one to the front */
+static size_t flush_batch(struct conditioner *c, unsigned char *out)
+{
+  const unsigned char *msgs[SHA256_MB_LANES];
+  int l, n = c->queued;
+
+  if (n == 0)
+    return 0;
+  for (l = 0; l < n; l++)
+    msgs[l] = c->batch + l * CONDITION_BATCH_STRIDE;
+  sha256_mb(msgs, c->in_bytes, n, out);
+  if (c->fill)
+    memmove(c->batch, c->batch + n * CONDITION_BATCH_STRIDE, c->fill);
+  c->queued = 0;
+  return n * c->out_bytes;
+}
+
+static size_t absorb_batch(struct conditioner *c, const unsigned char *in,
+			   size_t len, unsigned char *out)
+{
+  const unsigned char *msg = c->batch;
+  size_t n, written = 0;
+
+  /* the ratio went down since this message was started */
+  if (c->fill >= c->in_bytes) {
+    sha256_mb(&msg, c->fill, 1, out);
+    written += c->out_bytes;
+    c->fill = 0;
+  }
+  while (len > 0) {
+    n = c->in_bytes - c->fill;
+    if (n > len)
+      n = len;
+    memcpy(c->batch + c->queued * CONDITION_BATCH_STRIDE + c->fill, in, n);
+    c->fill += n;
+    in += n;
+    len -= n;
+    if (c->fill == c->in_bytes) {
+      c->fill = 0;
+      if (++c->queued == c->lanes)
+	written += flush_batch(c, out + written);
+    }
+  }
+  return written + flush_batch(c, out + written);
+}
+
+size_t conditioner_absorb(struct conditioner *c, const unsigned char *in,
+			  size_t len, unsigned char *out)
+{
+  size_t n, written = 0;
+
+  if (c->type == CONDITIONER_TOEPLITZ)
+    return toeplitz_absorb(&c->tz, in, len, out);
+  if (c->lanes > 1)
+    return absorb_batch(c, in, len, out);
+
+  while (len > 0) {
+    n = c->in_bytes > c->fill ? c->in_bytes - c->fill : 0;
+    if (n > len)
+      n = len;
+    if (c->type == CONDITIONER_BLAKE3)
+      blake3_update(&c->b3, in, n);
+    else
+      EVP_DigestUpdate(c->ctx, in, n);
+    c->fill += n;
+    in += n;
+    len -= n;
+    if (c->fill >= c->in_bytes) {
+      if (c->type == CONDITIONER_BLAKE3)
+	blake3_final(&c->b3, out + written);
+      else
+	EVP_DigestFinal_ex(c->ctx, out + written, NULL);
+      written += c->out_bytes;
+      start_digest(c);
+    }
+  }
+  return written;
+}
@@ -0,0 +1,113 @@
+/*
+ * condition.h -- conditioners for vetted output
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef CONDITION__H
+#define CONDITION__H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/evp.h>
+
+#include "blake3.h"
+#include "sha256_mb.h"
+#include "toeplitz.h"
+
+/*
+ * What happens to each FIPS vetted block before it is written out.
+ * xor and aes are done in place by the programs; the rest go through
+ * a struct conditioner.
+ */
+#define CONDITIONER_XOR		0
+#define CONDITIONER_AES		1
+#define CONDITIONER_TOEPLITZ	2
+#define CONDITIONER_SHA256	3
+#define CONDITIONER_SHA512	4
+#define CONDITIONER_BLAKE2B	5
+#define CONDITIONER_BLAKE3	6
+#define N_CONDITIONERS		7
+
+/* Min-entropy per input bit assumed until there is an estimate */
+#define CONDITION_DEFAULT_H	0.5
+/* Input entropy over the output size, per SP 800-90B for full entropy */
+#define CONDITION_MARGIN_BITS	64
+/* Least min-entropy per input bit a hash will be sized for */
+#define CONDITION_MIN_H		0.01
+/* Longest SHA-256 input, at CONDITION_MIN_H, and the batch stride */
+#define CONDITION_BATCH_STRIDE	4000
+
+extern const char *conditioner_names[N_CONDITIONERS];
+
+/*
+ * The hashes take in_bytes of input for each digest, enough to carry
+ * out_bytes * 8 + CONDITION_MARGIN_BITS bits of min-entropy at h bits
+ * per input bit.
+ *
+ * SHA-256 inputs are queued up and hashed SHA256_MB_LANES at a time
+ * when the CPU has AVX2.  Whatever is queued is hashed at the end of
+ * each conditioner_absorb(), so nothing waits longer than one block.
+ */
+struct conditioner {
+	int type;
+	int seeded;			/* Toeplitz needs seeding first */
+	double h;
+	size_t in_bytes, out_bytes;
+	size_t fill;			/* input hashed so far */
+	const EVP_MD *md;
+	EVP_MD_CTX *ctx;
+	struct blake3 b3;
+	int lanes;			/* SHA-256 messages hashed at once */
+	int queued;			/* full messages waiting */
+	unsigned char *batch;		/* lanes messages, CONDITION_BATCH_STRIDE apart */
+	struct toeplitz tz;
+};
+
+/* Returns the conditioner called name, or -1 */
+extern int conditioner_parse(const char *name);
+/*
+ * Sets up a Toeplitz or hash conditioner.  tz_in and tz_out are the
+ * Toeplitz block sizes, h the min-entropy per input bit for the hashes.
+ * Returns 0 on success.
+ */
+extern int conditioner_init(struct conditioner *c, int type, size_t tz_in,
+			    size_t tz_out, double h);
+extern void conditioner_free(struct conditioner *c);
+/* Seeds the Toeplitz matrix; a no-op for the hashes */
+extern void conditioner_seed(struct conditioner *c, const unsigned char *key, size_t len);
+/* Changes the compression ratio of the hashes, from the next digest */
+extern void conditioner_set_entropy(struct conditioner *c, double h);
+/* Adds len bytes, writing finished output to out.  Returns the bytes written. */
+extern size_t conditioner_absorb(struct conditioner *c, const unsigned char *in,
+				 size_t len, unsigned char *out);
+/* Room needed in out for len bytes of input, at any ratio */
+extern size_t conditioner_out_max(const struct conditioner *c, size_t len);
+
+#endif /* CONDITION__H */
@@ -0,0 +1,198 @@
+/*
+ * correlate.c -- Cross-correlation of raw sample streams from several devices
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "correlate.h"
+#include "cpu.h"
+
+/* out[i] holds bits lag .. lag + 63 of in, for the first n - 1 words */
+static void shift_window(const uint64_t *in, size_t n, int lag, uint64_t *out)
+{
+  size_t i;
+
+  if (!lag) {
+    memcpy(out, in, (n - 1) * sizeof(out[0]));
+    return;
+  }
+  for (i = 0; i + 1 < n; i++)
+    out[i] = (in[i] >> lag) | (in[i + 1] << (64 - lag));
+}
+
+double correlate_windows(const uint64_t *a, const uint64_t *b, size_t words,
+			 uint64_t *scratch)
+{
+  double bits = (double)(words - 1) * 64, corr, best = 0;
+  int lag;
+
+  for (lag = 0; lag <= CORRELATE_MAX_LAG; lag++) {
+    /* a against b, lag samples later */
+    shift_window(b, words, lag, scratch);
+    corr = fabs(1.0 - 2.0 * cpu_popcount_xor(a, scratch, words - 1) / bits);
+    if (corr > best)
+      best = corr;
+    if (!lag)
+      continue;
+    /* and b against a, lag samples later */
+    shift_window(a, words, lag, scratch);
+    corr = fabs(1.0 - 2.0 * cpu_popcount_xor(scratch, b, words - 1) / bits);
+    if (corr > best)
+      best = corr;
+  }
+  return best;
+}
+
+int correlator_init(struct correlator *c, int nstreams, double threshold)
+{
+  struct correlate_stream *s;
+  int i;
+
+  if (nstreams < 1 || nstreams > CORRELATE_MAX_STREAMS)
+    return -1;
+  memset(c, 0, sizeof(*c));
+  c->nstreams = nstreams;
+  c->threshold = threshold;
+  pthread_mutex_init(&c->lock, NULL);
+  for (i = 0; i < nstreams; i++) {
+    s = &c->streams[i];
+    s->fill = calloc(CORRELATE_WORDS, sizeof(uint64_t));
+    s->latest = calloc(CORRELATE_WORDS, sizeof(uint64_t));
+    s->peer = calloc(CORRELATE_WORDS, sizeof(uint64_t));
+    s->shifted = calloc(CORRELATE_WORDS, sizeof(uint64_t));
+    if (!s->fill || !s->latest || !s->peer || !s->shifted) {
+      correlator_free(c);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void correlator_free(struct correlator *c)
+{
+  struct correlate_stream *s;
+  int i;
+
+  for (i = 0; i < c->nstreams; i++) {
+    s = &c->streams[i];
+    free(s->fill);
+    free(s->latest);
+    free(s->peer);
+    free(s->shifted);
+  }
+  pthread_mutex_destroy(&c->lock);
+  memset(c, 0, sizeof(*c));
+}
+
+/* A full window: publish it, then compare it with every peer's fresh one */
+static void compare_window(struct correlator *c, int stream)
+{
+  struct correlate_stream *s = &c->streams[stream];
+  double corr, *smoothed;
+  int i, have;
+
+  pthread_mutex_lock(&c->lock);
+  memcpy(s->latest, s->fill, CORRELATE_WORDS * sizeof(uint64_t));
+  s->windows++;
+  pthread_mutex_unlock(&c->lock);
+
+  for (i = 0; i < c->nstreams; i++) {
+    if (i == stream)
+      continue;
+    pthread_mutex_lock(&c->lock);
+    have = c->streams[i].windows != c->compared[i][stream];
+    if (have) {
+      c->compared[i][stream] = c->streams[i].windows;
+      c->compared[stream][i] = s->windows;
+      memcpy(s->peer, c->streams[i].latest, CORRELATE_WORDS * sizeof(uint64_t));
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (!have)
+      continue;
+
+    corr = correlate_windows(s->fill, s->peer, CORRELATE_WORDS, s->shifted);
+    pthread_mutex_lock(&c->lock);
+    smoothed = stream < i ? &c->corr[stream][i] : &c->corr[i][stream];
+    *smoothed += CORRELATE_SMOOTHING * (corr - *smoothed);
+    pthread_mutex_unlock(&c->lock);
+  }
+}
+
+void correlator_feed_u8(struct correlator *c, int stream, const uint8_t *samples, size_t n)
+{
+  struct correlate_stream *s = &c->streams[stream];
+  uint64_t v;
+  size_t i = 0;
+
+  while (i < n) {
+    /* eight samples' LSBs to a byte at a time, while byte aligned */
+    if (!(s->nbits & 7)) {
+      for (; i + 8 <= n && s->nbits < CORRELATE_WINDOW_BITS; i += 8, s->nbits += 8) {
+	memcpy(&v, samples + i, sizeof(v));
+	v = ((v & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56;
+	s->fill[s->nbits >> 6] |= v << (s->nbits & 63);
+      }
+    }
+    for (; i < n && s->nbits < CORRELATE_WINDOW_BITS && (i + 8 > n || s->nbits & 7);
+	 i++, s->nbits++)
+      s->fill[s->nbits >> 6] |= (uint64_t)(samples[i] & 1) << (s->nbits & 63);
+    if (s->nbits == CORRELATE_WINDOW_BITS) {
+      compare_window(c, stream);
+      memset(s->fill, 0, CORRELATE_WORDS * sizeof(uint64_t));
+      s->nbits = 0;
+    }
+  }
+}
+
+double correlator_get(struct correlator *c, int a, int b)
+{
+  double corr;
+
+  pthread_mutex_lock(&c->lock);
+  corr = a < b ? c->corr[a][b] : c->corr[b][a];
+  pthread_mutex_unlock(&c->lock);
+  return corr;
+}
+
+double correlator_weight(struct correlator *c, int stream)
+{
+  double weight = 1.0;
+  int i;
+
+  pthread_mutex_lock(&c->lock);
+  for (i = 0; i < stream; i++)
+    if (c->corr[i][stream] > c->threshold)
+      weight *= 1.0 - c->corr[i][stream];
+  pthread_mutex_unlock(&c->lock);
+  return weight > 0 ? weight : 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * correlate.h -- Cross-correlation of raw sample streams from several devices
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef CORRELATE__H
+#define CORRELATE__H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Watches for common-mode interference between devices.  Each stream
+ * packs the least significant bit of its samples into windows of
+ * CORRELATE_WINDOW_BITS; every full window is compared with the
+ * latest window of every other stream that has also filled one since
+ * the pair was last compared, so each pair goes once per window of
+ * the slower stream.  Comparisons are at each lag up to
+ * CORRELATE_MAX_LAG samples either way, by popcount of the XOR, and
+ * the largest |correlation| over the lags is smoothed per pair.
+ *
+ * Devices aren't sample synchronised, so windows only line up to
+ * within a read; the lag search covers small skews, and interference
+ * strong enough to matter tends to persist across windows anyway.
+ * Independent streams sit around 2.5 / sqrt(CORRELATE_WINDOW_BITS).
+ */
+#define CORRELATE_WINDOW_BITS	(1 << 16)
+#define CORRELATE_WORDS		(CORRELATE_WINDOW_BITS / 64)
+#define CORRELATE_MAX_LAG	32	/* samples, must be under 64 */
+#define CORRELATE_SMOOTHING	0.1	/* weight of each new window */
+#define CORRELATE_MAX_STREAMS	16
+
+struct correlate_stream {
+	uint64_t *fill;			/* window being packed, feeder only */
+	size_t nbits;
+	uint64_t *latest;		/* last full window, under lock */
+	unsigned long windows;
+	uint64_t *peer, *shifted;	/* scratch, feeder only */
+};
+
+struct correlator {
+	int nstreams;
+	double threshold;
+	struct correlate_stream streams[CORRELATE_MAX_STREAMS];
+	/* smoothed max |correlation|, [a][b] with a < b */
+	double corr[CORRELATE_MAX_STREAMS][CORRELATE_MAX_STREAMS];
+	/* windows of a as of its last comparison with b */
+	unsigned long compared[CORRELATE_MAX_STREAMS][CORRELATE_MAX_STREAMS];
+	pthread_mutex_t lock;
+};
+
+/* Returns 0 on success */
+extern int correlator_init(struct correlator *c, int nstreams, double threshold);
+extern void correlator_free(struct correlator *c);
+
+/* Hot path, one stream per thread.  Compares every window it fills. */
+extern void correlator_feed_u8(struct correlator *c, int stream,
+			       const uint8_t *samples, size_t n);
+
+/* Smoothed correlation of a pair, 0 until both have a window */
+extern double correlator_get(struct correlator *c, int a, int b);
+
+/*
+ * What share of a stream's entropy to credit.  The first stream of a
+ * correlated pair keeps its credit, the later one loses the
+ * correlated part, so two copies of the same signal count once.
+ */
+extern double correlator_weight(struct correlator *c, int stream);
+
+/* Max |correlation| of two windows of words 64 bit words, over lags */
+extern double correlate_windows(const uint64_t *a, const uint64_t *b, size_t words,
+				uint64_t *scratch);
+
+#endif /* CORRELATE__H */
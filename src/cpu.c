@@ -0,0 +1,299 @@
+/*
+ * cpu.c -- CPU feature detection and kernel dispatch
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_TARGETS 1
+#include <immintrin.h>
+#endif
+
+#include "cpu.h"
+
+#define BENCH_WORDS	2048	/* 16 KB a side, in L1 */
+#define BENCH_SECONDS	0.001	/* per trial */
+#define BENCH_TRIALS	3	/* the best counts, after a warm up */
+
+const char *cpu_level_names[N_CPU_LEVELS] = { "scalar", "sse4.2", "avx2", "avx512" };
+
+static int detected = -1;
+static int cap = N_CPU_LEVELS - 1;
+
+int cpu_parse_level(const char *name)
+{
+  int i;
+
+  if (!strcmp(name, "auto"))
+    return CPU_AUTO;
+  for (i = 0; i < N_CPU_LEVELS; i++) {
+    if (!strcmp(name, cpu_level_names[i]))
+      return i;
+  }
+  return -2;
+}
+
+int cpu_detect(void)
+{
+  if (detected >= 0)
+    return detected;
+  detected = CPU_SCALAR;
+#ifdef HAVE_X86_TARGETS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+    detected = CPU_SSE42;
+  if (detected == CPU_SSE42 && __builtin_cpu_supports("avx2"))
+    detected = CPU_AVX2;
+  if (detected == CPU_AVX2 && __builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("avx512bw"))
+    detected = CPU_AVX512;
+#endif
+  return detected;
+}
+
+int cpu_level(void)
+{
+  int level = cpu_detect();
+
+  return level < cap ? level : cap;
+}
+
+static void xor_scalar(unsigned char *dst, const unsigned char *src, size_t len)
+{
+  uint64_t a, b;
+  size_t i;
+
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy(&a, dst + i, 8);
+    memcpy(&b, src + i, 8);
+    a ^= b;
+    memcpy(dst + i, &a, 8);
+  }
+  for (; i < len; i++)
+    dst[i] ^= src[i];
+}
+
+static uint64_t popcount_xor_scalar(const uint64_t *a, const uint64_t *b, size_t n)
+{
+  uint64_t total = 0;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    total += __builtin_popcountll(a[i] ^ b[i]);
+  return total;
+}
+
+#ifdef HAVE_X86_TARGETS
+__attribute__((target("sse4.2")))
+static void xor_sse42(unsigned char *dst, const unsigned char *src, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i + 16 <= len; i += 16)
+    _mm_storeu_si128((__m128i *)(dst + i),
+		     _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)),
+				   _mm_loadu_si128((const __m128i *)(src + i))));
+  xor_scalar(dst + i, src + i, len - i);
+}
+
+/* The same loop as scalar, but with the popcnt instruction */
+__attribute__((target("sse4.2,popcnt")))
+static uint64_t popcount_xor_sse42(const uint64_t *a, const uint64_t *b, size_t n)
+{
+  uint64_t total = 0;
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    total += __builtin_popcountll(a[i] ^ b[i]);
+  return total;
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(unsigned char *dst, const unsigned char *src, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i + 32 <= len; i += 32)
+    _mm256_storeu_si256((__m256i *)(dst + i),
+			_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(dst + i)),
+					 _mm256_loadu_si256((const __m256i *)(src + i))));
+  xor_scalar(dst + i, src + i, len - i);
+}
+
+/* Nibble table lookups, summed across bytes with psadbw */
+__attribute__((target("avx2")))
+static uint64_t popcount_xor_avx2(const uint64_t *a, const uint64_t *b, size_t n)
+{
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+				       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  __m256i acc = _mm256_setzero_si256(), v, cnt;
+  uint64_t lanes[4];
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+			 _mm256_loadu_si256((const __m256i *)(b + i)));
+    cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)),
+			  _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+  }
+  _mm256_storeu_si256((__m256i *)lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + popcount_xor_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void xor_avx512(unsigned char *dst, const unsigned char *src, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i + 64 <= len; i += 64)
+    _mm512_storeu_si512((void *)(dst + i),
+			_mm512_xor_si512(_mm512_loadu_si512((const void *)(dst + i)),
+					 _mm512_loadu_si512((const void *)(src + i))));
+  xor_scalar(dst + i, src + i, len - i);
+}
+
+/* As for AVX2, on 512 bit vectors */
+__attribute__((target("avx512f,avx512bw")))
+static uint64_t popcount_xor_avx512(const uint64_t *a, const uint64_t *b, size_t n)
+{
+  const __m512i lut = _mm512_set4_epi32(0x04030302, 0x03020201, 0x03020201, 0x02010100);
+  const __m512i low = _mm512_set1_epi8(0x0f);
+  __m512i acc = _mm512_setzero_si512(), v, cnt;
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    v = _mm512_xor_si512(_mm512_loadu_si512((const void *)(a + i)),
+			 _mm512_loadu_si512((const void *)(b + i)));
+    cnt = _mm512_add_epi8(_mm512_shuffle_epi8(lut, _mm512_and_si512(v, low)),
+			  _mm512_shuffle_epi8(lut, _mm512_and_si512(_mm512_srli_epi16(v, 4), low)));
+    acc = _mm512_add_epi64(acc, _mm512_sad_epu8(cnt, _mm512_setzero_si512()));
+  }
+  return _mm512_reduce_add_epi64(acc) + popcount_xor_scalar(a + i, b + i, n - i);
+}
+#endif
+
+static const cpu_xor_fn xor_variants[N_CPU_LEVELS] = {
+  xor_scalar,
+#ifdef HAVE_X86_TARGETS
+  xor_sse42, xor_avx2, xor_avx512
+#endif
+};
+
+static const cpu_popcount_xor_fn popcount_xor_variants[N_CPU_LEVELS] = {
+  popcount_xor_scalar,
+#ifdef HAVE_X86_TARGETS
+  popcount_xor_sse42, popcount_xor_avx2, popcount_xor_avx512
+#endif
+};
+
+cpu_xor_fn cpu_xor = xor_scalar;
+cpu_popcount_xor_fn cpu_popcount_xor = popcount_xor_scalar;
+
+static double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Bytes per second through variant level of a kernel, over a and b */
+static double bench(int level, int popcount, uint64_t *a, const uint64_t *b)
+{
+  volatile uint64_t sink = 0;
+  double start, elapsed, rate, best = 0;
+  unsigned long runs;
+  int trial;
+
+  for (trial = 0; trial <= BENCH_TRIALS; trial++) {
+    start = now();
+    runs = 0;
+    do {
+      if (popcount)
+	sink += popcount_xor_variants[level](a, b, BENCH_WORDS);
+      else
+	xor_variants[level]((unsigned char *)a, (const unsigned char *)b, BENCH_WORDS * 8);
+      runs++;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+    rate = runs * BENCH_WORDS * 8.0 * (popcount ? 2 : 1) / elapsed;
+    /* trial 0 warms up */
+    if (trial && rate > best)
+      best = rate;
+  }
+  (void)sink;
+  return best;
+}
+
+void cpu_select(int level, char *report, size_t len)
+{
+  static uint64_t a[BENCH_WORDS], b[BENCH_WORDS];
+  double rate, best_xor = 0, best_pop = 0;
+  int i, top, pick_xor, pick_pop;
+
+  top = cpu_detect();
+  if (level != CPU_AUTO && level < top)
+    top = level;
+  cap = top;
+  pick_xor = pick_pop = top;
+
+  if (level == CPU_AUTO) {
+    for (i = 0; i < BENCH_WORDS; i++) {
+      a[i] = 0x9e3779b97f4a7c15ULL * (i + 1);
+      b[i] = 0xc2b2ae3d27d4eb4fULL * (i + 1);
+    }
+    for (i = 0; i <= top; i++) {
+      rate = bench(i, 0, a, b);
+      if (rate > best_xor) {
+	best_xor = rate;
+	pick_xor = i;
+      }
+      rate = bench(i, 1, a, b);
+      if (rate > best_pop) {
+	best_pop = rate;
+	pick_pop = i;
+      }
+    }
+  }
+  cpu_xor = xor_variants[pick_xor];
+  cpu_popcount_xor = popcount_xor_variants[pick_pop];
+
+  if (level == CPU_AUTO)
+    snprintf(report, len, "CPU level %s: xor %s (%0.1f GB/s), popcount %s (%0.1f GB/s)",
+	     cpu_level_names[top], cpu_level_names[pick_xor], best_xor / 1e9,
+	     cpu_level_names[pick_pop], best_pop / 1e9);
+  else
+    snprintf(report, len, "CPU level %s, as asked (host has %s)",
+	     cpu_level_names[top], cpu_level_names[cpu_detect()]);
+}
@@ -0,0 +1,87 @@
+/*
+ * cpu.h -- CPU feature detection and kernel dispatch
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef CPU__H
+#define CPU__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * One package runs on everything from old Atoms to AVX-512 Xeons, so
+ * the hot kernels come in variants for each instruction set level,
+ * and the best one the host has is picked at startup.  A level caps
+ * what every kernel may use: the block kernels here, the multi-buffer
+ * SHA-256 (AVX2) and Toeplitz carry-less multiplies (SSE4.2 level, if
+ * the host has PCLMUL).  Extraction and FIPS testing are byte table
+ * lookups, with nothing for SIMD to do.
+ *
+ *  - scalar: anything x86-64, or not x86 at all
+ *  - sse4.2: 128 bit vectors, popcnt
+ *  - avx2:   256 bit vectors
+ *  - avx512: 512 bit vectors, with AVX-512BW
+ */
+#define CPU_SCALAR	0
+#define CPU_SSE42	1
+#define CPU_AVX2	2
+#define CPU_AVX512	3
+#define N_CPU_LEVELS	4
+
+#define CPU_AUTO	-1	/* benchmark, rather than take the highest level */
+
+extern const char *cpu_level_names[N_CPU_LEVELS];
+
+/* Returns the level called name, CPU_AUTO for "auto", or -2 */
+extern int cpu_parse_level(const char *name);
+/* The highest level this host supports */
+extern int cpu_detect(void);
+/* The highest level kernels may use: what the host has, under any cap */
+extern int cpu_level(void);
+
+/* dst ^= src */
+typedef void (*cpu_xor_fn)(unsigned char *dst, const unsigned char *src, size_t len);
+/* Bits set in a ^ b, over n words */
+typedef uint64_t (*cpu_popcount_xor_fn)(const uint64_t *a, const uint64_t *b, size_t n);
+
+extern cpu_xor_fn cpu_xor;
+extern cpu_popcount_xor_fn cpu_popcount_xor;
+
+/*
+ * Picks the block kernels, once at startup.  With CPU_AUTO every
+ * variant the host can run is timed and the fastest kept (wider isn't
+ * always faster, AVX-512 can cost clock speed); given a level, every
+ * kernel uses that level, or the host's own if it is lower, untimed.
+ * Writes what was chosen, and why, to report for logging.
+ */
+extern void cpu_select(int level, char *report, size_t len);
+
+#endif /* CPU__H */
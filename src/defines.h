@@ -44,6 +44,26 @@
 #define BUFFER_SIZE                     2500 /* need 2500 bits for FIPS */
 #define DEFAULT_FREQUENCY MHZ(70)
 #define HASH_BUFFER_SIZE  64 /* Bytes */
+#define ADAPT_SAMPLES     (1 << 22) /* samples between bit plane re-selections */
+#define METRICS_INTERVAL  10 /* seconds between metrics file writes */
+#define MAX_DEVICES       16 /* dongles one process will fan in */
+#define DEVICE_STALL_SECONDS  5 /* without samples, and a device is re-opened */
+#define DEVICE_RETRY_MIN      1 /* seconds before re-opening, doubling each time */
+#define DEVICE_RETRY_MAX      60
+#define DEVICE_FAILOVER_AFTER 3 /* failures in a row before a standby takes over */
+#define TUNE_SECONDS      2   /* calibration window per stream setup */
+#define TUNE_MIN_BUFFERS  64
+#define TUNE_BUSY         0.7 /* most of each buffer's time the callback may use */
+#define TUNE_DELIVERED    0.99 /* of the samples the clock says, or some were dropped */
+#define SYNC_BATCH        262144 /* samples per read with the sync interface */
+#define SYNC_POOL_BUFFERS 8      /* batches in flight between the reader and the pipeline */
+#define SYNC_TIMEOUT_MS   1000
+#define STATE_INTERVAL    60   /* seconds between warm-start state saves */
+#define STATE_FEED_BYTES  1024 /* DRBG seed material carried across a restart */
+#define CACHE_INTERVAL    300  /* seconds between device profile saves */
+#define CALIBRATE_SAMPLES (2 * DEFAULT_BUF_LENGTH) /* measured per gain and frequency */
+#define CALIBRATE_MAX_FREQS 16
+#define DUTY_WARMUP_BUFFERS 2 /* discarded after a pause, while the tuner and USB settle */
 
 #define GFLAGS_DETACH 0
 #define GFLAGS_DEBUG 1
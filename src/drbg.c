@@ -0,0 +1,338 @@
+/*
+ * drbg.c -- deterministic random bit generators seeded from the radio
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "arena.h"
+#include "drbg.h"
+#include "log.h"
+
+const char *drbg_names[N_DRBGS] = { "ctr", "chacha20" };
+
+int drbg_parse(const char *name)
+{
+  int i;
+
+  for (i = 0; i < N_DRBGS; i++) {
+    if (!strcmp(name, drbg_names[i]))
+      return i;
+  }
+  return -1;
+}
+
+/* v += n, as a 128 bit big endian number */
+static void add_be128(unsigned char v[16], unsigned long long n)
+{
+  int i;
+
+  for (i = 15; i >= 0 && n; i--) {
+    n += v[i];
+    v[i] = (unsigned char)n;
+    n >>= 8;
+  }
+}
+
+/* len bytes of keystream from the current key, starting at counter iv */
+static int keystream(struct drbg *d, const unsigned char iv[16], unsigned char *out,
+		     size_t len)
+{
+  int outl;
+
+  memset(out, 0, len);
+  /* the cipher was set in drbg_init(), setting it again allocates */
+  if (!EVP_EncryptInit_ex(d->ctx, NULL, NULL, d->key, iv))
+    return -1;
+  if (!EVP_EncryptUpdate(d->ctx, out, &outl, out, (int)len))
+    return -1;
+  return 0;
+}
+
+/* CTR_DRBG_Update, with provided_data of DRBG_SEED_LEN bytes or NULL */
+static void ctr_update(struct drbg *d, const unsigned char *data)
+{
+  unsigned char temp[DRBG_SEED_LEN], iv[16];
+  int i;
+
+  memcpy(iv, d->v, 16);
+  add_be128(iv, 1);
+  keystream(d, iv, temp, sizeof(temp));
+  if (data) {
+    for (i = 0; i < DRBG_SEED_LEN; i++)
+      temp[i] ^= data[i];
+  }
+  memcpy(d->key, temp, 32);
+  memcpy(d->v, temp + 32, 16);
+  memset(temp, 0, sizeof(temp));
+}
+
+/* ChaCha20 state is key and iv (counter and nonce): take the next
+ * state from the head of the keystream */
+static void chacha_rekey(struct drbg *d)
+{
+  unsigned char temp[DRBG_SEED_LEN];
+
+  keystream(d, d->v, temp, sizeof(temp));
+  memcpy(d->key, temp, 32);
+  memcpy(d->v, temp + 32, 16);
+  memset(temp, 0, sizeof(temp));
+}
+
+/*
+ * One ChaCha20 request: the next key and iv are the first block of
+ * keystream, and the output starts after it, so nothing handed out
+ * ever becomes generator state
+ */
+static int chacha_generate(struct drbg *d, unsigned char *out, size_t len)
+{
+  unsigned char temp[64];
+  int outl, r = -1;
+
+  memset(temp, 0, sizeof(temp));
+  memset(out, 0, len);
+  if (EVP_EncryptInit_ex(d->ctx, NULL, NULL, d->key, d->v) &&
+      EVP_EncryptUpdate(d->ctx, temp, &outl, temp, sizeof(temp)) &&
+      EVP_EncryptUpdate(d->ctx, out, &outl, out, (int)len)) {
+    memcpy(d->key, temp, 32);
+    memcpy(d->v, temp + 32, 16);
+    r = 0;
+  }
+  memset(temp, 0, sizeof(temp));
+  return r;
+}
+
+int drbg_init(struct drbg *d, int type, const unsigned char seed[DRBG_SEED_LEN])
+{
+  const EVP_CIPHER *cipher;
+
+  memset(d, 0, sizeof(*d));
+  d->type = type;
+  d->ctx = EVP_CIPHER_CTX_new();
+  if (!d->ctx)
+    return -1;
+  cipher = type == DRBG_CTR ? EVP_aes_256_ctr() : EVP_chacha20();
+  if (!EVP_EncryptInit_ex(d->ctx, cipher, NULL, NULL, NULL)) {
+    EVP_CIPHER_CTX_free(d->ctx);
+    d->ctx = NULL;
+    return -1;
+  }
+  drbg_reseed(d, seed);
+  return 0;
+}
+
+void drbg_reseed(struct drbg *d, const unsigned char seed[DRBG_SEED_LEN])
+{
+  int i;
+
+  if (d->type == DRBG_CTR) {
+    ctr_update(d, seed);
+  } else {
+    for (i = 0; i < 32; i++)
+      d->key[i] ^= seed[i];
+    for (i = 0; i < 16; i++)
+      d->v[i] ^= seed[32 + i];
+    chacha_rekey(d);
+  }
+  d->reseed_counter = 1;
+}
+
+int drbg_generate(struct drbg *d, unsigned char *out, size_t len)
+{
+  unsigned char iv[16];
+
+  if (len > DRBG_MAX_REQUEST)
+    return -1;
+  if (d->type == DRBG_CTR) {
+    memcpy(iv, d->v, 16);
+    add_be128(iv, 1);
+    if (keystream(d, iv, out, len))
+      return -1;
+    add_be128(d->v, (len + 15) / 16);
+    ctr_update(d, NULL);
+  } else if (chacha_generate(d, out, len)) {
+    return -1;
+  }
+  d->reseed_counter++;
+  return 0;
+}
+
+void drbg_free(struct drbg *d)
+{
+  if (d->ctx)
+    EVP_CIPHER_CTX_free(d->ctx);
+  memset(d, 0, sizeof(*d));
+}
+
+void drbg_feed_init(struct drbg_feed *f)
+{
+  memset(f, 0, sizeof(*f));
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->cond, NULL);
+}
+
+void drbg_feed_add(struct drbg_feed *f, const unsigned char *buf, size_t len)
+{
+  size_t n;
+
+  pthread_mutex_lock(&f->lock);
+  n = DRBG_FEED_SIZE - f->fill;
+  if (n > len)
+    n = len;
+  memcpy(f->buf + f->fill, buf, n);
+  f->fill += n;
+  f->added += n;
+  f->dropped += len - n;
+  if (f->fill >= DRBG_SEED_LEN)
+    pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+}
+
+size_t drbg_feed_peek(struct drbg_feed *f, unsigned char *buf, size_t len)
+{
+  pthread_mutex_lock(&f->lock);
+  if (len > f->fill)
+    len = f->fill;
+  memcpy(buf, f->buf, len);
+  pthread_mutex_unlock(&f->lock);
+  return len;
+}
+
+size_t drbg_feed_fill(struct drbg_feed *f)
+{
+  size_t fill;
+
+  pthread_mutex_lock(&f->lock);
+  fill = f->fill;
+  pthread_mutex_unlock(&f->lock);
+  return fill;
+}
+
+int drbg_feed_take(struct drbg_feed *f, unsigned char seed[DRBG_SEED_LEN])
+{
+  struct timespec ts;
+  int r = 0;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += 1;
+  pthread_mutex_lock(&f->lock);
+  while (f->fill < DRBG_SEED_LEN && r != ETIMEDOUT)
+    r = pthread_cond_timedwait(&f->cond, &f->lock, &ts);
+  if (f->fill < DRBG_SEED_LEN) {
+    pthread_mutex_unlock(&f->lock);
+    return -1;
+  }
+  /* take the newest bytes, leaving the rest in place */
+  f->fill -= DRBG_SEED_LEN;
+  memcpy(seed, f->buf + f->fill, DRBG_SEED_LEN);
+  memset(f->buf + f->fill, 0, DRBG_SEED_LEN);
+  pthread_mutex_unlock(&f->lock);
+  return 0;
+}
+
+/* A writer's generator and buffers, in pages of their own so -H locked keeps them off swap */
+struct writer_state {
+	struct drbg d;
+	unsigned char seed[DRBG_SEED_LEN];
+	unsigned char buf[DRBG_MAX_REQUEST];
+};
+
+static void *writer_run(void *arg)
+{
+  struct drbg_writers *w = arg;
+  struct writer_state *s;
+  size_t since_reseed = 0;
+  int seeded = 0;
+
+  s = arena_map(sizeof(*s));
+  if (!s) {
+    log_line(LOG_INFO, "WARNING: Out of memory for a DRBG thread");
+    return NULL;
+  }
+  while (!w->stop) {
+    if (!seeded || since_reseed >= w->reseed) {
+      if (drbg_feed_take(w->feed, s->seed))
+	continue;
+      if (!seeded) {
+	if (drbg_init(&s->d, w->type, s->seed))
+	  break;
+	seeded = 1;
+      } else {
+	drbg_reseed(&s->d, s->seed);
+      }
+      since_reseed = 0;
+    }
+    if (drbg_generate(&s->d, s->buf, sizeof(s->buf)))
+      break;
+    since_reseed += sizeof(s->buf);
+    w->write(s->buf, sizeof(s->buf));
+  }
+  memset(s->seed, 0, sizeof(s->seed));
+  memset(s->buf, 0, sizeof(s->buf));
+  if (seeded)
+    drbg_free(&s->d);
+  arena_unmap(s, sizeof(*s));
+  return NULL;
+}
+
+int drbg_writers_start(struct drbg_writers *w, int type, int nthreads,
+		       size_t reseed, struct drbg_feed *feed,
+		       void (*write)(const unsigned char *buf, size_t len))
+{
+  int i;
+
+  memset(w, 0, sizeof(*w));
+  if (nthreads < 1 || nthreads > DRBG_MAX_THREADS)
+    return -1;
+  w->type = type;
+  w->reseed = reseed;
+  w->feed = feed;
+  w->write = write;
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&w->threads[i], NULL, writer_run, w)) {
+      drbg_writers_stop(w);
+      return -1;
+    }
+    w->nthreads++;
+  }
+  return 0;
+}
+
+void drbg_writers_stop(struct drbg_writers *w)
+{
+  int i;
+
+  w->stop = 1;
+  for (i = 0; i < w->nthreads; i++)
+    pthread_join(w->threads[i], NULL);
+  w->nthreads = 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * drbg.h -- deterministic random bit generators seeded from the radio
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef DRBG__H
+#define DRBG__H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+
+/*
+ * CTR_DRBG is SP 800-90A AES-256 CTR_DRBG without a derivation
+ * function, so it takes full entropy seeds.  chacha20 is a fast key
+ * erasure generator: every request first makes the key for the next.
+ */
+#define DRBG_CTR	0
+#define DRBG_CHACHA20	1
+#define N_DRBGS		2
+
+/* Seed material per (re)seed, the CTR_DRBG seedlen for AES-256 */
+#define DRBG_SEED_LEN		48
+/* Output between reseeds, by default */
+#define DRBG_RESEED		(1 << 20)
+/* Largest request, 2^19 bits */
+#define DRBG_MAX_REQUEST	65536
+/* Seed material waiting for generators */
+#define DRBG_FEED_SIZE		(64 * 1024)
+#define DRBG_MAX_THREADS	64
+
+extern const char *drbg_names[N_DRBGS];
+
+struct drbg {
+	int type;
+	EVP_CIPHER_CTX *ctx;
+	unsigned char key[32], v[16];
+	unsigned long long reseed_counter;
+};
+
+/* Returns the generator called name, or -1 */
+extern int drbg_parse(const char *name);
+/* Returns 0 on success */
+extern int drbg_init(struct drbg *d, int type, const unsigned char seed[DRBG_SEED_LEN]);
+extern void drbg_reseed(struct drbg *d, const unsigned char seed[DRBG_SEED_LEN]);
+/* len is at most DRBG_MAX_REQUEST.  Returns 0 on success. */
+extern int drbg_generate(struct drbg *d, unsigned char *out, size_t len);
+extern void drbg_free(struct drbg *d);
+
+/* Conditioned output on its way to the generators */
+struct drbg_feed {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char buf[DRBG_FEED_SIZE];
+	size_t fill;
+	unsigned long long added, dropped;
+};
+
+extern void drbg_feed_init(struct drbg_feed *f);
+/* Never blocks; what doesn't fit is dropped */
+extern void drbg_feed_add(struct drbg_feed *f, const unsigned char *buf, size_t len);
+/* Waits up to a second for DRBG_SEED_LEN bytes.  Returns 0 if it got them. */
+extern int drbg_feed_take(struct drbg_feed *f, unsigned char seed[DRBG_SEED_LEN]);
+/* Copies up to len bytes of what is waiting, without taking them.  Returns the count. */
+extern size_t drbg_feed_peek(struct drbg_feed *f, unsigned char *buf, size_t len);
+/* Bytes waiting, out of DRBG_FEED_SIZE */
+extern size_t drbg_feed_fill(struct drbg_feed *f);
+
+/*
+ * Generator threads, one DRBG each, writing DRBG_MAX_REQUEST bytes at
+ * a time through write().  Each reseeds from the feed after reseed
+ * bytes of output, or before every request if reseed is 0 (prediction
+ * resistance), and waits for the feed when it has nothing.
+ */
+struct drbg_writers {
+	int type, nthreads;
+	size_t reseed;
+	struct drbg_feed *feed;
+	void (*write)(const unsigned char *buf, size_t len);
+	volatile int stop;
+	pthread_t threads[DRBG_MAX_THREADS];
+};
+
+/* Returns 0 on success */
+extern int drbg_writers_start(struct drbg_writers *w, int type, int nthreads,
+			      size_t reseed, struct drbg_feed *feed,
+			      void (*write)(const unsigned char *buf, size_t len));
+extern void drbg_writers_stop(struct drbg_writers *w);
+
+#endif /* DRBG__H */
@@ -0,0 +1,106 @@
+/*
+ * duty.c -- Pauses acquisition while the sinks are full
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "duty.h"
+#include "metrics.h"
+
+int duty_parse(const char *arg, double *high, double *low)
+{
+  if (sscanf(arg, "%lf:%lf", high, low) != 2 || *low < 0 || *low >= *high || *high > 100)
+    return -1;
+  *high /= 100;
+  *low /= 100;
+  return 0;
+}
+
+void duty_init(struct duty *d, double high, double low)
+{
+  d->high = high;
+  d->low = low;
+  d->paused = 0;
+  d->active = d->total = 0;
+  clock_gettime(CLOCK_MONOTONIC, &d->last);
+}
+
+int duty_update(struct duty *d, double fill)
+{
+  struct timespec now;
+  double dt;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  dt = (now.tv_sec - d->last.tv_sec) + (now.tv_nsec - d->last.tv_nsec) / 1e9;
+  d->last = now;
+  d->total += dt;
+  if (!d->paused)
+    d->active += dt;
+  metrics_set("duty_reservoir_fill", NULL, fill);
+  if (!d->paused && fill >= d->high) {
+    d->paused = 1;
+    metrics_add("duty_pauses_total", NULL, 1);
+    return 1;
+  }
+  if (d->paused && fill <= d->low) {
+    d->paused = 0;
+    return 1;
+  }
+  return 0;
+}
+
+void duty_publish(struct duty *d)
+{
+  if (d->total > 0)
+    metrics_set("duty_cycle", NULL, d->active / d->total);
+  d->active = d->total = 0;
+}
+
+double duty_pipe_fill(int fd)
+{
+#if defined(F_GETPIPE_SZ) && defined(FIONREAD)
+  struct stat st;
+  int size, n;
+
+  if (fd < 0 || fstat(fd, &st) || !S_ISFIFO(st.st_mode))
+    return -1;
+  size = fcntl(fd, F_GETPIPE_SZ);
+  if (size <= 0 || ioctl(fd, FIONREAD, &n))
+    return -1;
+  return (double)n / size;
+#else
+  return -1;
+#endif
+}
@@ -0,0 +1,66 @@
+/*
+ * duty.h -- Pauses acquisition while the sinks are full
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef DUTY__H
+#define DUTY__H
+
+#include <time.h>
+
+/*
+ * Acquisition only runs while something downstream has room.  The
+ * reservoir is whatever conditioned output waits in before a reader
+ * takes it: the pool's entropy account with -B, the DRBG feed with -D,
+ * otherwise the pipe or FIFO being written to.  Filling past the high
+ * watermark pauses the stream, and draining below the low one resumes
+ * it, so a daemon nobody is reading from costs next to nothing.
+ */
+struct duty {
+	double high, low;		/* fill, 0 to 1 */
+	volatile int paused;
+	double active, total;		/* seconds, since the last publish */
+	struct timespec last;
+};
+
+/* Parses "high:low", in percent.  Returns 0 on success. */
+extern int duty_parse(const char *arg, double *high, double *low);
+extern void duty_init(struct duty *d, double high, double low);
+/*
+ * Given how full the reservoir is, 0 to 1 or -1 if unknown, pauses or
+ * resumes.  Returns 1 if it did either.
+ */
+extern int duty_update(struct duty *d, double fill);
+/* Sets the duty_cycle metric, the time streaming since the last call */
+extern void duty_publish(struct duty *d);
+/* How full the pipe or FIFO fd is, 0 to 1, or -1 if it isn't one */
+extern double duty_pipe_fill(int fd);
+
+#endif /* DUTY__H */
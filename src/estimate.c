@@ -0,0 +1,574 @@
+/*
+ * estimate.c -- SP 800-90B non-IID min-entropy estimators
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "estimate.h"
+
+/* 99% confidence bound used throughout SP 800-90B */
+#define Z_ALPHA 2.576
+/* Compression estimator parameters, SP 800-90B 6.3.4 */
+#define COMPRESSION_B 6
+#define COMPRESSION_D 1000
+#define COMPRESSION_C 0.5907
+
+/* Don't bother estimating output entropy on less than a FIPS block */
+#define MIN_OUTPUT_BYTES 2500
+
+static int mask_bits(uint16_t mask)
+{
+  int bits = 0;
+  while (mask) {
+    bits += mask & 1;
+    mask >>= 1;
+  }
+  return bits;
+}
+
+/* Gather the bits of s selected by mask into the low bits */
+static uint16_t compact(uint16_t s, uint16_t mask)
+{
+  uint16_t out = 0;
+  int i, k = 0;
+  for (i = 0; i < 16; i++) {
+    if (mask & (1 << i)) {
+      out |= ((s >> i) & 1) << k;
+      k++;
+    }
+  }
+  return out;
+}
+
+static double upper_bound(double p, size_t n)
+{
+  p += Z_ALPHA * sqrt(p * (1.0 - p) / (double)(n - 1));
+  return p > 1.0 ? 1.0 : p;
+}
+
+/* 6.3.1 Most common value */
+static double est_mcv(const uint16_t *s, size_t n, int bits)
+{
+  unsigned int *counts;
+  size_t i, max = 0;
+
+  counts = calloc((size_t)1 << bits, sizeof(counts[0]));
+  if (!counts)
+    return 0.0;
+  for (i = 0; i < n; i++) {
+    if (++counts[s[i]] > max)
+      max = counts[s[i]];
+  }
+  free(counts);
+  return -log2(upper_bound((double)max / n, n));
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* 6.3.5 t-Tuple.  Tuples are packed into 64 bit keys, so t is capped
+ * at 64/bits; a source that predictable has already been caught by
+ * the other estimators. */
+static double est_t_tuple(const uint16_t *s, size_t n, int bits)
+{
+  uint64_t *keys, *sorted;
+  size_t i, run, max, len;
+  int t, tmax = 64 / bits;
+  double p, pmax = 0.0;
+
+  keys = malloc(n * sizeof(keys[0]));
+  sorted = malloc(n * sizeof(sorted[0]));
+  if (!keys || !sorted) {
+    free(keys);
+    free(sorted);
+    return 0.0;
+  }
+  for (i = 0; i < n; i++)
+    keys[i] = 0;
+
+  for (t = 1; t <= tmax; t++) {
+    len = n - t + 1;
+    for (i = 0; i < len; i++)
+      keys[i] = (keys[i] << bits) | s[i + t - 1];
+    memcpy(sorted, keys, len * sizeof(sorted[0]));
+    qsort(sorted, len, sizeof(sorted[0]), cmp_u64);
+    max = run = 1;
+    for (i = 1; i < len; i++) {
+      run = (sorted[i] == sorted[i - 1]) ? run + 1 : 1;
+      if (run > max)
+	max = run;
+    }
+    if (max < 35)
+      break;
+    p = pow((double)max / len, 1.0 / t);
+    if (p > pmax)
+      pmax = p;
+  }
+  free(keys);
+  free(sorted);
+
+  if (pmax == 0.0)
+    return (double)bits;
+  return -log2(upper_bound(pmax, n));
+}
+
+/* 6.3.2 Collision, binary form */
+static double est_collision(const unsigned char *b, size_t n)
+{
+  size_t i = 0, v = 0;
+  double t, sum = 0.0, sumsq = 0.0, mean, sd, x, p;
+
+  while (i + 2 < n) {
+    if (b[i] == b[i + 1]) {
+      t = 2.0;
+      i += 2;
+    } else {
+      t = 3.0;
+      i += 3;
+    }
+    sum += t;
+    sumsq += t * t;
+    v++;
+  }
+  if (v < 2)
+    return 0.0;
+  mean = sum / v;
+  sd = sqrt((sumsq - v * mean * mean) / (v - 1));
+  x = mean - Z_ALPHA * sd / sqrt((double)v);
+
+  /* E[t] = 2 + 2pq, solved for the larger of p and q */
+  if (x >= 2.5)
+    return 1.0;
+  if (x <= 2.0)
+    return 0.0;
+  p = 0.5 + sqrt(1.25 - 0.5 * x);
+  return -log2(p);
+}
+
+/* 6.3.3 Markov */
+static double est_markov(const unsigned char *b, size_t n)
+{
+  size_t i, ones = 0, c[2][2] = {{0, 0}, {0, 0}};
+  double p0, p1, t[2][2], lp, best = -INFINITY;
+  double seq[6];
+  int k;
+
+  for (i = 0; i < n; i++) {
+    ones += b[i];
+    if (i + 1 < n)
+      c[b[i]][b[i + 1]]++;
+  }
+  p1 = (double)ones / n;
+  p0 = 1.0 - p1;
+  for (k = 0; k < 2; k++) {
+    double row = (double)(c[k][0] + c[k][1]);
+    t[k][0] = row ? c[k][0] / row : 0.0;
+    t[k][1] = row ? c[k][1] / row : 0.0;
+  }
+
+  /* log2 probabilities of the most likely 128 bit sequences */
+  seq[0] = log2(p0) + 127 * log2(t[0][0]);
+  seq[1] = log2(p0) + 64 * log2(t[0][1]) + 63 * log2(t[1][0]);
+  seq[2] = log2(p0) + log2(t[0][1]) + 126 * log2(t[1][1]);
+  seq[3] = log2(p1) + log2(t[1][0]) + 126 * log2(t[0][0]);
+  seq[4] = log2(p1) + 64 * log2(t[1][0]) + 63 * log2(t[0][1]);
+  seq[5] = log2(p1) + 127 * log2(t[1][1]);
+  for (k = 0; k < 6; k++) {
+    lp = seq[k];
+    if (!isnan(lp) && lp > best)
+      best = lp;
+  }
+  lp = -best / 128.0;
+  return lp > 1.0 ? 1.0 : lp;
+}
+
+/* Expected compression statistic for a block with probability z,
+ * the G(z) of 6.3.4, folded into a single O(L) pass.  lg[t] holds
+ * log2(t + 1). */
+static double compression_g(double z, const double *lg, size_t d, size_t l)
+{
+  double sum = 0.0, a = 0.0, pw = 1.0;
+  size_t t;
+
+  for (t = 1; t <= l; t++) {
+    if (pw < 1e-300) {
+      /* the tail no longer changes a, avoid crawling through denormals */
+      sum += a * (double)(l - (t > d ? t : d + 1) + 1);
+      break;
+    }
+    if (t > d)
+      sum += a + lg[t - 1] * z * pw;
+    a += lg[t - 1] * z * z * pw;
+    pw *= 1.0 - z;
+  }
+  return sum / (double)(l - d);
+}
+
+static double compression_expect(double p, const double *lg, size_t d, size_t l)
+{
+  const double k = (1 << COMPRESSION_B) - 1;
+  return compression_g(p, lg, d, l) + k * compression_g((1.0 - p) / k, lg, d, l);
+}
+
+/* 6.3.4 Compression */
+static double est_compression(const unsigned char *b, size_t n)
+{
+  size_t dict[1 << COMPRESSION_B];
+  size_t i, l = n / COMPRESSION_B, v;
+  double sum = 0.0, sumsq = 0.0, mean, sd, x, lo, hi, mid;
+  double *lg;
+  int j, k, s;
+
+  if (l <= COMPRESSION_D + 1)
+    return 0.0;
+  lg = malloc(l * sizeof(lg[0]));
+  if (!lg)
+    return 0.0;
+  for (i = 0; i < l; i++)
+    lg[i] = log2((double)(i + 1));
+  v = l - COMPRESSION_D;
+  memset(dict, 0, sizeof(dict));
+  for (i = 1; i <= l; i++) {
+    s = 0;
+    for (j = 0; j < COMPRESSION_B; j++)
+      s = (s << 1) | b[(i - 1) * COMPRESSION_B + j];
+    if (i > COMPRESSION_D) {
+      x = lg[(dict[s] ? i - dict[s] : i) - 1];
+      sum += x;
+      sumsq += x * x;
+    }
+    dict[s] = i;
+  }
+  mean = sum / v;
+  sd = sumsq / v - mean * mean;
+  sd = COMPRESSION_C * sqrt(sd > 0.0 ? sd : 0.0);
+  x = mean - Z_ALPHA * sd / sqrt((double)v);
+
+  lo = 1.0 / (1 << COMPRESSION_B);
+  hi = 1.0;
+  if (x >= compression_expect(lo, lg, COMPRESSION_D, l)) {
+    free(lg);
+    return 1.0;
+  }
+  for (k = 0; k < 40; k++) {
+    mid = (lo + hi) / 2.0;
+    if (compression_expect(mid, lg, COMPRESSION_D, l) > x)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  free(lg);
+  return -log2(hi) / COMPRESSION_B;
+}
+
+static double binary_min_entropy(const unsigned char *b, size_t n,
+				 struct entropy_estimate *out)
+{
+  double col, mar, com, h;
+
+  col = est_collision(b, n);
+  mar = est_markov(b, n);
+  com = est_compression(b, n);
+  if (out) {
+    out->collision = col;
+    out->markov = mar;
+    out->compression = com;
+  }
+  h = col < mar ? col : mar;
+  return h < com ? h : com;
+}
+
+double estimate_min_entropy(const uint16_t *samples, size_t n, uint16_t mask,
+			    struct entropy_estimate *out)
+{
+  uint16_t *s;
+  unsigned char *b;
+  size_t i, nbits, limit = ESTIMATE_WINDOW_BITS;
+  int j, bits = mask_bits(mask);
+  double mcv, tt, hb, h;
+
+  if (!bits || n < 2)
+    return 0.0;
+  s = malloc(n * sizeof(s[0]));
+  nbits = n * bits < limit ? n * bits : limit;
+  b = malloc(nbits);
+  if (!s || !b) {
+    free(s);
+    free(b);
+    return 0.0;
+  }
+  for (i = 0; i < n; i++)
+    s[i] = compact(samples[i], mask);
+  for (i = 0; i < nbits; i++) {
+    j = bits - 1 - (int)(i % bits);
+    b[i] = (s[i / bits] >> j) & 1;
+  }
+
+  mcv = est_mcv(s, n, bits);
+  tt = est_t_tuple(s, n, bits);
+  hb = binary_min_entropy(b, nbits, out);
+  free(s);
+  free(b);
+
+  /* H = min(H_original, bits * H_bitstring) */
+  h = mcv < tt ? mcv : tt;
+  if (bits * hb < h)
+    h = bits * hb;
+  if (out) {
+    out->mcv = mcv;
+    out->t_tuple = tt;
+    out->h_sample = h;
+    out->h_bit = h / bits;
+  }
+  return h;
+}
+
+double estimate_output_entropy(const unsigned char *buf, size_t len)
+{
+  unsigned char *b;
+  size_t i, n = len * 8, ones = 0;
+  double mcv, h;
+
+  b = malloc(n);
+  if (!b)
+    return 0.0;
+  for (i = 0; i < n; i++) {
+    b[i] = (buf[i / 8] >> (i % 8)) & 1;
+    ones += b[i];
+  }
+  mcv = (double)(ones > n - ones ? ones : n - ones) / n;
+  mcv = -log2(upper_bound(mcv, n));
+  h = binary_min_entropy(b, n, NULL);
+  free(b);
+  return mcv < h ? mcv : h;
+}
+
+static void *estimator_run(void *arg)
+{
+  struct estimator *est = arg;
+  struct entropy_estimate e;
+  struct timespec until;
+  unsigned char *output = NULL;
+  size_t output_len;
+  uint16_t *tmp, mask;
+#ifdef SCHED_IDLE
+  struct sched_param sp;
+
+  memset(&sp, 0, sizeof(sp));
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+#endif
+
+  output = malloc(ESTIMATE_WINDOW_BITS / 8);
+  pthread_mutex_lock(&est->lock);
+  while (!est->stop) {
+    while (!est->stop && est->fill < ESTIMATE_WINDOW_SAMPLES)
+      pthread_cond_wait(&est->cond, &est->lock);
+    if (est->stop)
+      break;
+
+    /* Take the full window, and whatever output has been collected */
+    tmp = est->work;
+    est->work = est->window;
+    est->window = tmp;
+    est->fill = 0;
+    output_len = 0;
+    if (output && est->output_fill >= MIN_OUTPUT_BYTES) {
+      output_len = est->output_fill;
+      memcpy(output, est->output, output_len);
+    }
+    est->output_fill = 0;
+    mask = est->mask;
+    pthread_mutex_unlock(&est->lock);
+
+    memset(&e, 0, sizeof(e));
+    estimate_min_entropy(est->work, ESTIMATE_WINDOW_SAMPLES, mask, &e);
+    e.h_output = output_len ? estimate_output_entropy(output, output_len) : -1.0;
+
+    pthread_mutex_lock(&est->lock);
+    e.runs = est->result.runs + 1;
+    est->result = e;
+
+    /* Sleep out the interval, then ask for a fresh window */
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += est->interval;
+    while (!est->stop &&
+	   pthread_cond_timedwait(&est->cond, &est->lock, &until) != ETIMEDOUT)
+      ;
+    est->want = 1;
+  }
+  pthread_mutex_unlock(&est->lock);
+  free(output);
+  return NULL;
+}
+
+int estimator_start(struct estimator *est, uint16_t mask, int interval)
+{
+  memset(est, 0, sizeof(*est));
+  est->window = malloc(ESTIMATE_WINDOW_SAMPLES * sizeof(est->window[0]));
+  est->work = malloc(ESTIMATE_WINDOW_SAMPLES * sizeof(est->work[0]));
+  est->output = malloc(ESTIMATE_WINDOW_BITS / 8);
+  if (!est->window || !est->work || !est->output)
+    goto fail;
+  est->mask = mask;
+  est->interval = interval;
+  est->want = 1;
+  pthread_mutex_init(&est->lock, NULL);
+  pthread_cond_init(&est->cond, NULL);
+  if (pthread_create(&est->thread, NULL, estimator_run, est) == 0)
+    return 0;
+  pthread_mutex_destroy(&est->lock);
+  pthread_cond_destroy(&est->cond);
+ fail:
+  free(est->window);
+  free(est->work);
+  free(est->output);
+  est->window = NULL;
+  return -1;
+}
+
+void estimator_stop(struct estimator *est)
+{
+  if (!est->window)
+    return;
+  pthread_mutex_lock(&est->lock);
+  est->stop = 1;
+  est->want = 0;
+  pthread_cond_signal(&est->cond);
+  pthread_mutex_unlock(&est->lock);
+  pthread_join(est->thread, NULL);
+  pthread_mutex_destroy(&est->lock);
+  pthread_cond_destroy(&est->cond);
+  free(est->window);
+  free(est->work);
+  free(est->output);
+  est->window = NULL;
+}
+
+void estimator_set_mask(struct estimator *est, uint16_t mask)
+{
+  if (!est->window)
+    return;
+  pthread_mutex_lock(&est->lock);
+  est->mask = mask;
+  pthread_mutex_unlock(&est->lock);
+}
+
+/* Returns the number of samples the window can still take, with the
+ * lock held, or 0 with it released. */
+static size_t feed_begin(struct estimator *est, size_t n)
+{
+  size_t room;
+
+  if (!est->want)
+    return 0;
+  if (pthread_mutex_trylock(&est->lock))
+    return 0;
+  room = ESTIMATE_WINDOW_SAMPLES - est->fill;
+  if (!est->want || !room) {
+    pthread_mutex_unlock(&est->lock);
+    return 0;
+  }
+  return n < room ? n : room;
+}
+
+static void feed_end(struct estimator *est, size_t n)
+{
+  est->fill += n;
+  if (est->fill == ESTIMATE_WINDOW_SAMPLES) {
+    est->want = 0;
+    pthread_cond_signal(&est->cond);
+  }
+  pthread_mutex_unlock(&est->lock);
+}
+
+void estimator_feed_u8(struct estimator *est, const uint8_t *samples, size_t n)
+{
+  size_t i;
+
+  n = feed_begin(est, n);
+  if (!n)
+    return;
+  for (i = 0; i < n; i++)
+    est->window[est->fill + i] = samples[i];
+  feed_end(est, n);
+}
+
+void estimator_feed_s16(struct estimator *est, const int16_t *samples, size_t n)
+{
+  size_t i;
+
+  n = feed_begin(est, n);
+  if (!n)
+    return;
+  for (i = 0; i < n; i++)
+    est->window[est->fill + i] = (uint16_t)samples[i];
+  feed_end(est, n);
+}
+
+void estimator_feed_output(struct estimator *est, const unsigned char *buf, size_t len)
+{
+  size_t room;
+
+  if (!est->want)
+    return;
+  if (pthread_mutex_trylock(&est->lock))
+    return;
+  room = ESTIMATE_WINDOW_BITS / 8 - est->output_fill;
+  if (len > room)
+    len = room;
+  memcpy(est->output + est->output_fill, buf, len);
+  est->output_fill += len;
+  pthread_mutex_unlock(&est->lock);
+}
+
+unsigned long estimator_get(struct estimator *est, struct entropy_estimate *out)
+{
+  unsigned long runs;
+
+  if (!est->window)
+    return 0;
+  if (pthread_mutex_trylock(&est->lock))
+    return 0;
+  *out = est->result;
+  runs = est->result.runs;
+  pthread_mutex_unlock(&est->lock);
+  return runs;
+}
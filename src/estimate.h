@@ -0,0 +1,103 @@
+/*
+ * estimate.h -- SP 800-90B non-IID min-entropy estimators
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef ESTIMATE__H
+#define ESTIMATE__H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Raw samples per estimation window, as recommended by SP 800-90B */
+#define ESTIMATE_WINDOW_SAMPLES 1000000
+/* Bits of vetted output per estimation window */
+#define ESTIMATE_WINDOW_BITS    1000000
+
+/* Results of one estimation run.  Estimates are in bits. */
+struct entropy_estimate {
+	double mcv;		/* most common value, per sample */
+	double t_tuple;		/* t-tuple, per sample */
+	double collision;	/* collision, per sampled bit */
+	double markov;		/* Markov, per sampled bit */
+	double compression;	/* compression, per sampled bit */
+	double h_sample;	/* assessed min-entropy per raw sample */
+	double h_bit;		/* assessed min-entropy per sampled bit */
+	double h_output;	/* assessed min-entropy per output bit, or -1 */
+	unsigned long runs;	/* number of completed estimation runs */
+};
+
+/* Background estimator.  The hot path only ever trylocks and copies
+ * into the window; all the work happens on a low priority thread. */
+struct estimator {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint16_t *window, *work;	/* raw samples, filling and analysing */
+	unsigned char *output;		/* vetted output bytes */
+	size_t fill, output_fill;
+	uint16_t mask;			/* bit planes used by the extractor */
+	int interval;			/* seconds between runs */
+	volatile int want;		/* window wants samples */
+	int stop;
+	struct entropy_estimate result;
+};
+
+/*
+ * Runs all estimators over n raw samples, using the bit planes set
+ * in mask.  out may be NULL.  Returns the min-entropy per sample.
+ */
+extern double estimate_min_entropy(const uint16_t *samples, size_t n,
+				   uint16_t mask, struct entropy_estimate *out);
+
+/*
+ * Runs the binary estimators over len bytes of output.  Returns the
+ * min-entropy per output bit.
+ */
+extern double estimate_output_entropy(const unsigned char *buf, size_t len);
+
+/* Starts the background thread, running every interval seconds.
+ * Returns 0 on success. */
+extern int estimator_start(struct estimator *est, uint16_t mask, int interval);
+extern void estimator_stop(struct estimator *est);
+extern void estimator_set_mask(struct estimator *est, uint16_t mask);
+
+/* Hot path feeds, these never block */
+extern void estimator_feed_u8(struct estimator *est, const uint8_t *samples, size_t n);
+extern void estimator_feed_s16(struct estimator *est, const int16_t *samples, size_t n);
+extern void estimator_feed_output(struct estimator *est, const unsigned char *buf, size_t len);
+
+/* Copies the latest published estimate into out.  Returns the number
+ * of completed runs, 0 if there is no estimate yet (or the estimator
+ * is busy). */
+extern unsigned long estimator_get(struct estimator *est, struct entropy_estimate *out);
+
+#endif /* ESTIMATE__H */
@@ -0,0 +1,379 @@
+/*
+ * extract.c -- Von Neumann extraction plans
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extract.h"
+
+const char *extractor_names[N_EXTRACTORS] = { "vn", "peres", "elias" };
+
+/* One byte of a Peres level: Von Neumann output, the XOR of each
+ * pair, and the value of each equal pair */
+struct peres_entry {
+  unsigned char out, nout, x, v, nv;
+};
+
+static struct peres_entry peres_lut[256];
+
+static void build_lut(struct extract_plan *plan)
+{
+  struct extract_entry *e;
+  int s, k, ch, ch2, bits;
+
+  plan->has_lut = plan->mask < (1 << EXTRACT_LUT_BITS);
+  if (!plan->has_lut)
+    return;
+  for (bits = 1; plan->mask >> bits; bits++)
+    ;
+  plan->lut_mask = (1 << bits) - 1;
+  for (s = 0; s <= plan->lut_mask; s++) {
+    e = &plan->lut[s];
+    memset(e, 0, sizeof(*e));
+    for (k = 0; k < plan->npairs; k++) {
+      ch = (s >> plan->a[k]) & 0x01;
+      ch2 = (s >> plan->b[k]) & 0x01;
+      if (ch != ch2) {
+	e->out |= ch << e->nout;
+	e->nout++;
+      } else {
+	e->discard |= ch << e->ndiscard;
+	e->ndiscard++;
+      }
+      e->raw |= (ch | (ch2 << 1)) << e->nraw;
+      e->nraw += 2;
+    }
+  }
+}
+
+void extract_plan_from_pairs(struct extract_plan *plan, const unsigned char *a,
+			     const unsigned char *b, int npairs)
+{
+  int k;
+
+  if (npairs > EXTRACT_MAX_PAIRS)
+    npairs = EXTRACT_MAX_PAIRS;
+  plan->npairs = npairs;
+  plan->mask = 0;
+  for (k = 0; k < npairs; k++) {
+    plan->a[k] = a[k];
+    plan->b[k] = b[k];
+    plan->mask |= (1 << a[k]) | (1 << b[k]);
+  }
+  build_lut(plan);
+}
+
+void extract_plan_from_mask(struct extract_plan *plan, uint16_t mask)
+{
+  unsigned char a[EXTRACT_MAX_PAIRS], b[EXTRACT_MAX_PAIRS];
+  int i, n = 0, have = -1;
+
+  for (i = 0; i < BITSTATS_PLANES; i++) {
+    if (!(mask & (1 << i)))
+      continue;
+    if (have < 0) {
+      have = i;
+    } else {
+      a[n] = have;
+      b[n] = i;
+      n++;
+      have = -1;
+    }
+  }
+  extract_plan_from_pairs(plan, a, b, n);
+}
+
+int extract_plan_adapt(struct extract_plan *plan, struct bitstats *bs,
+		       uint16_t candidates, double threshold)
+{
+  unsigned char a[EXTRACT_MAX_PAIRS], b[EXTRACT_MAX_PAIRS];
+  uint16_t mask = 0;
+  int k, n, changed = 0;
+
+  n = bitstats_select(bs, candidates, threshold, a, b);
+  for (k = 0; k < n; k++)
+    mask |= (1 << a[k]) | (1 << b[k]);
+
+  /* Same planes as now: only re-pair if a current pair has drifted,
+   * otherwise near equal biases would reshuffle pairs every time */
+  if (n && mask == plan->mask) {
+    for (k = 0; k < plan->npairs; k++) {
+      if (fabs(bitstats_pair_bias(bs, plan->a[k], plan->b[k])) > threshold)
+	changed = 1;
+    }
+  } else if (n) {
+    changed = 1;
+  }
+  bitstats_reset(bs);
+  if (changed)
+    extract_plan_from_pairs(plan, a, b, n);
+  return changed;
+}
+
+int extractor_parse(const char *name)
+{
+  int i;
+
+  for (i = 0; i < N_EXTRACTORS; i++) {
+    if (!strcmp(name, extractor_names[i]))
+      return i;
+  }
+  return -1;
+}
+
+/* Appends count bits to a zeroed bit buffer holding *n bits */
+static inline void append_bits(unsigned char *buf, size_t *n, unsigned int bits, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++, (*n)++) {
+    if ((bits >> i) & 1)
+      buf[*n >> 3] |= 1 << (*n & 7);
+  }
+}
+
+static void build_peres_lut(void)
+{
+  struct peres_entry *e;
+  int s, k, a, b;
+
+  for (s = 0; s < 256; s++) {
+    e = &peres_lut[s];
+    memset(e, 0, sizeof(*e));
+    for (k = 0; k < 8; k += 2) {
+      a = (s >> k) & 1;
+      b = (s >> (k + 1)) & 1;
+      if (a != b) {
+	e->out |= a << e->nout;
+	e->nout++;
+      } else {
+	e->v |= a << e->nv;
+	e->nv++;
+      }
+      e->x |= (a ^ b) << (k / 2);
+    }
+  }
+}
+
+static void peres(struct extractor *x, const unsigned char *in, size_t n, int level)
+{
+  const struct peres_entry *e;
+  unsigned char *u, *v;
+  size_t i, nu = 0, nv = 0, bytes;
+  int j, a, b;
+
+  if (level == PERES_DEPTH || n < 2) {
+    for (i = 0; i < n; i++)
+      x->discard(x->arg, (in[i >> 3] >> (i & 7)) & 1);
+    return;
+  }
+  u = x->scratch[2 * level];
+  v = x->scratch[2 * level + 1];
+  bytes = (PERES_BLOCK >> (level + 1)) / 8 + 1;
+  memset(u, 0, bytes);
+  memset(v, 0, bytes);
+
+  for (i = 0; i < n / 8; i++) {
+    e = &peres_lut[in[i]];
+    for (j = 0; j < e->nout; j++)
+      x->emit(x->arg, (e->out >> j) & 1);
+    append_bits(u, &nu, e->x, 4);
+    append_bits(v, &nv, e->v, e->nv);
+  }
+  for (i = (n / 8) * 8; i + 1 < n; i += 2) {
+    a = (in[i >> 3] >> (i & 7)) & 1;
+    b = (in[(i + 1) >> 3] >> ((i + 1) & 7)) & 1;
+    if (a != b)
+      x->emit(x->arg, a);
+    else
+      append_bits(v, &nv, a, 1);
+    append_bits(u, &nu, a ^ b, 1);
+  }
+  if (n & 1)
+    x->discard(x->arg, (in[(n - 1) >> 3] >> ((n - 1) & 7)) & 1);
+
+  peres(x, u, nu, level + 1);
+  peres(x, v, nv, level + 1);
+}
+
+static uint32_t choose(int n, int k)
+{
+  uint32_t c = 1;
+  int i;
+
+  if (k < 0 || k > n)
+    return 0;
+  for (i = 1; i <= k; i++)
+    c = c * (n - k + i) / i;
+  return c;
+}
+
+/* Elias output for every ELIAS_BITS bit block */
+static uint32_t *build_elias_lut(void)
+{
+  uint32_t *lut, rank, m, seg;
+  int k, i, j, p;
+
+  lut = malloc(sizeof(lut[0]) << ELIAS_BITS);
+  if (!lut)
+    return NULL;
+  for (i = 0; i < (1 << ELIAS_BITS); i++) {
+    /* rank among blocks of the same weight, combinatorial numbering */
+    rank = 0;
+    k = 0;
+    for (p = 0; p < ELIAS_BITS; p++) {
+      if ((i >> p) & 1) {
+	k++;
+	rank += choose(p, k);
+      }
+    }
+    /* find the power of two part of C(n, k) that rank falls in */
+    m = choose(ELIAS_BITS, k);
+    lut[i] = 0;
+    for (j = 31; j >= 0; j--) {
+      if (!((m >> j) & 1))
+	continue;
+      seg = (uint32_t)1 << j;
+      if (rank < seg) {
+	lut[i] = (rank << 5) | j;
+	break;
+      }
+      rank -= seg;
+    }
+  }
+  return lut;
+}
+
+int extractor_init(struct extractor *x, int type, extract_bit_fn emit,
+		   extract_bit_fn discard, void *arg)
+{
+  int level;
+
+  memset(x, 0, sizeof(*x));
+  x->type = type;
+  x->emit = emit;
+  x->discard = discard;
+  x->arg = arg;
+  switch (type) {
+  case EXTRACTOR_VN:
+    return 0;
+  case EXTRACTOR_PERES:
+    build_peres_lut();
+    x->raw = calloc(PERES_BLOCK / 8, 1);
+    if (!x->raw)
+      return -1;
+    for (level = 0; level < PERES_DEPTH; level++) {
+      x->scratch[2 * level] = malloc((PERES_BLOCK >> (level + 1)) / 8 + 1);
+      x->scratch[2 * level + 1] = malloc((PERES_BLOCK >> (level + 1)) / 8 + 1);
+      if (!x->scratch[2 * level] || !x->scratch[2 * level + 1]) {
+	extractor_free(x);
+	return -1;
+      }
+    }
+    return 0;
+  case EXTRACTOR_ELIAS:
+    x->elias = build_elias_lut();
+    return x->elias ? 0 : -1;
+  }
+  return -1;
+}
+
+void extractor_free(struct extractor *x)
+{
+  int i;
+
+  free(x->raw);
+  for (i = 0; i < 2 * PERES_DEPTH; i++)
+    free(x->scratch[i]);
+  free(x->elias);
+  memset(x, 0, sizeof(*x));
+}
+
+void extractor_reset(struct extractor *x)
+{
+  if (x->raw)
+    memset(x->raw, 0, PERES_BLOCK / 8);
+  x->nraw = 0;
+  x->acc = 0;
+  x->nacc = 0;
+}
+
+void extractor_add(struct extractor *x, uint32_t bits, int nbits)
+{
+  uint32_t e;
+  int i, a, b;
+
+  switch (x->type) {
+  case EXTRACTOR_VN:
+    for (i = 0; i + 1 < nbits; i += 2) {
+      a = (bits >> i) & 1;
+      b = (bits >> (i + 1)) & 1;
+      if (a != b)
+	x->emit(x->arg, a);
+      else
+	x->discard(x->arg, a);
+    }
+    break;
+
+  case EXTRACTOR_PERES:
+    for (i = 0; i < nbits; i++) {
+      if ((bits >> i) & 1)
+	x->raw[x->nraw >> 3] |= 1 << (x->nraw & 7);
+      if (++x->nraw == PERES_BLOCK) {
+	peres(x, x->raw, PERES_BLOCK, 0);
+	memset(x->raw, 0, PERES_BLOCK / 8);
+	x->nraw = 0;
+      }
+    }
+    break;
+
+  case EXTRACTOR_ELIAS:
+    x->acc |= (uint64_t)bits << x->nacc;
+    x->nacc += nbits;
+    while (x->nacc >= ELIAS_BITS) {
+      b = x->acc & ((1 << ELIAS_BITS) - 1);
+      e = x->elias[b];
+      if (e & 0x1f) {
+	for (i = 0; i < (int)(e & 0x1f); i++)
+	  x->emit(x->arg, (e >> (5 + i)) & 1);
+      } else {
+	/* nothing to extract, the hash ring can have it */
+	for (i = 0; i < ELIAS_BITS; i++)
+	  x->discard(x->arg, (b >> i) & 1);
+      }
+      x->acc >>= ELIAS_BITS;
+      x->nacc -= ELIAS_BITS;
+    }
+    break;
+  }
+}
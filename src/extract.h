@@ -0,0 +1,171 @@
+/*
+ * extract.h -- Von Neumann extraction plans
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef EXTRACT__H
+#define EXTRACT__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bitstats.h"
+
+#define EXTRACT_MAX_PAIRS (BITSTATS_PLANES / 2)
+
+/* What one sample yields: output bits and discarded bits, both LSB
+ * first, and the raw pair bits (a0 b0 a1 b1 ...) for extractors other
+ * than plain Von Neumann */
+struct extract_entry {
+	uint16_t raw;
+	unsigned char out, nout, discard, ndiscard, nraw;
+};
+
+#define EXTRACT_LUT_BITS 12	/* covers RTL2832 and bladeRF samples */
+
+/*
+ * Which bit planes of a sample are debiased against each other.  Pair
+ * k compares plane a[k] with plane b[k], and outputs the a[k] bit
+ * when they differ.  lut[] is indexed by the sample's low bits, up to
+ * the highest plane used (sample & lut_mask), and is only built when
+ * every plane is below EXTRACT_LUT_BITS.
+ */
+struct extract_plan {
+	uint16_t mask;
+	int npairs;
+	unsigned char a[EXTRACT_MAX_PAIRS], b[EXTRACT_MAX_PAIRS];
+	int has_lut;
+	uint16_t lut_mask;
+	struct extract_entry lut[1 << EXTRACT_LUT_BITS];
+};
+
+/* Pairs up adjacent set bits of mask: 0x3f gives (0,1) (2,3) (4,5) */
+extern void extract_plan_from_mask(struct extract_plan *plan, uint16_t mask);
+extern void extract_plan_from_pairs(struct extract_plan *plan, const unsigned char *a,
+				    const unsigned char *b, int npairs);
+
+/*
+ * Replans from the statistics in bs, restricted to the candidate
+ * planes, then resets bs.  Leaves the plan alone if no pairs pass.
+ * Returns 1 if the plan changed.
+ */
+extern int extract_plan_adapt(struct extract_plan *plan, struct bitstats *bs,
+			      uint16_t candidates, double threshold);
+
+/*
+ * Extractors take the raw pair bits of a plan, as a stream, and hand
+ * out unbiased bits through emit(), and bits they have no use for
+ * through discard().
+ *
+ *  - Von Neumann: one bit from each unequal pair.
+ *  - Peres: Von Neumann, then recursively the same on the XOR of each
+ *    pair and on the equal pairs, PERES_DEPTH deep, over blocks of
+ *    PERES_BLOCK bits.  Each level goes a byte at a time via a table.
+ *  - Elias: each ELIAS_BITS bit block with k ones is one of C(n, k)
+ *    equally likely strings; its rank is output, from a table, as
+ *    many bits as fit in a power of two.
+ */
+#define EXTRACTOR_VN	0
+#define EXTRACTOR_PERES	1
+#define EXTRACTOR_ELIAS	2
+#define N_EXTRACTORS	3
+
+#define PERES_DEPTH	8
+#define PERES_BLOCK	4096
+#define ELIAS_BITS	16
+
+extern const char *extractor_names[N_EXTRACTORS];
+
+typedef void (*extract_bit_fn)(void *arg, int bit);
+
+struct extractor {
+	int type;
+	extract_bit_fn emit, discard;
+	void *arg;			/* passed back to emit() and discard() */
+	unsigned char *raw;		/* Peres: bits waiting for a full block */
+	size_t nraw;
+	unsigned char *scratch[2 * PERES_DEPTH];
+	uint64_t acc;			/* Elias: bits waiting for a full block */
+	int nacc;
+	uint32_t *elias;		/* Elias table: output << 5 | length */
+};
+
+/* Returns the extractor called name, or -1 */
+extern int extractor_parse(const char *name);
+/* Returns 0 on success */
+extern int extractor_init(struct extractor *x, int type, extract_bit_fn emit,
+			  extract_bit_fn discard, void *arg);
+extern void extractor_free(struct extractor *x);
+/* Drops bits waiting for a full block, after a gap in the samples */
+extern void extractor_reset(struct extractor *x);
+/* Adds nbits raw bits, LSB first.  nbits should be even, and under 32 */
+extern void extractor_add(struct extractor *x, uint32_t bits, int nbits);
+
+/*
+ * Table driven extraction kernels, instantiated once per sample type
+ * and per program.  The sample width, and the sinks taking the bits,
+ * are fixed where a kernel is instantiated, so each one compiles to a
+ * straight loop of table lookups with the sinks inlined, and a new
+ * sample format is one more line.  The plan must have a table.
+ *
+ * EXTRACT_VN_KERNEL calls put_fn(ctx, bits, nbits) with the Von
+ * Neumann output, and discard_fn(ctx, bits, nbits) with the equal
+ * pairs, both LSB first.  EXTRACT_RAW_KERNEL feeds an extractor the raw pair bits.
+ */
+#define EXTRACT_VN_KERNEL(name, sample_t, ctx_t, put_fn, discard_fn)	\
+static inline void name(ctx_t *ctx, const struct extract_plan *plan,	\
+			const sample_t *samples, size_t n)		\
+{									\
+	const struct extract_entry *e;					\
+	size_t i;							\
+									\
+	for (i = 0; i < n; i++) {					\
+		e = &plan->lut[(uint16_t)samples[i] & plan->lut_mask];	\
+		if (e->ndiscard)					\
+			discard_fn(ctx, e->discard, e->ndiscard);	\
+		if (e->nout)						\
+			put_fn(ctx, e->out, e->nout);			\
+	}								\
+}
+
+#define EXTRACT_RAW_KERNEL(name, sample_t)				\
+static inline void name(struct extractor *x, const struct extract_plan *plan, \
+			const sample_t *samples, size_t n)		\
+{									\
+	const struct extract_entry *e;					\
+	size_t i;							\
+									\
+	for (i = 0; i < n; i++) {					\
+		e = &plan->lut[(uint16_t)samples[i] & plan->lut_mask];	\
+		extractor_add(x, e->raw, e->nraw);			\
+	}								\
+}
+
+#endif /* EXTRACT__H */
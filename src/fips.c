@@ -81,64 +81,131 @@ const unsigned int fips_test_mask[N_FIPS_TESTS] = {
 */
 
 
+/*
+ * What a byte does to the runs test, MSB first: how long its first and
+ * last runs are, and the buckets of the runs wholly inside it.  Runs
+ * are bucketed, as below, by one less than their length and by the
+ * bit that ends them.
+ */
+struct fips_byte {
+	unsigned char ones, lead, trail, nruns;
+	unsigned char run[6];
+};
+
+static struct fips_byte fips_bytes[256];
+static int fips_bytes_built;
+
+static void fips_build_bytes(void)
+{
+	struct fips_byte *e;
+	int b, j, bit, len;
+
+	for (b = 0; b < 256; b++) {
+		e = &fips_bytes[b];
+		memset(e, 0, sizeof(*e));
+		for (j = 7, len = 0; j >= 0; j--) {
+			bit = (b >> j) & 1;
+			e->ones += bit;
+			len++;
+			/* a run ends at j if the next bit differs */
+			if (j > 0 && ((b >> (j - 1)) & 1) != bit) {
+				if (!e->lead)
+					e->lead = len;
+				else
+					e->run[e->nruns++] = (len - 1) + 6 * !bit;
+				len = 0;
+			}
+		}
+		e->trail = len;
+		if (!e->lead)
+			e->lead = 8;
+	}
+	fips_bytes_built = 1;
+}
+
+/* Ends the current run, and starts one of bit */
+static inline void fips_end_run(fips_ctx_t *ctx, int bit)
+{
+	/* If runlength is 1-6 count it in correct bucket. 0's go in
+	   runs[0-5] 1's go in runs[6-11] hence the 6*bit below */
+	if (ctx->rlength < 5)
+		ctx->runs[ctx->rlength + (6 * bit)]++;
+	else
+		ctx->runs[5 + (6 * bit)]++;
+
+	/* Check if we just failed longrun test */
+	if (ctx->rlength >= 25)
+		ctx->longrun = 1;
+}
+
 /*
  * fips_test_store - store 8 bits of entropy in FIPS
  * 			 internal test data pool
+ *
+ * Note rlength is always one less than the actual run length.  This
+ * makes things easier.
  */
 static void fips_test_store(fips_ctx_t *ctx, unsigned int rng_data)
 {
-	int j;
+	const struct fips_byte *e = &fips_bytes[rng_data];
+	int first = rng_data >> 7, j;
 
 	ctx->poker[rng_data >> 4]++;
 	ctx->poker[rng_data & 15]++;
+	ctx->ones += e->ones;
 
-	/* Note in the loop below rlength is always one less than the actual
-	   run length. This makes things easier. */
-	for (j = 7; j >= 0; j--) {
-		ctx->ones += ctx->current_bit = ((rng_data >> j) & 1);
-		if (ctx->current_bit != ctx->last_bit) {
-			/* If runlength is 1-6 count it in correct bucket. 0's go in
-			   runs[0-5] 1's go in runs[6-11] hence the 6*current_bit below */
-			if (ctx->rlength < 5) {
-				ctx->runs[ctx->rlength +
-				     (6 * ctx->current_bit)]++;
-			} else {
-				ctx->runs[5 + (6 * ctx->current_bit)]++;
-			}
+	if (first != ctx->last_bit) {
+		fips_end_run(ctx, first);
+		ctx->rlength = e->lead - 1;
+		ctx->last_bit = first;
+	} else {
+		ctx->rlength += e->lead;
+	}
+	if (e->lead < 8) {
+		fips_end_run(ctx, !first);
+		for (j = 0; j < e->nruns; j++)
+			ctx->runs[e->run[j]]++;
+		ctx->rlength = e->trail - 1;
+		ctx->last_bit = rng_data & 1;
+	}
+	ctx->current_bit = rng_data & 1;
+}
 
-			/* Check if we just failed longrun test */
-			if (ctx->rlength >= 25)
-				ctx->longrun = 1;
-			ctx->rlength = 0;
-			/* flip the current run type */
-			ctx->last_bit = ctx->current_bit;
-		} else {
-			ctx->rlength++;
-		}
+void fips_add_byte(fips_ctx_t *ctx, unsigned int byte)
+{
+	ctx->word |= byte << (8 * ctx->nbytes);
+	if (++ctx->nbytes == 4) {
+		if (ctx->word == ctx->last32)
+			ctx->continuous = 1;
+		ctx->last32 = ctx->word;
+		ctx->word = 0;
+		ctx->nbytes = 0;
 	}
+	fips_test_store(ctx, byte);
 }
 
 int fips_run_rng_test (fips_ctx_t *ctx, const void *buf)
 {
-	int i, j;
-	int rng_test = 0;
-	unsigned char *rngdatabuf;
+	const unsigned char *rngdatabuf;
+	int i;
 
 	if (!ctx) return -1;
 	if (!buf) return -1;
-	rngdatabuf = (unsigned char *)buf;
-
-	for (i=0; i<FIPS_RNG_BUFFER_SIZE; i += 4) {
-		unsigned int new32 = rngdatabuf[i] |
-			    ( rngdatabuf[i+1] << 8 ) |
-			    ( rngdatabuf[i+2] << 16 ) |
-			    ( rngdatabuf[i+3] << 24 );
-		if (new32 == ctx->last32) rng_test |= FIPS_RNG_CONTINUOUS_RUN;
-		ctx->last32 = new32;
-		fips_test_store(ctx, rngdatabuf[i]);
-		fips_test_store(ctx, rngdatabuf[i+1]);
-		fips_test_store(ctx, rngdatabuf[i+2]);
-		fips_test_store(ctx, rngdatabuf[i+3]);
+	rngdatabuf = (const unsigned char *)buf;
+
+	for (i = 0; i < FIPS_RNG_BUFFER_SIZE; i++)
+		fips_add_byte(ctx, rngdatabuf[i]);
+	return fips_end_block(ctx);
+}
+
+int fips_end_block(fips_ctx_t *ctx)
+{
+	int i, j;
+	int rng_test = 0;
+
+	if (ctx->continuous) {
+		rng_test |= FIPS_RNG_CONTINUOUS_RUN;
+		ctx->continuous = 0;
 	}
 
 	/* add in the last (possibly incomplete) run */
@@ -187,12 +254,16 @@ int fips_run_rng_test (fips_ctx_t *ctx, const void *buf)
 	ctx->ones = 0;
 	ctx->rlength = -1;
 	ctx->current_bit = 0;
+	ctx->word = 0;
+	ctx->nbytes = 0;
 
 	return rng_test;
 }
 
 void fips_init(fips_ctx_t *ctx, unsigned int last32)
 {
+	if (!fips_bytes_built)
+		fips_build_bytes();
 	if (ctx) {
 		memset (ctx->poker, 0, sizeof (ctx->poker));
 		memset (ctx->runs, 0, sizeof (ctx->runs));
@@ -202,6 +273,9 @@ void fips_init(fips_ctx_t *ctx, unsigned int last32)
 		ctx->current_bit = 0;
 		ctx->last_bit = 0;
 		ctx->last32 = last32;
+		ctx->word = 0;
+		ctx->nbytes = 0;
+		ctx->continuous = 0;
 	}
 }
 
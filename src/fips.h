@@ -42,6 +42,8 @@ struct fips_ctx {
 	int poker[16], runs[12];
 	int ones, rlength, current_bit, last_bit, longrun;
 	unsigned int last32;
+	unsigned int word;		/* bytes added towards the next 32 bits */
+	int nbytes, continuous;
 };
 typedef struct fips_ctx fips_ctx_t;
 
@@ -82,4 +84,14 @@ extern const unsigned int fips_test_mask[N_FIPS_TESTS];
  */
 extern int fips_run_rng_test(fips_ctx_t *ctx, const void *buf);
 
+/*
+ * The same tests, a byte at a time, for callers that test bits as they
+ * produce them rather than re-reading a finished buffer.  After
+ * FIPS_RNG_BUFFER_SIZE calls to fips_add_byte(), fips_end_block()
+ * returns what fips_run_rng_test() would have for those bytes.  Called
+ * early, it drops a partial block.
+ */
+extern void fips_add_byte(fips_ctx_t *ctx, unsigned int byte);
+extern int fips_end_block(fips_ctx_t *ctx);
+
 #endif /* FIPS__H */
@@ -0,0 +1,114 @@
+/*
+ * govern.c -- Steps the sample rate to meet a target output rate
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include "govern.h"
+#include "metrics.h"
+
+#define XCHG(x) __atomic_exchange_n(&(x), 0, __ATOMIC_RELAXED)
+
+uint32_t governor_init(struct governor *g, double target,
+		       const uint32_t *rates, int nrates, uint32_t rate)
+{
+  g->rates = rates;
+  g->nrates = nrates;
+  for (g->step = nrates - 1; g->step > 0 && rates[g->step] > rate; g->step--)
+    ;
+  g->ceiling = nrates - 1;
+  g->settling = 1;
+  g->target = target;
+  g->output_rate = 0;
+  g->bytes = g->blocked_ns = 0;
+  g->drops = 0;
+  clock_gettime(CLOCK_MONOTONIC, &g->since);
+  g->reprobe = 0;
+  metrics_set("governor_sample_rate", NULL, rates[g->step]);
+  metrics_set("governor_ceiling_rate", NULL, rates[g->ceiling]);
+  return rates[g->step];
+}
+
+void governor_output(struct governor *g, size_t len, unsigned long long blocked_ns)
+{
+  __atomic_add_fetch(&g->bytes, len, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g->blocked_ns, blocked_ns, __ATOMIC_RELAXED);
+}
+
+void governor_drop(struct governor *g, unsigned long n)
+{
+  __atomic_add_fetch(&g->drops, n, __ATOMIC_RELAXED);
+}
+
+uint32_t governor_check(struct governor *g)
+{
+  struct timespec now;
+  double elapsed, rate, blocked;
+  unsigned long drops;
+  int step = g->step;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = (now.tv_sec - g->since.tv_sec) + (now.tv_nsec - g->since.tv_nsec) / 1e9;
+  if (elapsed < GOVERN_INTERVAL)
+    return 0;
+  g->since = now;
+  rate = g->output_rate = XCHG(g->bytes) / elapsed;
+  blocked = XCHG(g->blocked_ns) / 1e9 / elapsed;
+  drops = XCHG(g->drops);
+  metrics_set("governor_output_rate", NULL, rate);
+  metrics_set("governor_blocked_ratio", NULL, blocked);
+
+  if (drops >= GOVERN_DROPS) {
+    /* this rate is more than the host keeps up with */
+    if (step > 0)
+      g->ceiling = --step;
+    g->reprobe = now.tv_sec + GOVERN_REPROBE;
+  } else if (g->reprobe && now.tv_sec >= g->reprobe) {
+    if (g->ceiling < g->nrates - 1)
+      g->ceiling++;
+    g->reprobe = g->ceiling < g->nrates - 1 ? now.tv_sec + GOVERN_REPROBE : 0;
+  }
+  if (g->settling)
+    g->settling = 0;
+  else if (blocked > GOVERN_BLOCKED && step > 0 && !drops)
+    step--;
+  else if (rate < g->target && step < g->ceiling && !drops)
+    step++;
+  else
+    /* as far down as still makes the target, output scaling with the rate */
+    while (step > 0 && rate * g->rates[step - 1] / g->rates[g->step] >= g->target * GOVERN_HEADROOM)
+      step--;
+  metrics_set("governor_ceiling_rate", NULL, g->rates[g->ceiling]);
+  if (step == g->step)
+    return 0;
+  g->step = step;
+  g->settling = 1;
+  metrics_set("governor_sample_rate", NULL, g->rates[step]);
+  return g->rates[step];
+}
@@ -0,0 +1,89 @@
+/*
+ * govern.h -- Steps the sample rate to meet a target output rate
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef GOVERN__H
+#define GOVERN__H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Picks, from a table of sample rates the device is stable at, the
+ * lowest that delivers a target output rate.  Every GOVERN_INTERVAL it
+ * compares the bytes written out with the target and steps a rate up,
+ * or down to the lowest predicted to still make it.  Time spent
+ * blocked writing means the consumer, not the device, is what limits
+ * the output, so more samples would only burn CPU and USB bandwidth;
+ * that steps down too.  Drops at a rate (short
+ * reads, overruns, failed streams) make the rate below it the ceiling,
+ * which is tried again after GOVERN_REPROBE seconds without drops, so
+ * the highest rate the host keeps up with is found and followed.
+ */
+#define GOVERN_INTERVAL	10	/* seconds measured per decision */
+#define GOVERN_DROPS	2	/* in a window, and it's more than a one-off glitch */
+#define GOVERN_REPROBE	600	/* seconds without drops before the ceiling goes up */
+#define GOVERN_BLOCKED	0.5	/* of the time in writes, and the consumer is the limit */
+#define GOVERN_HEADROOM	1.1	/* over target a step down must still be predicted at */
+
+struct governor {
+	const uint32_t *rates;		/* ascending */
+	int nrates;
+	int step;			/* rates[step] is in use */
+	int ceiling;			/* highest step without drops */
+	int settling;			/* the first window after a step doesn't count */
+	double target;			/* output bytes per second */
+	double output_rate;		/* delivered, over the last window */
+	unsigned long long bytes;	/* since the last check */
+	unsigned long long blocked_ns;
+	unsigned long drops;
+	struct timespec since;
+	time_t reprobe;			/* when the ceiling goes up a step */
+};
+
+/* Starts at the highest rate not above rate, which it returns */
+extern uint32_t governor_init(struct governor *g, double target,
+			      const uint32_t *rates, int nrates, uint32_t rate);
+/* Counts output, and the time it took to write.  Any thread. */
+extern void governor_output(struct governor *g, size_t len, unsigned long long blocked_ns);
+/*
+ * Counts n losses of samples at the current rate, GOVERN_DROPS for a
+ * stream that failed outright.  Any thread.
+ */
+extern void governor_drop(struct governor *g, unsigned long n);
+/*
+ * Once per GOVERN_INTERVAL, weighs the window and publishes it.
+ * Returns the rate to step to, or 0 to stay.
+ */
+extern uint32_t governor_check(struct governor *g);
+
+#endif /* GOVERN__H */
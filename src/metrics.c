@@ -0,0 +1,134 @@
+/*
+ * metrics.c -- named values for monitoring
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+
+struct metric {
+  char name[METRICS_NAME_LEN];
+  char labels[METRICS_LABELS_LEN];
+  double value;
+};
+
+static struct metric metrics[METRICS_MAX];
+static int nmetrics = 0;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Finds or adds a metric, with metrics_lock held.  NULL if full, or too long. */
+static struct metric *lookup(const char *name, const char *labels)
+{
+  struct metric *m;
+  int i;
+
+  if (!labels)
+    labels = "";
+  if (strlen(name) >= METRICS_NAME_LEN || strlen(labels) >= METRICS_LABELS_LEN)
+    return NULL;
+  for (i = 0; i < nmetrics; i++) {
+    m = &metrics[i];
+    if (!strcmp(m->name, name) && !strcmp(m->labels, labels))
+      return m;
+  }
+  if (nmetrics == METRICS_MAX)
+    return NULL;
+  m = &metrics[nmetrics++];
+  strcpy(m->name, name);
+  strcpy(m->labels, labels);
+  m->value = 0.0;
+  return m;
+}
+
+void metrics_set(const char *name, const char *labels, double value)
+{
+  struct metric *m;
+
+  pthread_mutex_lock(&metrics_lock);
+  m = lookup(name, labels);
+  if (m)
+    m->value = value;
+  pthread_mutex_unlock(&metrics_lock);
+}
+
+void metrics_add(const char *name, const char *labels, double delta)
+{
+  struct metric *m;
+
+  pthread_mutex_lock(&metrics_lock);
+  m = lookup(name, labels);
+  if (m)
+    m->value += delta;
+  pthread_mutex_unlock(&metrics_lock);
+}
+
+double metrics_get(const char *name, const char *labels)
+{
+  struct metric *m;
+  double value = 0.0;
+
+  pthread_mutex_lock(&metrics_lock);
+  m = lookup(name, labels);
+  if (m)
+    value = m->value;
+  pthread_mutex_unlock(&metrics_lock);
+  return value;
+}
+
+int metrics_write(const char *path)
+{
+  char tmp[4096];
+  FILE *fh;
+  int i, r;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    return -1;
+  fh = fopen(tmp, "w");
+  if (!fh)
+    return -1;
+  pthread_mutex_lock(&metrics_lock);
+  for (i = 0; i < nmetrics; i++) {
+    if (metrics[i].labels[0])
+      fprintf(fh, "rtl_entropy_%s{%s} %.6g\n", metrics[i].name,
+	      metrics[i].labels, metrics[i].value);
+    else
+      fprintf(fh, "rtl_entropy_%s %.6g\n", metrics[i].name, metrics[i].value);
+  }
+  pthread_mutex_unlock(&metrics_lock);
+  r = fclose(fh);
+  if (r || rename(tmp, path)) {
+    remove(tmp);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * metrics.h -- named values for monitoring
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef METRICS__H
+#define METRICS__H
+
+/*
+ * A small table of named values, written out in the Prometheus text
+ * format so a node_exporter textfile collector (or a human with cat)
+ * can pick them up.  Names get an "rtl_entropy_" prefix.  labels is
+ * either NULL or a label list without the braces, e.g. "plane=\"3\"".
+ * A name or labels too long to keep whole are ignored, rather than
+ * cut short into a series that never matches itself again.
+ */
+#define METRICS_MAX 512
+#define METRICS_NAME_LEN 48
+/* Room for a device's labels, a 31 character name, plus a peer's name */
+#define METRICS_LABELS_LEN 96
+
+extern void metrics_set(const char *name, const char *labels, double value);
+extern void metrics_add(const char *name, const char *labels, double delta);
+extern double metrics_get(const char *name, const char *labels);
+
+/* Writes every value to path, atomically.  Returns 0 on success. */
+extern int metrics_write(const char *path);
+
+#endif /* METRICS__H */
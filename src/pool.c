@@ -0,0 +1,256 @@
+/*
+ * pool.c -- entropy pool with mixing and accounting
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/evp.h>
+
+#include "arena.h"
+#include "log.h"
+#include "pool.h"
+
+const char *pool_modes[2] = { "nonblocking", "blocking" };
+
+/* Taps of the Linux 4096 bit input pool */
+static const int taps[5] = { 104, 76, 51, 25, 1 };
+
+static const uint32_t twist[8] = {
+  0x00000000, 0x3b6e20c8, 0x76dc4190, 0x4db26158,
+  0xedb88320, 0xd6d6a3e8, 0x9b64c2b0, 0xa00ae278
+};
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+int pool_parse_mode(const char *name)
+{
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (!strcmp(name, pool_modes[i]))
+      return i;
+  }
+  return -1;
+}
+
+void pool_init(struct pool *p)
+{
+  memset(p, 0, sizeof(*p));
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+}
+
+int pool_add_source(struct pool *p, const char *name)
+{
+  int id;
+
+  pthread_mutex_lock(&p->lock);
+  id = p->nsources < POOL_MAX_SOURCES ? p->nsources++ : -1;
+  if (id >= 0)
+    snprintf(p->sources[id].name, sizeof(p->sources[id].name), "%s", name);
+  pthread_mutex_unlock(&p->lock);
+  return id;
+}
+
+static inline uint32_t rol32(uint32_t w, int n)
+{
+  return n ? (w << n) | (w >> (32 - n)) : w;
+}
+
+/* Mixes one word in.  The slot is claimed atomically, and written with
+ * compare and swap, so concurrent mixers never lose each other's input. */
+static void mix_word(struct pool *p, uint32_t in)
+{
+  unsigned int i;
+  uint32_t w, old, t, new;
+  int k;
+
+  i = (__atomic_sub_fetch(&p->add_ptr, 1, __ATOMIC_RELAXED)) & (POOL_WORDS - 1);
+  w = rol32(in, (i * 7) & 31);
+  old = LOAD(p->words[i]);
+  do {
+    t = w ^ old;
+    for (k = 0; k < 5; k++)
+      t ^= LOAD(p->words[(i + taps[k]) & (POOL_WORDS - 1)]);
+    new = (t >> 3) ^ twist[t & 7];
+  } while (!__atomic_compare_exchange_n(&p->words[i], &old, new, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void mix_bytes(struct pool *p, const unsigned char *buf, size_t len)
+{
+  uint32_t w;
+  size_t i;
+
+  for (i = 0; i + 4 <= len; i += 4)
+    mix_word(p, (uint32_t)buf[i] | ((uint32_t)buf[i + 1] << 8) |
+	     ((uint32_t)buf[i + 2] << 16) | ((uint32_t)buf[i + 3] << 24));
+  if (i < len) {
+    for (w = 0; i < len; i++)
+      w = (w << 8) | buf[i];
+    mix_word(p, w);
+  }
+}
+
+void pool_mix(struct pool *p, int source, const unsigned char *buf, size_t len,
+	      double entropy_bits)
+{
+  long credit, cur, next, max = (long)POOL_BITS << POOL_FRAC_BITS;
+
+  mix_bytes(p, buf, len);
+  if (entropy_bits > len * 8.0)
+    entropy_bits = len * 8.0;
+  credit = entropy_bits > 0 ? (long)(entropy_bits * (1 << POOL_FRAC_BITS)) : 0;
+  if (source >= 0 && source < POOL_MAX_SOURCES) {
+    __atomic_add_fetch(&p->sources[source].bytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&p->sources[source].credited, credit, __ATOMIC_RELAXED);
+  }
+  if (credit == 0)
+    return;
+  cur = LOAD(p->entropy);
+  do {
+    next = cur + credit > max ? max : cur + credit;
+  } while (!__atomic_compare_exchange_n(&p->entropy, &cur, next, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  if (LOAD(p->waiters)) {
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+double pool_entropy(struct pool *p)
+{
+  return (double)LOAD(p->entropy) / (1 << POOL_FRAC_BITS);
+}
+
+/* Takes want (1/8 bits) from the account: all of it or nothing when
+ * blocking, as much as there is otherwise.  Returns non-zero on success. */
+static int debit(struct pool *p, long want, int blocking)
+{
+  long cur, next;
+
+  cur = LOAD(p->entropy);
+  do {
+    if (cur < want && blocking)
+      return 0;
+    next = cur > want ? cur - want : 0;
+  } while (!__atomic_compare_exchange_n(&p->entropy, &cur, next, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  return 1;
+}
+
+static void extract_block(struct pool *p, unsigned char out[POOL_EXTRACT])
+{
+  uint32_t snap[POOL_WORDS];
+  unsigned char md[2 * POOL_EXTRACT];
+  int i;
+
+  for (i = 0; i < POOL_WORDS; i++)
+    snap[i] = LOAD(p->words[i]);
+  EVP_Digest(snap, sizeof(snap), md, NULL, EVP_sha512(), NULL);
+  /* so the next output can't be worked back to this one */
+  mix_bytes(p, md, sizeof(md));
+  for (i = 0; i < POOL_EXTRACT; i++)
+    out[i] = md[i] ^ md[i + POOL_EXTRACT];
+  memset(md, 0, sizeof(md));
+  memset(snap, 0, sizeof(snap));
+}
+
+size_t pool_extract(struct pool *p, unsigned char *out, size_t len, int blocking,
+		    volatile int *stop)
+{
+  unsigned char block[POOL_EXTRACT];
+  size_t done = 0, n;
+  struct timespec ts;
+
+  while (done < len) {
+    n = len - done < POOL_EXTRACT ? len - done : POOL_EXTRACT;
+    if (!debit(p, (long)n * 8 << POOL_FRAC_BITS, blocking)) {
+      if (stop && *stop)
+	break;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += 1;
+      pthread_mutex_lock(&p->lock);
+      __atomic_add_fetch(&p->waiters, 1, __ATOMIC_SEQ_CST);
+      if (LOAD(p->entropy) < (long)n * 8 << POOL_FRAC_BITS)
+	pthread_cond_timedwait(&p->cond, &p->lock, &ts);
+      __atomic_sub_fetch(&p->waiters, 1, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&p->lock);
+      continue;
+    }
+    extract_block(p, block);
+    memcpy(out + done, block, n);
+    done += n;
+  }
+  memset(block, 0, sizeof(block));
+  __atomic_add_fetch(&p->extracted, done, __ATOMIC_RELAXED);
+  return done;
+}
+
+static void *reader_run(void *arg)
+{
+  struct pool_reader *r = arg;
+  unsigned char *buf;
+  size_t n;
+
+  /* a page of its own, so -H locked keeps it off swap */
+  buf = arena_map(POOL_READ_BYTES);
+  if (!buf) {
+    log_line(LOG_INFO, "WARNING: Out of memory for the pool reader");
+    return NULL;
+  }
+  while (!r->stop) {
+    n = pool_extract(r->pool, buf, POOL_READ_BYTES, r->blocking, &r->stop);
+    if (n)
+      r->write(buf, n);
+  }
+  memset(buf, 0, POOL_READ_BYTES);
+  arena_unmap(buf, POOL_READ_BYTES);
+  return NULL;
+}
+
+int pool_reader_start(struct pool_reader *r, struct pool *p, int blocking,
+		      void (*write)(const unsigned char *buf, size_t len))
+{
+  memset(r, 0, sizeof(*r));
+  r->pool = p;
+  r->blocking = blocking;
+  r->write = write;
+  return pthread_create(&r->thread, NULL, reader_run, r) ? -1 : 0;
+}
+
+void pool_reader_stop(struct pool_reader *r)
+{
+  r->stop = 1;
+  pthread_join(r->thread, NULL);
+}
@@ -0,0 +1,112 @@
+/*
+ * pool.h -- entropy pool with mixing and accounting
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef POOL__H
+#define POOL__H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * A /dev/random style input pool, see CryptoNotes.txt.  Input is
+ * mixed in a word at a time with the twisted GFSR polynomial of the
+ * Linux 4096 bit pool.  Extraction hashes the whole pool with SHA-512,
+ * mixes the hash back in, and hands out the two halves XORed together.
+ *
+ * Mixing and accounting are lock free, so any number of sources can
+ * add at once; only readers waiting for entropy ever sleep.
+ */
+#define POOL_WORDS		128
+#define POOL_BITS		(POOL_WORDS * 32)
+#define POOL_EXTRACT		32	/* bytes per hash */
+#define POOL_FRAC_BITS		3	/* account in 1/8 bits */
+#define POOL_MAX_SOURCES	16
+#define POOL_READ_BYTES		4096	/* handed to write() at a time */
+
+#define POOL_NONBLOCKING	0
+#define POOL_BLOCKING		1
+
+extern const char *pool_modes[2];
+
+struct pool_source {
+	char name[32];
+	unsigned long long bytes;	/* mixed in */
+	unsigned long long credited;	/* entropy, in 1/8 bits */
+};
+
+struct pool {
+	uint32_t words[POOL_WORDS];
+	unsigned int add_ptr;
+	long entropy;			/* 1/8 bits, 0 to POOL_BITS << POOL_FRAC_BITS */
+	unsigned long long extracted;	/* bytes */
+	int nsources;
+	struct pool_source sources[POOL_MAX_SOURCES];
+	int waiters;
+	pthread_mutex_t lock;		/* only for sleeping readers */
+	pthread_cond_t cond;
+};
+
+/* Returns the mode called name, or -1 */
+extern int pool_parse_mode(const char *name);
+extern void pool_init(struct pool *p);
+/* Not lock free, for setup.  Returns the source id, or -1 if full. */
+extern int pool_add_source(struct pool *p, const char *name);
+/* Mixes len bytes from source in, crediting entropy_bits */
+extern void pool_mix(struct pool *p, int source, const unsigned char *buf, size_t len,
+		     double entropy_bits);
+/* Entropy in the account, in bits */
+extern double pool_entropy(struct pool *p);
+/*
+ * Extracts up to len bytes.  Blocking, it waits for the account to
+ * cover every POOL_EXTRACT bytes, and gives up early (returning what
+ * it has) once *stop is set.  Non-blocking, it just debits what there
+ * is.  Returns the number of bytes extracted.
+ */
+extern size_t pool_extract(struct pool *p, unsigned char *out, size_t len, int blocking,
+			   volatile int *stop);
+
+/* A thread extracting from the pool and handing the output on */
+struct pool_reader {
+	pthread_t thread;
+	struct pool *pool;
+	int blocking;
+	void (*write)(const unsigned char *buf, size_t len);
+	volatile int stop;
+};
+
+/* Returns 0 on success */
+extern int pool_reader_start(struct pool_reader *r, struct pool *p, int blocking,
+			     void (*write)(const unsigned char *buf, size_t len));
+extern void pool_reader_stop(struct pool_reader *r);
+
+#endif /* POOL__H */
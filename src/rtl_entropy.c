@@ -37,8 +37,10 @@
  * files in the program, then also delete it here.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -56,22 +58,109 @@
 #include <sys/time.h>
 #else
 #include <time.h>
+#include <sched.h>
 #include <sys/capability.h>
 #include <sys/prctl.h>
 #endif
 
 #include "rtl-sdr.h"
 #include "fips.h"
+#include "estimate.h"
+#include "extract.h"
+#include "metrics.h"
+#include "condition.h"
+#include "correlate.h"
+#include "arena.h"
+#include "cache.h"
+#include "cpu.h"
+#include "drbg.h"
+#include "duty.h"
+#include "govern.h"
+#include "pool.h"
+#include "state.h"
 #include "util.h"
 #include "log.h"
 #include "defines.h"
 
+/*
+ * One dongle, and the pipeline from its samples to vetted output.
+ * Each runs on its own thread; only the sinks are shared.
+ */
+struct device {
+	uint32_t index;
+	char name[32];			/* as given to -d, index or serial */
+	char labels[48];		/* device="name", for metrics */
+	rtlsdr_dev_t *dev;
+	pthread_mutex_t lock;		/* dev, against the watchdog */
+	pthread_t thread;
+	int cpu;			/* core to pin to, or -1 */
+	int opened;
+	volatile int done;
+	volatile int streaming;
+	int warm;			/* restored from the state file, not yet opened */
+	volatile time_t last_read;	/* for the stall watchdog */
+	const char *volatile why;	/* what ended the stream, if not us */
+	unsigned long reads;		/* buffers since the last open */
+	int failures;			/* in a row, for backoff and failover */
+	char serial[64];		/* USB serial of the dongle in use */
+	int gain, frequency;		/* in use, from the profile or the options */
+	uint32_t rate;			/* sample rate in use, trails samp_rate under -G */
+	int profiled;			/* from the device cache, no gain discovery */
+	unsigned long long yield_samples, yield_bits;	/* since the last open */
+	unsigned long long yield_blocks;	/* tested, passed or not */
+	int calibrated;			/* this dongle has been swept */
+	volatile int recalibrate;	/* stream stopped for a sweep */
+	volatile int retune;		/* stream stopped for a new sample rate */
+	volatile int paused;		/* stream stopped while the sinks are full */
+	int warmup;			/* buffers to discard after a pause */
+	time_t next_calibrate;		/* 0 if never */
+	fips_ctx_t fipsctx;		/* Context for the FIPS tests */
+	struct estimator estimator;	/* Background min-entropy estimator */
+	unsigned long estimate_runs;
+	double estimated_h;
+	struct extract_plan plan;	/* Bit planes to debias */
+	struct extractor extractor;	/* Debiasing of the plan's pairs */
+	struct conditioner conditioner;	/* Conditioner instead of XOR or AES */
+	unsigned char *condition_buffer;
+	EVP_CIPHER_CTX *aes;
+	unsigned char *ciphertext;	/* BUFFER_SIZE + AES_BLOCK_SIZE */
+	int pool_source;
+	struct bitstats planestats;	/* Bit plane statistics for adapting the plan */
+	unsigned char bitbuffer[BUFFER_SIZE];
+	unsigned char bitbuffer_old[BUFFER_SIZE];
+	unsigned int bitacc, bitcounter, buffercounter;
+	int output_ready;
+	unsigned char hash_data[HASH_BUFFER_SIZE];	/* Ring of discarded bits, keys AES */
+	unsigned int hash_bits;
+	int hash_loop;
+};
+
 /*  Globals. */
-static int do_exit = 0;
-/*@NULL@*/
-static rtlsdr_dev_t *dev = NULL;
-static fips_ctx_t fipsctx;		/* Context for the FIPS tests */
-uint32_t dev_index = 0;
+static volatile int do_exit = 0;
+static volatile int stop_devices = 0;
+static struct device devices[MAX_DEVICES];
+static int ndevices;
+static uint32_t standby[MAX_DEVICES];	/* Spare dongles, for failover */
+static int nstandby;
+static pthread_mutex_t standby_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct drbg_feed drbg_feed;	/* Conditioned output, to seed the DRBGs */
+static struct drbg_writers drbg_writers;
+static struct pool pool;		/* Mixes conditioned output, with accounting */
+static struct pool_reader pool_reader;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct correlator correlator;	/* Common-mode interference between devices */
+static int correlating;
+static struct bitstats profilestats;	/* Bit plane statistics for the profiler */
+static time_t next_profile, next_metrics, next_state, next_cache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct governor governor;	/* Sample rate for -G, devices follow samp_rate */
+static struct duty duty;		/* Pauses the devices for -y */
+/* from the lowest the tuner allows up to the fastest USB 2 manages */
+static const uint32_t govern_rates[] = {
+  250000, 1024000, 1400000, 1800000, 2048000, 2400000, 2560000, 2880000, 3200000
+};
+char *device_list = NULL;
+char *standby_list = NULL;
 uint32_t samp_rate = DEFAULT_SAMPLE_RATE;
 uint32_t frequency = DEFAULT_FREQUENCY;
 int opt = 0;
@@ -83,6 +172,29 @@ char *config_name = NULL;
 int gflags_quiet = 0;
 int device_count = 0;
 float gain = 1000.0;
+int estimate_interval = 0;
+uint16_t bit_mask = 0x3f;
+double adapt_threshold = 0;
+int profile_interval = 0;
+char *metrics_name = NULL;
+int extract_method = EXTRACTOR_VN;
+int condition_type = CONDITIONER_XOR;
+size_t toeplitz_in = TOEPLITZ_IN, toeplitz_out = TOEPLITZ_OUT;
+double min_entropy = 0;
+int drbg_type = -1;
+int drbg_threads = 1;
+size_t drbg_reseed_bytes = DRBG_RESEED;
+int pool_mode = -1;
+double correlation_threshold = 0;
+int cpu_choice = CPU_AUTO;
+int memory_mode = ARENA_PAGEABLE;
+char *state_name = NULL;
+char *cache_name = NULL;		/* Per-device profiles, -T */
+int calibrate_interval = -1;		/* -L: 0 at startup only, else also every so often */
+uint32_t calibrate_freqs[CALIBRATE_MAX_FREQS];	/* -F, the -f frequency if none */
+int ncalibrate_freqs;
+double target_rate = 0;			/* -G: output bytes/s to govern the sample rate to */
+double duty_high = 0, duty_low;		/* -y: reservoir fill to pause at, and resume below */
 
 /* daemon */
 int uid = -1, gid = -1;
@@ -91,17 +203,6 @@ int uid = -1, gid = -1;
 FILE *output = NULL;
 FILE *config = NULL;
 
-/* Buffers */
-unsigned char bitbuffer[BUFFER_SIZE] = {0};
-unsigned char bitbuffer_old[BUFFER_SIZE] = {0};
-
-/* Counters */
-unsigned int bitcounter = 0;
-unsigned int buffercounter = 0;
-
-/* Other bits */
-AES_KEY wctx;
-EVP_CIPHER_CTX *en;
 
 int read_config_file (FILE * infile, char ***config_options);
 void * Alloc (size_t len);
@@ -113,7 +214,7 @@ void usage(void) {
 	  "rtl_entropy, a high quality entropy source using RTL2832 based DVB-T receivers\n\n"
 	  "Usage: rtl_entropy [options]\n"
 	  "\t-a Set gain (default: max for dongle)\n"
-	  "\t-d Device index (default: 0)\n"
+	  "\t-d Device indices or serials, comma separated (default: 0)\n"
 	  "\t-e Encrypt output\n"
 	  "\t-f Set frequency to listen (default: 70MHz )\n"
 	  "\t-s Samplerate (default: 3200000 Hz)\n");
@@ -127,45 +228,106 @@ void usage(void) {
 #endif
 	  );
   // Long options
+  fprintf(stderr, "\t--pool,          -B []  Mix output into an entropy pool, and read it blocking or nonblocking (default: off)\n");
   fprintf(stderr, "\t--config_file,   -c []  Configuration file (defaults: /etc/rtl_entropy.conf, /etc/sysconfig/rtl_entropy.conf)\n");
-  fprintf(stderr, "\t--device_idx,    -d []  Device index (default: %i)\n", dev_index);
+  fprintf(stderr, "\t--conditioner,   -C []  Conditioner: xor, aes, toeplitz, sha256, sha512, blake2b or blake3 (default: xor)\n");
+  fprintf(stderr, "\t--device_idx,    -d []  Device indices or serials, comma separated, each read on its own thread (default: 0)\n");
+  fprintf(stderr, "\t--drbg,          -D []  Stretch output with a DRBG seeded from it: ctr or chacha20 (default: off)\n");
+  fprintf(stderr, "\t--drbg_reseed,   -X []  DRBG output between reseeds, 0 reseeds every %d bytes (default: %d)\n", DRBG_MAX_REQUEST, DRBG_RESEED);
+  fprintf(stderr, "\t--drbg_threads,  -j []  DRBG threads, each with its own generator (default: %i)\n", drbg_threads);
   fprintf(stderr, "\t--encrpyt,       -e     Encrypt output\n");
+  fprintf(stderr, "\t--estimate,      -E []  Estimate min-entropy every [] seconds in the background (default: off)\n");
   fprintf(stderr, "\t--frequency,     -f []  Set frequency to listen (default: %i MHz)\n", frequency);
+  fprintf(stderr, "\t--frequencies,   -F []  Candidate frequencies for calibration, comma separated (default: -f)\n");
+  fprintf(stderr, "\t--calibrate,     -L []  Sweep gains and frequencies for the most vetted output at startup, and every [] seconds if not 0 (default: off)\n");
+  fprintf(stderr, "\t--duty_cycle,    -y []  Pause the devices while the pool, DRBG feed or output pipe is over high%% full, until under low%%, as high:low (default: off)\n");
+  fprintf(stderr, "\t--target_rate,   -G []  Step the sample rate to deliver [] bytes/s with the least CPU (default: off)\n");
 #if !(defined(__APPLE__) || defined(__FreeBSD__))
   fprintf(stderr, "\t--group,         -g []  Group to run as (default: rtl_entropy)\n");
   fprintf(stderr, "\t--pid_file,      -p []  PID file (default: /var/run/rtl_entropy.pid)\n");
   fprintf(stderr, "\t--user,          -u []  User to run as (default: rtl_entropy)\n");
 #endif
+  fprintf(stderr, "\t--state_file,    -W []  Save state here every %d seconds and on exit, to start from on restart (default: off)\n", STATE_INTERVAL);
+  fprintf(stderr, "\t--device_cache,  -T []  Keep each dongle's gain, frequency and bit mask in this file, by serial (default: off)\n");
+  fprintf(stderr, "\t--toeplitz,      -t []  Toeplitz conditioner block, in:out bytes, implies -C toeplitz (default: %d:%d)\n", TOEPLITZ_IN, TOEPLITZ_OUT);
+  fprintf(stderr, "\t--extractor,     -x []  Debiasing extractor: vn, peres or elias (default: %s)\n", extractor_names[extract_method]);
   fprintf(stderr, "\t--help,          -h     This help. (Default no)\n");
+  fprintf(stderr, "\t--memory,        -H []  Buffers in pageable, locked or huge (and locked) pages (default: pageable)\n");
+  fprintf(stderr, "\t--cpu,           -k []  Instruction set for the kernels: scalar, sse4.2, avx2, avx512, or auto to benchmark (default: auto)\n");
+  fprintf(stderr, "\t--correlation,   -K []  Warn, and with -B credit less, when devices correlate above [] (default: off)\n");
+  fprintf(stderr, "\t--mask,          -m []  Bit planes of each sample to debias (default: 0x%02x)\n", bit_mask);
+  fprintf(stderr, "\t--adaptive,      -A []  Pick bit planes on the fly, keeping bias and correlation under [] (default: off)\n");
+  fprintf(stderr, "\t--metrics_file,  -M []  Write metrics to this file every %d seconds (default: off)\n", METRICS_INTERVAL);
   fprintf(stderr, "\t--output_file,   -o []  Output file (default: STDOUT, /var/run/rtl_entropy.fifo for daemon mode (-b))\n");
+  fprintf(stderr, "\t--profile,       -P []  Profile bias and correlation of every bit plane, every [] seconds (default: off)\n");
   fprintf(stderr, "\t--quiet,         -q []  quiet level, how much output to print, 0-3 (default: %i, print all)\n", gflags_quiet);
+  fprintf(stderr, "\t--min_entropy,   -R []  Min-entropy per bit to assume when sizing hash input (default: estimate with -E, else %0.1f)\n", CONDITION_DEFAULT_H);
   fprintf(stderr, "\t--sample_rate,   -s []  Samplerate (default: %i Hz)\n", samp_rate);
+  fprintf(stderr, "\t--standby,       -S []  Spare device indices or serials, to fail over to (default: none)\n");
   fprintf(stderr, "\tConfiguration file at /etc/{,sysconfig/}rtl_entropy has more detail and sample values.\n");
   fprintf(stderr, "\n");
   exit(EXIT_SUCCESS);
 }
 
 
+/* Fills calibrate_freqs from a comma separated list */
+static void parse_frequencies(const char *list)
+{
+  char *copy, *token, *save = NULL;
+
+  copy = StrnDup((char *)list);
+  ncalibrate_freqs = 0;
+  for (token = strtok_r(copy, ", ", &save); token; token = strtok_r(NULL, ", ", &save)) {
+    if (ncalibrate_freqs == CALIBRATE_MAX_FREQS)
+      suicide("No more than %d calibration frequencies", CALIBRATE_MAX_FREQS);
+    calibrate_freqs[ncalibrate_freqs++] = (uint32_t)atofs(token);
+  }
+  free(copy);
+}
+
 void parse_args(int argc, char ** argv)
 { int opt;
   static struct option long_options[] =
   { {"amplify",  1, NULL, 'a' },
+    {"adaptive",  1, NULL, 'A' },
     {"daemonize",  0, NULL, 'b' },
+    {"pool",  1, NULL, 'B' },
     {"config_file",  1, NULL, 'c' },
+    {"conditioner",  1, NULL, 'C' },
     {"device_idx",  1, NULL, 'd' },
+    {"drbg",  1, NULL, 'D' },
+    {"drbg_threads",  1, NULL, 'j' },
+    {"drbg_reseed",  1, NULL, 'X' },
     {"encrypt",  0, NULL, 'e' },
+    {"correlation",  1, NULL, 'K' },
+    {"cpu",  1, NULL, 'k' },
+    {"estimate",  1, NULL, 'E' },
     {"frequency", 1, NULL, 'f' },
+    {"frequencies", 1, NULL, 'F' },
+    {"calibrate", 1, NULL, 'L' },
+    {"target_rate", 1, NULL, 'G' },
     {"group", 1, NULL, 'g' },
     {"help",  0, NULL, 'h' },
+    {"memory",  1, NULL, 'H' },
+    {"mask",  1, NULL, 'm' },
+    {"metrics_file",  1, NULL, 'M' },
     {"output_file",  1, NULL, 'o' },
     {"pid_file",  1, NULL, 'p' },
+    {"profile",  1, NULL, 'P' },
     {"quiet",  1, NULL, 'q' },
+    {"min_entropy",  1, NULL, 'R' },
     {"sample_rate",  1, NULL, 's' },
+    {"standby",  1, NULL, 'S' },
     {"user",  1, NULL, 'u' },
+    {"state_file",  1, NULL, 'W' },
+    {"toeplitz",  1, NULL, 't' },
+    {"device_cache",  1, NULL, 'T' },
+    {"extractor",  1, NULL, 'x' },
+    {"duty_cycle",  1, NULL, 'y' },
     {NULL,    0, NULL, 0   }
   };
 
-  char *arg_string= "a:bc:d:ef:g:ho:p:q:s:u:";
+  char *arg_string= "a:A:bB:c:C:d:D:eE:f:F:g:G:hH:j:k:K:L:m:M:o:p:P:q:R:s:S:t:T:u:W:x:X:y:";
     
   optind = 1;  // start at 1 in argv, allows reuse 
   while(1)
@@ -177,10 +339,20 @@ void parse_args(int argc, char ** argv)
         gain = (int)(atof(optarg) * 10);
         break;
 
+      case 'A':
+        adapt_threshold = atof(optarg);
+        break;
+
       case 'b':
         gflags_detach = 1;
         break;
         
+      case 'B':
+        pool_mode = pool_parse_mode(optarg);
+        if (pool_mode < 0)
+          suicide("Pool mode should be blocking or nonblocking, not %s", optarg);
+        break;
+
       case 'c':
         gflags_config = 1;
         if (config_name != NULL)
@@ -188,26 +360,88 @@ void parse_args(int argc, char ** argv)
         config_name = (char *) StrnDup (optarg);
         break;
         
+      case 'C':
+        condition_type = conditioner_parse(optarg);
+        if (condition_type < 0)
+          suicide("Unknown conditioner %s", optarg);
+        break;
+
+      case 'D':
+        drbg_type = drbg_parse(optarg);
+        if (drbg_type < 0)
+          suicide("Unknown DRBG %s", optarg);
+        break;
+
       case 'd':
-        dev_index = atoi(optarg);
+        if (device_list != NULL)
+          free (device_list);
+        device_list = (char *) StrnDup (optarg);
         break;
 
       case 'e':
         gflags_encryption = 1;
         break;
         
+      case 'E':
+        estimate_interval = atoi(optarg);
+        break;
+        
       case 'f':
         frequency = (uint32_t)atofs(optarg);
         break;
+
+      case 'F':
+        parse_frequencies(optarg);
+        break;
+
+      case 'L':
+        calibrate_interval = atoi(optarg);
+        if (calibrate_interval < 0)
+          suicide("Calibration interval should be 0 or more seconds");
+        break;
         
       case 'g':
         gid = parse_group(optarg);
         break;
+
+      case 'G':
+        target_rate = atofs(optarg);
+        break;
         
       case 'h':
         usage();
         break;
         
+      case 'j':
+        drbg_threads = atoi(optarg);
+        break;
+
+      case 'H':
+        memory_mode = arena_parse_memory(optarg);
+        if (memory_mode < 0)
+          suicide("Unknown memory mode %s", optarg);
+        break;
+
+      case 'k':
+        cpu_choice = cpu_parse_level(optarg);
+        if (cpu_choice < CPU_AUTO)
+          suicide("Unknown instruction set %s", optarg);
+        break;
+
+      case 'K':
+        correlation_threshold = atof(optarg);
+        break;
+
+      case 'm':
+        bit_mask = (uint16_t)strtol(optarg, NULL, 0) & 0xff;
+        break;
+
+      case 'M':
+        if (metrics_name != NULL)
+          free (metrics_name);
+        metrics_name = (char *) StrnDup (optarg);
+        break;
+        
       case 'o':
         redirect_output = 1;
         if (output_name != NULL)
@@ -218,18 +452,61 @@ void parse_args(int argc, char ** argv)
       case 'p':
         pidfile_path = strdup(optarg);
         break;
+
+      case 'P':
+        profile_interval = atoi(optarg);
+        break;
         
       case 'q':
         gflags_quiet = atoi(optarg);
         break;
         
+      case 'R':
+        min_entropy = atof(optarg);
+        break;
+
       case 's':
         samp_rate = (uint32_t)atofs(optarg);
         break;
         
+      case 'S':
+        if (standby_list != NULL)
+          free (standby_list);
+        standby_list = (char *) StrnDup (optarg);
+        break;
+
+      case 't':
+        if (toeplitz_parse(optarg, &toeplitz_in, &toeplitz_out))
+          suicide("Toeplitz sizes should be in:out bytes, multiples of 8, out no more than in");
+        condition_type = CONDITIONER_TOEPLITZ;
+        break;
+
+      case 'T':
+        cache_name = StrnDup(optarg);
+        break;
+
       case 'u':
         uid = parse_user(optarg, &gid);
         break;
+
+      case 'W':
+        state_name = StrnDup(optarg);
+        break;
+
+      case 'X':
+        drbg_reseed_bytes = (size_t)atofs(optarg);
+        break;
+
+      case 'x':
+        extract_method = extractor_parse(optarg);
+        if (extract_method < 0)
+          suicide("Unknown extractor %s", optarg);
+        break;
+
+      case 'y':
+        if (duty_parse(optarg, &duty_high, &duty_low))
+          suicide("Duty cycle should be high:low percentages, low under high");
+        break;
         
       case '?':
       default:
@@ -385,7 +662,337 @@ void route_output(void) {
   }
 }
 
-int nearest_gain(int target_gain){
+static void report_estimate(struct device *d)
+{
+  struct entropy_estimate e;
+  char labels[METRICS_LABELS_LEN];
+
+  if (estimator_get(&d->estimator, &e) <= d->estimate_runs)
+    return;
+  d->estimate_runs = e.runs;
+  snprintf(labels, sizeof(labels), "%s,per=\"sample\"", d->labels);
+  metrics_set("min_entropy_bits", labels, e.h_sample);
+  snprintf(labels, sizeof(labels), "%s,per=\"sampled_bit\"", d->labels);
+  metrics_set("min_entropy_bits", labels, e.h_bit);
+  if (e.h_output >= 0) {
+    snprintf(labels, sizeof(labels), "%s,per=\"output_bit\"", d->labels);
+    metrics_set("min_entropy_bits", labels, e.h_output);
+    d->estimated_h = e.h_output;
+    /* size hash input to the estimate, unless told what to assume */
+    if (condition_type > CONDITIONER_TOEPLITZ && min_entropy <= 0)
+      conditioner_set_entropy(&d->conditioner, e.h_output);
+  }
+  if (gflags_quiet < 2) {
+    if (e.h_output < 0)
+      log_line(LOG_INFO, "Device %s min-entropy: %0.3f bits/sample, %0.3f bits/sampled bit",
+               d->name, e.h_sample, e.h_bit);
+    else
+      log_line(LOG_INFO, "Device %s min-entropy: %0.3f bits/sample, %0.3f bits/sampled bit, %0.3f bits/output bit",
+               d->name, e.h_sample, e.h_bit, e.h_output);
+  }
+  if (gflags_quiet < 3)
+    log_line(LOG_DEBUG, "  MCV %0.3f, t-Tuple %0.3f, Collision %0.3f, Markov %0.3f, Compression %0.3f",
+             e.mcv, e.t_tuple, e.collision, e.markov, e.compression);
+}
+
+static void publish_pool(void)
+{
+  char labels[METRICS_LABELS_LEN];
+  int i;
+
+  metrics_set("pool_entropy_bits", NULL, pool_entropy(&pool));
+  metrics_set("pool_extracted_bytes_total", NULL, pool.extracted);
+  for (i = 0; i < pool.nsources; i++) {
+    snprintf(labels, sizeof(labels), "source=\"%s\"", pool.sources[i].name);
+    metrics_set("pool_mixed_bytes_total", labels, pool.sources[i].bytes);
+    metrics_set("pool_credited_bits_total", labels,
+		(double)pool.sources[i].credited / (1 << POOL_FRAC_BITS));
+  }
+}
+
+/* Publishes pairwise correlation, and warns as pairs cross the threshold */
+static void check_correlation(void)
+{
+  static unsigned char alerted[MAX_DEVICES][MAX_DEVICES];
+  char labels[METRICS_LABELS_LEN];
+  double corr;
+  int a, b;
+
+  for (a = 0; a < ndevices; a++) {
+    for (b = a + 1; b < ndevices; b++) {
+      corr = correlator_get(&correlator, a, b);
+      snprintf(labels, sizeof(labels), "%s,peer=\"%s\"", devices[a].labels, devices[b].name);
+      metrics_set("device_correlation", labels, corr);
+      if (corr > correlation_threshold && !alerted[a][b]) {
+	alerted[a][b] = 1;
+	metrics_add("correlation_alerts_total", labels, 1);
+	log_line(LOG_INFO, "WARNING: Devices %s and %s are correlated, %0.3f%s", devices[a].name,
+		 devices[b].name, corr, pool_mode >= 0 ? ", crediting less from the second" : "");
+      } else if (corr < correlation_threshold / 2 && alerted[a][b]) {
+	alerted[a][b] = 0;
+	if (gflags_quiet < 2)
+	  log_line(LOG_INFO, "Devices %s and %s no longer correlated, %0.3f", devices[a].name,
+		   devices[b].name, corr);
+      }
+    }
+  }
+}
+
+/* Profile dumps, from the first device's reads only */
+static void profile(const uint8_t *buffer, int n_read)
+{
+  time_t now;
+
+  bitstats_add_u8(&profilestats, buffer, n_read);
+  now = time(NULL);
+  if (now >= next_profile) {
+    if (profilestats.samples) {
+      bitstats_publish(&profilestats, 8);
+      if (!metrics_name && gflags_quiet < 2)
+        bitstats_log(&profilestats, 8);
+    }
+    bitstats_reset(&profilestats);
+    next_profile = now + profile_interval;
+  }
+}
+
+/*
+ * Looks the dongle up in the device cache.  A profile made at the same
+ * sample rate sets the gain, frequency and bit mask, otherwise they
+ * come from the options.
+ */
+static void profile_load(struct device *d)
+{
+  char manufact[256], product[256], serial[256], key[96], value[CACHE_LINE_LEN];
+  struct extract_plan plan;
+  unsigned int rate, mask;
+  int g, f;
+  double yield;
+
+  if (rtlsdr_get_device_usb_strings(d->index, manufact, product, serial))
+    serial[0] = '\0';
+  /* a re-open of the dongle that was swept keeps what the sweep chose */
+  if (d->calibrated && !strncmp(d->serial, serial, sizeof(d->serial) - 1)) {
+    d->profiled = 1;
+    return;
+  }
+  d->calibrated = 0;
+  d->gain = gain;
+  d->frequency = frequency;
+  d->profiled = 0;
+  d->serial[0] = '\0';
+  if (!serial[0])
+    return;
+  snprintf(d->serial, sizeof(d->serial), "%.63s", serial);
+  if (!cache_name)
+    return;
+  snprintf(key, sizeof(key), "rtl/%s", d->serial);
+  pthread_mutex_lock(&cache_lock);
+  if (cache_lookup(cache_name, key, value, sizeof(value)) ||
+      sscanf(value, "%d %d %u %x %lf", &g, &f, &rate, &mask, &yield) != 5) {
+    pthread_mutex_unlock(&cache_lock);
+    return;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if (rate != d->rate) {
+    if (gflags_quiet < 3)
+      log_line(LOG_DEBUG, "Device %s profile is for %u Hz sampling, not using it", d->name, rate);
+    return;
+  }
+  extract_plan_from_mask(&plan, mask & 0xff);
+  if (!plan.npairs)
+    return;
+  d->plan = plan;
+  d->gain = g;
+  d->frequency = f;
+  d->profiled = 1;
+  metrics_set("bit_mask", d->labels, d->plan.mask);
+  if (estimate_interval > 0)
+    estimator_set_mask(&d->estimator, d->plan.mask);
+  if (gflags_quiet < 2)
+    log_line(LOG_INFO, "Device %s (serial %s) from %s: gain %0.1f, %d Hz, bit planes 0x%02x, %0.3f bits/sample",
+	     d->name, d->serial, cache_name, g / 10.0, f, d->plan.mask, yield);
+}
+
+/* Remembers what the dongle is using, once there is a yield worth noting */
+static void profile_store(struct device *d)
+{
+  char key[96], value[96];
+
+  if (!cache_name || !d->serial[0] || d->yield_samples < ADAPT_SAMPLES)
+    return;
+  snprintf(key, sizeof(key), "rtl/%s", d->serial);
+  snprintf(value, sizeof(value), "%d %d %u 0x%02x %0.4f", d->gain, d->frequency, d->rate,
+	   d->plan.mask, (double)d->yield_bits / d->yield_samples);
+  pthread_mutex_lock(&cache_lock);
+  if (cache_store(cache_name, key, value))
+    log_line(LOG_INFO, "WARNING: Couldn't save device %s to %s", d->name, cache_name);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Saves what a restart needs to produce output straight away: each
+ * device's discard ring, the block it is accumulating and its FIPS
+ * continuous test word, and the DRBG feed and pool.
+ */
+static void save_state(void)
+{
+  unsigned char feed[STATE_FEED_BYTES];
+  char name[STATE_NAME_LEN];
+  struct state st;
+  struct device *d;
+  int i, r;
+
+  if (state_begin(&st)) {
+    log_line(LOG_INFO, "WARNING: Couldn't start a state file");
+    return;
+  }
+  for (r = 0, i = 0; i < ndevices && !r; i++) {
+    d = &devices[i];
+    if (d->hash_loop) {
+      snprintf(name, sizeof(name), "dev.%s.ring", d->name);
+      r |= state_put(&st, name, d->hash_data, sizeof(d->hash_data));
+    }
+    if (d->output_ready || d->warm) {
+      snprintf(name, sizeof(name), "dev.%s.block", d->name);
+      r |= state_put(&st, name, d->bitbuffer_old, sizeof(d->bitbuffer_old));
+    }
+    snprintf(name, sizeof(name), "dev.%s.fips", d->name);
+    r |= state_put(&st, name, &d->fipsctx.last32, sizeof(d->fipsctx.last32));
+  }
+  /* the records are expanded from what is there, so a short feed still fills one */
+  if (!r && drbg_type >= 0 && drbg_feed_peek(&drbg_feed, feed, sizeof(feed)) >= DRBG_SEED_LEN)
+    r = state_put(&st, "drbg_feed", feed, sizeof(feed));
+  if (!r && pool_mode >= 0)
+    r = state_put(&st, "pool", pool.words, sizeof(pool.words));
+  memset(feed, 0, sizeof(feed));
+  if (r) {
+    state_free(&st);
+    log_line(LOG_INFO, "WARNING: Couldn't build the state file");
+  } else if (state_commit(&st, state_name)) {
+    log_line(LOG_INFO, "WARNING: Couldn't write state to %s", state_name);
+  }
+}
+
+/* Picks up the last run's state, if there is one.  After device_init(). */
+static void load_state(void)
+{
+  const unsigned char *rec;
+  char name[STATE_NAME_LEN];
+  struct state st;
+  struct device *d;
+  unsigned int last32;
+  int i, n = 0;
+
+  if (state_load(&st, state_name)) {
+    if (gflags_quiet < 3)
+      log_line(LOG_DEBUG, "No usable state in %s, starting cold", state_name);
+    return;
+  }
+  for (i = 0; i < ndevices; i++) {
+    d = &devices[i];
+    snprintf(name, sizeof(name), "dev.%s.ring", d->name);
+    if ((rec = state_get(&st, name, sizeof(d->hash_data)))) {
+      memcpy(d->hash_data, rec, sizeof(d->hash_data));
+      d->hash_loop = 1;
+      n++;
+    }
+    snprintf(name, sizeof(name), "dev.%s.block", d->name);
+    if ((rec = state_get(&st, name, sizeof(d->bitbuffer_old)))) {
+      memcpy(d->bitbuffer_old, rec, sizeof(d->bitbuffer_old));
+      d->warm = 1;
+      n++;
+    }
+    snprintf(name, sizeof(name), "dev.%s.fips", d->name);
+    /*
+     * Like every record this is an expansion, not the last word tested,
+     * so the continuous run test starts over across a restart; it only
+     * spares the first word a comparison against zero
+     */
+    if ((rec = state_get(&st, name, sizeof(last32)))) {
+      memcpy(&last32, rec, sizeof(last32));
+      fips_init(&d->fipsctx, last32);
+    }
+  }
+  if (drbg_type >= 0 && (rec = state_get(&st, "drbg_feed", STATE_FEED_BYTES))) {
+    drbg_feed_add(&drbg_feed, rec, STATE_FEED_BYTES);
+    n++;
+  }
+  /* mixed in without credit, a blocking pool still waits for fresh entropy */
+  if (pool_mode >= 0 && (rec = state_get(&st, "pool", sizeof(pool.words)))) {
+    pool_mix(&pool, pool_add_source(&pool, "state"), rec, sizeof(pool.words), 0);
+    n++;
+  }
+  state_free(&st);
+  if (gflags_quiet < 2)
+    log_line(LOG_INFO, "Warm start from %s, %d records restored", state_name, n);
+}
+
+/* How full whatever output waits in is, 0 to 1, or -1 if there's no telling */
+static double reservoir_fill(void)
+{
+  double fill;
+
+  if (pool_mode >= 0)
+    return pool_entropy(&pool) / POOL_BITS;
+  if (drbg_type >= 0)
+    return (double)drbg_feed_fill(&drbg_feed) / DRBG_FEED_SIZE;
+  pthread_mutex_lock(&output_lock);
+  fill = duty_pipe_fill(output ? fileno(output) : -1);
+  pthread_mutex_unlock(&output_lock);
+  return fill;
+}
+
+/* Metrics file writes, called from the main loop */
+static void periodic(void)
+{
+  time_t now = time(NULL);
+  uint32_t rate;
+  int i, ceiling;
+
+  if (state_name && now >= next_state) {
+    if (next_state)
+      save_state();
+    next_state = now + STATE_INTERVAL;
+  }
+  if (cache_name && now >= next_cache) {
+    for (i = 0; next_cache && i < ndevices; i++)
+      if (devices[i].streaming)
+	profile_store(&devices[i]);
+    next_cache = now + CACHE_INTERVAL;
+  }
+  /* the devices stop at their next buffer, and wait */
+  if (duty_high > 0 && duty_update(&duty, reservoir_fill()) && gflags_quiet < 3)
+    log_line(LOG_DEBUG, duty.paused ? "Sinks full, pausing the devices" : "Resuming the devices");
+  if (target_rate > 0) {
+    ceiling = governor.ceiling;
+    rate = governor_check(&governor);
+    if (governor.ceiling < ceiling)
+      log_line(LOG_INFO, "WARNING: Samples dropped at %u Hz, not going above %u Hz",
+	       govern_rates[governor.ceiling + 1], govern_rates[governor.ceiling]);
+    if (rate) {
+      if (gflags_quiet < 2)
+	log_line(LOG_INFO, "Delivering %0.0f bytes/s for a target of %0.0f, sample rate now %u Hz",
+		 governor.output_rate, target_rate, rate);
+      /* each device picks it up at its next buffer */
+      samp_rate = rate;
+    }
+  }
+  if (metrics_name && now >= next_metrics) {
+    if (pool_mode >= 0)
+      publish_pool();
+    metrics_set("arena_heap_allocs_total", NULL, arena_heap_allocs());
+    metrics_set("memory_huge_bytes", NULL, arena_huge_bytes());
+    metrics_set("memory_locked_bytes", NULL, arena_locked_bytes());
+    if (duty_high > 0)
+      duty_publish(&duty);
+    if (metrics_write(metrics_name) && gflags_quiet < 3)
+      log_line(LOG_DEBUG, "WARNING: Couldn't write metrics to %s", metrics_name);
+    next_metrics = now + METRICS_INTERVAL;
+  }
+}
+
+int nearest_gain(rtlsdr_dev_t *dev, int target_gain){
   int i, err1, err2, count, close_gain;
   int* gains;
   count = rtlsdr_get_tuner_gains(dev, NULL);
@@ -413,18 +1020,715 @@ int nearest_gain(int target_gain){
 
 
 
-int main(int argc, char **argv) {
-  struct sigaction sigact;
-  int n_read;
-  int r;
-  unsigned int i, j;
-  uint8_t *buffer;
-  uint8_t *ciphertext;
-  uint32_t out_block_size = MAXIMAL_BUF_LENGTH;
-  int ch, ch2;
+/* Write to the output, from any thread */
+static void write_output(const unsigned char *buf, size_t len)
+{
+  struct timespec start, end;
+
+  if (target_rate > 0)
+    clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(&output_lock);
+  /* closed, when the reader went away */
+  if (!output) {
+    pthread_mutex_unlock(&output_lock);
+    return;
+  }
+  fwrite(buf,sizeof(buf[0]),len,output);
+  pthread_mutex_unlock(&output_lock);
+  metrics_add("output_bytes_total", NULL, len);
+  if (target_rate > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    governor_output(&governor, len, (end.tv_sec - start.tv_sec) * 1000000000ULL +
+		    end.tv_nsec - start.tv_nsec);
+  }
+}
+
+/* Write out, or with -D, hand to the DRBGs */
+static void deliver_output(const unsigned char *buf, size_t len)
+{
+  if (drbg_type >= 0) {
+    drbg_feed_add(&drbg_feed, buf, len);
+    metrics_add("drbg_seed_bytes_total", NULL, len);
+    return;
+  }
+  write_output(buf, len);
+}
+
+/* Min-entropy per bit of conditioned output, to credit the pool with */
+static double output_entropy_rate(const struct device *d)
+{
+  double h;
+
+  h = min_entropy > 0 ? min_entropy : d->estimated_h >= 0 ? d->estimated_h : CONDITION_DEFAULT_H;
+  if (condition_type > CONDITIONER_TOEPLITZ)
+    return 1.0;	/* hash input is sized for full entropy */
+  /* less the leftover hash margin, as the hashes size their input with */
+  if (condition_type == CONDITIONER_TOEPLITZ)
+    h = (h * toeplitz_in * 8 - CONDITION_MARGIN_BITS) / (toeplitz_out * 8);
+  return h > 1.0 ? 1.0 : h < 0.0 ? 0.0 : h;
+}
+
+/* Deliver a conditioned block, or with -B, mix it into the pool */
+static void emit_output(struct device *d, const unsigned char *buf, size_t len)
+{
+  double credit;
+
+  metrics_add("vetted_bytes_total", d->labels, len);
+  if (pool_mode >= 0) {
+    credit = len * 8 * output_entropy_rate(d);
+    if (correlating)
+      credit *= correlator_weight(&correlator, d - devices);
+    pool_mix(&pool, d->pool_source, buf, len, credit);
+    return;
+  }
+  deliver_output(buf, len);
+}
+
+/* Vet a full bitbuffer, and write it out if it passes */
+static void process_block(struct device *d)
+{
+  unsigned int j;
+  unsigned char key[SHA512_DIGEST_LENGTH];
+  char labels[METRICS_LABELS_LEN];
   int fips_result;
   int aes_len;
-  int output_ready;
+  size_t len;
+
+  /* We have 2500 bytes of entropy 
+     Can now send it to FIPS! */
+  /* put_bits() tested it byte by byte, on the way in */
+  fips_result = fips_end_block(&d->fipsctx);
+  snprintf(labels, sizeof(labels), "%s,result=\"%s\"", d->labels, fips_result ? "fail" : "pass");
+  metrics_add("fips_blocks_total", labels, 1);
+  d->yield_blocks++;
+  if (!fips_result) {
+    d->yield_bits += BUFFER_SIZE * 8;
+    if (gflags_encryption != 0) {
+      if (d->hash_loop) {
+	/*   /\* Get a key from disacarded bits *\/ */
+	SHA512(d->hash_data, sizeof(d->hash_data), key);
+	/* use key to encrypt output */
+	aes_init(key, sizeof(key), d->aes);
+	aes_len = aes_encrypt(d->aes, d->bitbuffer, sizeof(d->bitbuffer), d->ciphertext);
+	/* yay, send it to the output! */
+	emit_output(d, d->ciphertext, aes_len);
+	/* the estimate is of the plaintext, ciphertext always looks good */
+	if (estimate_interval > 0)
+	  estimator_feed_output(&d->estimator, d->bitbuffer, BUFFER_SIZE);
+      }
+    } else if (condition_type != CONDITIONER_XOR) {
+      /* Toeplitz seeds its matrix once, from discarded bits */
+      if (!d->conditioner.seeded && d->hash_loop)
+	conditioner_seed(&d->conditioner, d->hash_data, sizeof(d->hash_data));
+      if (d->conditioner.seeded) {
+	/* the estimate is of what goes in, what comes out always looks good */
+	if (estimate_interval > 0)
+	  estimator_feed_output(&d->estimator, d->bitbuffer, BUFFER_SIZE);
+	len = conditioner_absorb(&d->conditioner, d->bitbuffer, BUFFER_SIZE, d->condition_buffer);
+	emit_output(d, d->condition_buffer, len);
+      }
+    } else { 
+      if (d->output_ready) {
+	emit_output(d, d->bitbuffer_old, BUFFER_SIZE);
+	if (estimate_interval > 0)
+	  estimator_feed_output(&d->estimator, d->bitbuffer_old, BUFFER_SIZE);
+      }
+      /* xor the new data into the old, which is what goes out next time */
+      cpu_xor(d->bitbuffer_old, d->bitbuffer, BUFFER_SIZE);
+    }
+    /* We're ready to write once we've been through the above once */
+    d->output_ready = 1;
+  } else {   /* FIPS test failed */
+    for (j=0; j< N_FIPS_TESTS; j++) {
+      if (fips_result & fips_test_mask[j]) {
+	if (!gflags_detach && gflags_quiet < 1)
+	  log_line(LOG_DEBUG, "Device %s failed: %s", d->name, fips_test_names[j]);
+      }
+    }
+  }
+}
+
+/*
+ * Append nbits debiased bits, LSB first, handing each full bitbuffer
+ * to process_block().  Bits gather in bitacc, and each byte is stored
+ * and FIPS tested once, as it completes.
+ */
+static inline void put_bits(struct device *d, unsigned int bits, int nbits)
+{
+  unsigned int byte;
+
+  d->bitacc |= bits << d->bitcounter;
+  d->bitcounter += nbits;
+  while (d->bitcounter >= 8) {
+    byte = d->bitacc & 0xff;
+    d->bitacc >>= 8;
+    d->bitcounter -= 8;
+    d->bitbuffer[d->buffercounter++] = byte;
+    fips_add_byte(&d->fipsctx, byte);
+
+    /* is buffer full? */
+    if (d->buffercounter >= BUFFER_SIZE) {
+      process_block(d);
+      d->buffercounter = 0;
+    }
+  }
+}
+
+/* Keep nbits discarded bits, LSB first, in the device's ring, for keys and seeds */
+static inline void store_discards(struct device *d, unsigned int bits, int nbits)
+{
+  unsigned int byte, shift;
+  int take;
+
+  while (nbits) {
+    byte = d->hash_bits >> 3;
+    shift = d->hash_bits & 7;
+    take = 8 - shift;
+    if (take > nbits)
+      take = nbits;
+    d->hash_data[byte] = (d->hash_data[byte] & ~(((1 << take) - 1) << shift)) |
+      ((bits & ((1 << take) - 1)) << shift);
+    bits >>= take;
+    nbits -= take;
+    d->hash_bits += take;
+    if (d->hash_bits == sizeof(d->hash_data) * 8) {
+      d->hash_bits = 0;
+      d->hash_loop = 1;
+    }
+  }
+}
+
+/* The extractors' sinks, a bit at a time */
+static void put_bit(void *arg, int bit)
+{
+  put_bits(arg, bit, 1);
+}
+
+static void store_discard(void *arg, int bit)
+{
+  store_discards(arg, bit, 1);
+}
+
+EXTRACT_VN_KERNEL(extract_vn_u8, unsigned char, struct device, put_bits, store_discards)
+EXTRACT_RAW_KERNEL(extract_raw_u8, unsigned char)
+
+/*
+ * Finds the dongle a -d or -S entry means.  Plain numbers below the
+ * device count are indices, anything else (including numbers with
+ * leading zeros) is looked up as a serial.
+ */
+static uint32_t device_lookup(const char *token)
+{
+  long idx;
+  int r, i;
+
+  if (token[strspn(token, "0123456789")] == '\0' && (token[0] != '0' || !token[1])
+      && (idx = strtol(token, NULL, 10)) < device_count) {
+    r = (int)idx;
+  } else {
+    r = rtlsdr_get_index_by_serial(token);
+    if (r < 0)
+      suicide("No device with index or serial %s", token);
+  }
+  for (i = 0; i < ndevices; i++)
+    if (devices[i].index == (uint32_t)r)
+      suicide("Device %s is listed twice", token);
+  for (i = 0; i < nstandby; i++)
+    if (standby[i] == (uint32_t)r)
+      suicide("Device %s is listed twice", token);
+  return r;
+}
+
+/* Splits the -d list into devices, and the -S list into standbys */
+static void parse_devices(const char *list, const char *spares)
+{
+  char *copy, *token, *save = NULL;
+  struct device *d;
+
+  copy = StrnDup((char *)list);
+  for (token = strtok_r(copy, ", ", &save); token; token = strtok_r(NULL, ", ", &save)) {
+    if (ndevices == MAX_DEVICES)
+      suicide("No more than %d devices", MAX_DEVICES);
+    d = &devices[ndevices];
+    memset(d, 0, sizeof(*d));
+    d->index = device_lookup(token);
+    snprintf(d->name, sizeof(d->name), "%s", token);
+    snprintf(d->labels, sizeof(d->labels), "device=\"%s\"", token);
+    ndevices++;
+  }
+  free(copy);
+  if (!ndevices)
+    suicide("No devices in %s", list);
+  if (!spares)
+    return;
+  copy = StrnDup((char *)spares);
+  for (token = strtok_r(copy, ", ", &save); token; token = strtok_r(NULL, ", ", &save)) {
+    if (nstandby == MAX_DEVICES)
+      suicide("No more than %d standby devices", MAX_DEVICES);
+    standby[nstandby++] = device_lookup(token);
+  }
+  free(copy);
+}
+
+/*
+ * Swaps a failing device's dongle for the first standby; the failing
+ * one goes to the back of the line, to be tried again later.  Returns
+ * 1 if there was a standby.
+ */
+static int device_failover(struct device *d)
+{
+  uint32_t old = d->index;
+
+  pthread_mutex_lock(&standby_lock);
+  if (!nstandby) {
+    pthread_mutex_unlock(&standby_lock);
+    return 0;
+  }
+  d->index = standby[0];
+  d->calibrated = 0;
+  memmove(standby, standby + 1, (nstandby - 1) * sizeof(standby[0]));
+  standby[nstandby - 1] = old;
+  pthread_mutex_unlock(&standby_lock);
+  log_line(LOG_INFO, "WARNING: Device %s failing over from #%d to standby #%d", d->name, old, d->index);
+  metrics_add("device_failovers_total", d->labels, 1);
+  metrics_set("device_index", d->labels, d->index);
+  return 1;
+}
+
+/* Everything of a device's pipeline but the dongle itself */
+static void device_init(struct device *d)
+{
+  char source[32];
+
+  d->estimated_h = -1;
+  pthread_mutex_init(&d->lock, NULL);
+  metrics_set("device_index", d->labels, d->index);
+  fips_init(&d->fipsctx, (int)0);
+  extract_plan_from_mask(&d->plan, bit_mask);
+  if (!d->plan.npairs)
+    suicide("Bit mask 0x%02x has no pairs of bit planes to debias", bit_mask);
+  if (extractor_init(&d->extractor, extract_method, put_bit, store_discard, d))
+    suicide("Failed to set up %s extractor", extractor_names[extract_method]);
+  if (gflags_encryption) {
+    d->aes = aes_ctx_new();
+    d->ciphertext = arena_map(BUFFER_SIZE + AES_BLOCK_SIZE);
+    if (!d->aes || !d->ciphertext)
+      suicide("Out of memory for AES");
+  }
+  if (condition_type > CONDITIONER_AES) {
+    if (conditioner_init(&d->conditioner, condition_type, toeplitz_in, toeplitz_out,
+			 min_entropy > 0 ? min_entropy : CONDITION_DEFAULT_H))
+      suicide("Failed to set up the %s conditioner", conditioner_names[condition_type]);
+    d->condition_buffer = arena_map(conditioner_out_max(&d->conditioner, BUFFER_SIZE));
+    if (!d->condition_buffer)
+      suicide("Out of memory for the %s conditioner", conditioner_names[condition_type]);
+  }
+  bitstats_reset(&d->planestats);
+  metrics_set("bit_mask", d->labels, d->plan.mask);
+
+  if (estimate_interval > 0) {
+    if (gflags_quiet < 3)
+      log_line(LOG_DEBUG, "Starting min-entropy estimator for device %s", d->name);
+    if (estimator_start(&d->estimator, d->plan.mask, estimate_interval))
+      log_line(LOG_INFO, "WARNING: Failed to start min-entropy estimator");
+  }
+  if (pool_mode >= 0) {
+    snprintf(source, sizeof(source), "rtl%s", d->name);
+    d->pool_source = pool_add_source(&pool, source);
+  }
+}
+
+static void device_free(struct device *d)
+{
+  estimator_stop(&d->estimator);
+  extractor_free(&d->extractor);
+  if (condition_type > CONDITIONER_AES) {
+    arena_unmap(d->condition_buffer, conditioner_out_max(&d->conditioner, BUFFER_SIZE));
+    conditioner_free(&d->conditioner);
+  }
+  if (d->aes)
+    EVP_CIPHER_CTX_free(d->aes);
+  arena_unmap(d->ciphertext, BUFFER_SIZE + AES_BLOCK_SIZE);
+  pthread_mutex_destroy(&d->lock);
+}
+
+/* Opens and tunes the dongle, returns 0 on success */
+static int device_open(struct device *d)
+{
+  rtlsdr_dev_t *dev;
+  int r, g;
+
+  if (gflags_quiet < 3)
+    log_line(LOG_DEBUG, "Using device %s (#%d): %s", d->name, d->index,
+	   rtlsdr_get_device_name(d->index));
+  r = rtlsdr_open(&dev, d->index);
+  if (r < 0) {
+    if (gflags_quiet < 3)
+      log_line(LOG_DEBUG, "Failed to open rtlsdr device #%d.", d->index);
+    return r;
+  }
+  pthread_mutex_lock(&d->lock);
+  d->dev = dev;
+  pthread_mutex_unlock(&d->lock);
+
+  /* Set the sample rate */
+  d->rate = samp_rate;
+  r = rtlsdr_set_sample_rate(d->dev, d->rate);
+  if (r < 0)
+    if (gflags_quiet < 3)
+      log_line(LOG_DEBUG, "WARNING: Failed to set sample rate.");
+  
+  /* Reset endpoint before we start reading from it (mandatory) */
+  r = rtlsdr_reset_buffer(d->dev);
+  if (r < 0)
+    if (gflags_quiet < 3)
+      log_line(LOG_DEBUG, "WARNING: Failed to reset buffers.");
+  
+  profile_load(d);
+  if (gflags_quiet < 3)
+    log_line(LOG_DEBUG, "Setting Frequency to %d", d->frequency);
+  r = rtlsdr_set_center_freq(d->dev, (uint32_t)d->frequency);
+  
+  /* a profiled gain is one the tuner already said it has */
+  g = d->profiled ? d->gain : nearest_gain(d->dev, gain);
+  d->gain = g;
+  if (gflags_quiet < 3)
+    log_line(LOG_DEBUG, "Setting gain to %0.2f", g/10.0);
+  /* Manual gain mode */
+  r = rtlsdr_set_tuner_gain_mode(d->dev, 1);
+  if (r < 0)
+    if (gflags_quiet < 3)
+      log_line(LOG_DEBUG, "WARNING: Failed to set manual gain");
+  r = rtlsdr_set_tuner_gain(d->dev, g);
+  if (r < 0)
+    if (gflags_quiet < 3)
+      log_line(LOG_DEBUG, "WARNING: Failed to set gain");
+  return 0;
+}
+
+/* Runs one read's worth of samples through the device's pipeline */
+static void device_samples(struct device *d, const uint8_t *buffer, int n_read)
+{
+  metrics_add("samples_total", d->labels, n_read);
+  d->yield_samples += n_read;
+  if (estimate_interval > 0) {
+    estimator_feed_u8(&d->estimator, buffer, n_read);
+    report_estimate(d);
+  }
+  if (profile_interval > 0 && d == &devices[0])
+    profile(buffer, n_read);
+  if (correlating)
+    correlator_feed_u8(&correlator, d - devices, buffer, n_read);
+
+  /* for each byte in the rtl-sdr read buffer
+     pick least significant 6 bits
+     for now:
+     debias, storing useful bits in write buffer, 
+     and discarded bits in hash buffer
+     until the write buffer is full.
+     create a key by SHA512() hashing the hash buffer
+     encrypt write buffer with key
+     output encrypted buffer
+     
+  */
+
+  if (adapt_threshold > 0) {
+    bitstats_add_u8(&d->planestats, buffer, n_read);
+    if (d->planestats.samples >= ADAPT_SAMPLES &&
+        extract_plan_adapt(&d->plan, &d->planestats, 0xff, adapt_threshold)) {
+      if (gflags_quiet < 2)
+        log_line(LOG_INFO, "Device %s bit planes now 0x%02x, %d pairs", d->name,
+                 d->plan.mask, d->plan.npairs);
+      metrics_set("bit_mask", d->labels, d->plan.mask);
+      if (estimate_interval > 0)
+        estimator_set_mask(&d->estimator, d->plan.mask);
+    }
+  }
+
+  if (extract_method == EXTRACTOR_VN)
+    extract_vn_u8(d, &d->plan, buffer, n_read);
+  else
+    extract_raw_u8(&d->extractor, &d->plan, buffer, n_read);
+}
+
+/*
+ * Sweeps the tuner's gains at each candidate frequency and keeps the
+ * setting with the most vetted output per second.  What is read goes
+ * through the pipeline as usual, so yield and FIPS passes are measured,
+ * not modelled; the vetted rate is capped by what the min-entropy
+ * estimate says the samples hold, so no setting wins on output that
+ * only looks random.  On the device thread, open and not streaming.
+ */
+static void calibrate(struct device *d)
+{
+  unsigned long long bits, blocks;
+  uint32_t freq, best_freq = d->frequency;
+  int i, f, n, len, got, ngains, nfreqs, best_gain = d->gain;
+  double h, vetted, score, best = -1;
+  int *gains;
+  uint8_t *buf;
+  uint16_t *wide;
+
+  ngains = rtlsdr_get_tuner_gains(d->dev, NULL);
+  nfreqs = ncalibrate_freqs ? ncalibrate_freqs : 1;
+  gains = malloc(sizeof(int) * (ngains > 0 ? ngains : 1));
+  buf = malloc(CALIBRATE_SAMPLES);
+  wide = malloc(CALIBRATE_SAMPLES * sizeof(wide[0]));
+  if (ngains <= 0 || !gains || !buf || !wide) {
+    log_line(LOG_INFO, "WARNING: Can't calibrate device %s", d->name);
+    goto out;
+  }
+  ngains = rtlsdr_get_tuner_gains(d->dev, gains);
+  if (gflags_quiet < 2)
+    log_line(LOG_INFO, "Calibrating device %s over %d gains and %d frequencies", d->name,
+	     ngains, nfreqs);
+  for (f = 0; f < nfreqs && !stop_devices; f++) {
+    freq = ncalibrate_freqs ? calibrate_freqs[f] : (uint32_t)d->frequency;
+    rtlsdr_set_center_freq(d->dev, freq);
+    for (i = 0; i < ngains && !stop_devices; i++) {
+      rtlsdr_set_tuner_gain(d->dev, gains[i]);
+      rtlsdr_reset_buffer(d->dev);
+      /* the first buffer after a change is the tuner settling */
+      if (rtlsdr_read_sync(d->dev, buf, DEFAULT_BUF_LENGTH, &n) < 0)
+	goto out;
+      bits = d->yield_bits;
+      blocks = d->yield_blocks;
+      for (got = 0; got < CALIBRATE_SAMPLES; got += n) {
+	/* a short read leaves less than a buffer's room */
+	len = CALIBRATE_SAMPLES - got < DEFAULT_BUF_LENGTH ? CALIBRATE_SAMPLES - got : DEFAULT_BUF_LENGTH;
+	if (rtlsdr_read_sync(d->dev, buf + got, len, &n) < 0 || n <= 0 || n > len)
+	  goto out;
+	d->last_read = time(NULL);
+	device_samples(d, buf + got, n);
+      }
+      for (n = 0; n < got; n++)
+	wide[n] = buf[n];
+      h = estimate_min_entropy(wide, got, d->plan.mask, NULL);
+      vetted = (double)(d->yield_bits - bits) / got * d->rate;
+      score = vetted < h * d->rate ? vetted : h * d->rate;
+      if (gflags_quiet < 3)
+	log_line(LOG_DEBUG, "  %u Hz, gain %0.1f: %0.0f vetted bits/s, %llu/%llu FIPS passes, %0.3f bits/sample",
+		 freq, gains[i] / 10.0, vetted, (d->yield_bits - bits) / (BUFFER_SIZE * 8),
+		 d->yield_blocks - blocks, h);
+      if (score > best) {
+	best = score;
+	best_freq = freq;
+	best_gain = gains[i];
+      }
+    }
+  }
+out:
+  /* a sweep cut short by shutdown isn't worth announcing */
+  if (best >= 0 && !stop_devices) {
+    d->frequency = best_freq;
+    d->gain = best_gain;
+    d->profiled = 1;
+    if (gflags_quiet < 2)
+      log_line(LOG_INFO, "Device %s calibrated to %d Hz, gain %0.1f, %0.0f vetted bits/s",
+	       d->name, d->frequency, d->gain / 10.0, best);
+    metrics_set("calibrated_frequency_hz", d->labels, d->frequency);
+    metrics_set("calibrated_gain_db", d->labels, d->gain / 10.0);
+    metrics_set("calibrated_vetted_bits_per_second", d->labels, best);
+  }
+  rtlsdr_set_center_freq(d->dev, (uint32_t)d->frequency);
+  rtlsdr_set_tuner_gain(d->dev, d->gain);
+  rtlsdr_reset_buffer(d->dev);
+  /* the sweep's yield isn't the chosen setting's */
+  d->yield_samples = d->yield_bits = d->yield_blocks = 0;
+  d->calibrated = 1;
+  d->recalibrate = 0;
+  if (calibrate_interval > 0)
+    d->next_calibrate = time(NULL) + calibrate_interval;
+  free(gains);
+  free(buf);
+  free(wide);
+}
+
+/* Moves a stopped stream to the governor's sample rate */
+static void device_rate(struct device *d)
+{
+  /* the yield so far was at the old rate */
+  profile_store(d);
+  d->rate = samp_rate;
+  if (gflags_quiet < 3)
+    log_line(LOG_DEBUG, "Device %s now sampling at %u Hz", d->name, d->rate);
+  if (rtlsdr_set_sample_rate(d->dev, d->rate) < 0 && gflags_quiet < 3)
+    log_line(LOG_DEBUG, "WARNING: Failed to set sample rate.");
+  rtlsdr_reset_buffer(d->dev);
+  d->yield_samples = d->yield_bits = 0;
+  d->last_read = time(NULL);
+  d->retune = 0;
+}
+
+/* Waits out a pause, then has the first buffers after it discarded */
+static void device_pause(struct device *d)
+{
+  if (gflags_quiet < 3)
+    log_line(LOG_DEBUG, "Device %s paused", d->name);
+  while (duty.paused && !stop_devices)
+    usleep(100000);
+  rtlsdr_reset_buffer(d->dev);
+  d->warmup = DUTY_WARMUP_BUFFERS;
+  d->last_read = time(NULL);
+  d->paused = 0;
+}
+
+/* Each buffer from the dongle, on the device's thread */
+static void device_callback(unsigned char *buf, uint32_t len, void *ctx)
+{
+  struct device *d = ctx;
+
+  if (stop_devices || d->why) {
+    rtlsdr_cancel_async(d->dev);
+    return;
+  }
+  if (len < DEFAULT_BUF_LENGTH) {
+    if (gflags_quiet < 3)
+      log_line(LOG_DEBUG, "ERROR: Short read on device %s, samples lost!", d->name);
+    d->why = "short read";
+    rtlsdr_cancel_async(d->dev);
+    return;
+  }
+  d->last_read = time(NULL);
+  if (d->next_calibrate && d->last_read >= d->next_calibrate) {
+    d->recalibrate = 1;
+    rtlsdr_cancel_async(d->dev);
+    return;
+  }
+  if (d->rate != samp_rate) {
+    d->retune = 1;
+    rtlsdr_cancel_async(d->dev);
+    return;
+  }
+  if (duty.paused) {
+    d->paused = 1;
+    rtlsdr_cancel_async(d->dev);
+    return;
+  }
+  d->reads++;
+  if (d->warmup) {
+    d->warmup--;
+    return;
+  }
+  device_samples(d, buf, len);
+}
+
+/* Cancels the stream of any device that's gone quiet, from the main loop */
+static void check_stalls(void)
+{
+  time_t now = time(NULL);
+  struct device *d;
+  int i;
+
+  for (i = 0; i < ndevices; i++) {
+    d = &devices[i];
+    pthread_mutex_lock(&d->lock);
+    if (d->streaming && !d->why && !d->paused && now - d->last_read > DEVICE_STALL_SECONDS) {
+      d->why = "stall";
+      rtlsdr_cancel_async(d->dev);
+    }
+    pthread_mutex_unlock(&d->lock);
+  }
+}
+
+/*
+ * A device's acquisition thread.  Whatever ends a stream, other than
+ * shutting down, the dongle is closed, re-opened and re-tuned after a
+ * backoff that doubles up to DEVICE_RETRY_MAX.  After
+ * DEVICE_FAILOVER_AFTER failures in a row a standby takes its place.
+ */
+static void *device_thread(void *arg)
+{
+  struct device *d = arg;
+  char labels[METRICS_LABELS_LEN];
+  int backoff = DEVICE_RETRY_MIN;
+  int r, wait;
+#if !(defined(__APPLE__) || defined(__FreeBSD__))
+  cpu_set_t cpus;
+
+  if (d->cpu >= 0) {
+    CPU_ZERO(&cpus);
+    CPU_SET(d->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) && gflags_quiet < 3)
+      log_line(LOG_DEBUG, "WARNING: Couldn't pin device %s to core %d", d->name, d->cpu);
+  }
+#endif
+
+  while (!stop_devices) {
+    if (device_open(d) < 0) {
+      d->why = "open";
+    } else {
+      d->opened = 1;
+      d->why = NULL;
+      d->reads = 0;
+      d->yield_samples = d->yield_bits = 0;
+      /*
+       * a warm start's restored block is in bitbuffer_old, and goes out
+       * with the first new one XORed in, never on its own
+       */
+      d->output_ready = 0;
+      d->warm = 0;
+      d->last_read = time(NULL);
+      d->streaming = 1;
+      metrics_set("device_up", d->labels, 1);
+      /* a cached profile stands in for the startup sweep */
+      if (calibrate_interval > 0 && !d->next_calibrate)
+	d->next_calibrate = time(NULL) + calibrate_interval;
+      do {
+	if (d->paused)
+	  device_pause(d);
+	if (d->retune)
+	  device_rate(d);
+	if (d->recalibrate || (calibrate_interval >= 0 && !d->calibrated && !d->profiled))
+	  calibrate(d);
+	if (gflags_quiet < 3)
+	  log_line(LOG_DEBUG, "Reading samples from device %s in async mode...", d->name);
+	r = rtlsdr_read_async(d->dev, device_callback, d, DEFAULT_ASYNC_BUF_NUMBER,
+			      DEFAULT_BUF_LENGTH);
+      } while ((d->recalibrate || d->retune || d->paused) && !stop_devices && !d->why);
+      profile_store(d);
+      pthread_mutex_lock(&d->lock);
+      d->streaming = 0;
+      rtlsdr_close(d->dev);
+      d->dev = NULL;
+      pthread_mutex_unlock(&d->lock);
+      metrics_set("device_up", d->labels, 0);
+      if (stop_devices)
+	break;
+      if (!d->why)
+	d->why = r < 0 ? "error" : "lost";
+      if (target_rate > 0)
+	governor_drop(&governor, GOVERN_DROPS);
+      /* it was working, so this is the first failure */
+      if (d->reads) {
+	d->failures = 0;
+	backoff = DEVICE_RETRY_MIN;
+      }
+    }
+    snprintf(labels, sizeof(labels), "%s,reason=\"%s\"", d->labels, d->why);
+    metrics_add("device_failures_total", labels, 1);
+    log_line(LOG_INFO, "WARNING: Device %s (#%d) %s", d->name, d->index, d->why);
+    /* a standby gets tried straight away */
+    if (++d->failures >= DEVICE_FAILOVER_AFTER && device_failover(d)) {
+      d->failures = 0;
+      backoff = DEVICE_RETRY_MIN;
+      continue;
+    }
+    if (gflags_quiet < 3)
+      log_line(LOG_DEBUG, "Re-opening device %s in %d s", d->name, backoff);
+    for (wait = 0; wait < backoff * 10 && !stop_devices; wait++)
+      usleep(100000);
+    backoff = backoff * 2 > DEVICE_RETRY_MAX ? DEVICE_RETRY_MAX : backoff * 2;
+  }
+  d->done = 1;
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  struct sigaction sigact;
+  char cpu_report[128];
+  int i, live, opened;
+  long ncpus;
 
   int option_count = 0, iii;
   char **config_file_options;
@@ -512,7 +1816,6 @@ int main(int argc, char **argv) {
 #endif
 
   /* get to the important stuff! */
-  buffer = malloc(out_block_size * sizeof(uint8_t));
   device_count = rtlsdr_get_device_count();
   if (!device_count) {
     suicide("No supported devices found, shutting down");
@@ -520,20 +1823,11 @@ int main(int argc, char **argv) {
   
   if (gflags_quiet < 3)
     log_line(LOG_DEBUG, "Found %d device(s):", device_count);
-  for (i = 0; i <(unsigned int)device_count; i++)
+  for (i = 0; i < device_count; i++)
   { if (gflags_quiet < 3)
       log_line(LOG_DEBUG, "  %d:  %s", i, rtlsdr_get_device_name(i));
   }
-  if (gflags_quiet < 3)
-    log_line(LOG_DEBUG, "Using device %d: %s", dev_index,
-	   rtlsdr_get_device_name(dev_index));
-  
-  r = rtlsdr_open(&dev, dev_index);
-  if (r < 0) {
-    if (gflags_quiet < 3)
-      log_line(LOG_DEBUG, "Failed to open rtlsdr device #%d.", dev_index);
-    exit(EXIT_FAILURE);
-  }
+  parse_devices(device_list ? device_list : "0", standby_list);
   
   /* Setup Signal handlers */
   sigact.sa_handler = sighandler;
@@ -543,168 +1837,142 @@ int main(int argc, char **argv) {
   sigaction(SIGTERM, &sigact, NULL);
   sigaction(SIGQUIT, &sigact, NULL);
   sigaction(SIGPIPE, &sigact, NULL);
-    
-  /* Set the sample rate */
-  r = rtlsdr_set_sample_rate(dev, samp_rate);
-  if (r < 0)
-    if (gflags_quiet < 3)
-      log_line(LOG_DEBUG, "WARNING: Failed to set sample rate.");
-  
-  /* Reset endpoint before we start reading from it (mandatory) */
-  r = rtlsdr_reset_buffer(dev);
-  if (r < 0)
-    if (gflags_quiet < 3)
-      log_line(LOG_DEBUG, "WARNING: Failed to reset buffers.");
-  
-  if (gflags_quiet < 3)
-    log_line(LOG_DEBUG, "Setting Frequency to %d", frequency);
-  r = rtlsdr_set_center_freq(dev, (uint32_t)frequency);
-  
-  gain = nearest_gain(gain);
-  if (gflags_quiet < 3)
-    log_line(LOG_DEBUG, "Setting gain to %0.2f", gain/10.0);
-  /* Manual gain mode */
-  r = rtlsdr_set_tuner_gain_mode(dev, 1);
-  if (r < 0)
-    if (gflags_quiet < 3)
-      log_line(LOG_DEBUG, "WARNING: Failed to set manual gain");
-  r = rtlsdr_set_tuner_gain(dev, gain);
-  if (r < 0)
-    if (gflags_quiet < 3)
-      log_line(LOG_DEBUG, "WARNING: Failed to set gain");
-  
+
+  /* before anything sets up a kernel */
+  cpu_select(cpu_choice, cpu_report, sizeof(cpu_report));
+  if (gflags_quiet < 2)
+    log_line(LOG_INFO, "%s", cpu_report);
+  metrics_set("cpu_level", NULL, cpu_level());
+
+  /* before anything asks OpenSSL for memory */
+  if (arena_init(ARENA_BYTES, memory_mode) || arena_hook_openssl())
+    log_line(LOG_INFO, "WARNING: Failed to set up the allocation arena, using the heap");
+  /* blocks, keys and conditioned output, kept off swap if asked */
+  arena_lock(devices, sizeof(devices));
+  arena_lock(&drbg_feed, sizeof(drbg_feed));
+  arena_lock(&pool, sizeof(pool));
+
+  if (condition_type == CONDITIONER_AES)
+    gflags_encryption = 1;
+  else if (gflags_encryption && condition_type != CONDITIONER_XOR)
+    suicide("Encryption (-e) and the %s conditioner don't mix", conditioner_names[condition_type]);
+  if (target_rate > 0)
+    samp_rate = governor_init(&governor, target_rate, govern_rates,
+			      sizeof(govern_rates) / sizeof(govern_rates[0]), samp_rate);
+  bitstats_reset(&profilestats);
+  next_profile = time(NULL) + profile_interval;
+
+  if (drbg_type >= 0) {
+    drbg_feed_init(&drbg_feed);
+    if (drbg_writers_start(&drbg_writers, drbg_type, drbg_threads, drbg_reseed_bytes,
+			   &drbg_feed, write_output))
+      suicide("Failed to start %d %s DRBG threads", drbg_threads, drbg_names[drbg_type]);
+  }
+  if (pool_mode >= 0)
+    pool_init(&pool);
+  if (correlation_threshold > 0) {
+    if (ndevices < 2)
+      log_line(LOG_INFO, "WARNING: Correlation needs more than one device, not checking");
+    else if (correlator_init(&correlator, ndevices, correlation_threshold))
+      suicide("Failed to set up the correlation detector");
+    else
+      correlating = 1;
+  }
+
   if (gflags_quiet < 3)
     log_line(LOG_DEBUG, "Doing FIPS init");
-  fips_init(&fipsctx, (int)0);
-  
-  if (gflags_quiet < 3)
-    log_line(LOG_DEBUG, "Reading samples in sync mode...");
+  /* with more than one device, each gets a core of its own, if there are enough */
+  ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (i = 0; i < ndevices; i++) {
+    device_init(&devices[i]);
+    devices[i].cpu = ndevices > 1 && ncpus > 1 ? (int)(i % ncpus) : -1;
+  }
+  if (state_name)
+    load_state();
+  if (pool_mode >= 0 && pool_reader_start(&pool_reader, &pool, pool_mode, deliver_output))
+    suicide("Failed to start the pool reader");
+  if (duty_high > 0 && reservoir_fill() < 0) {
+    log_line(LOG_INFO, "WARNING: Output isn't a pipe, and there's no -B or -D, so no duty cycling");
+    duty_high = 0;
+  }
+  if (duty_high > 0)
+    duty_init(&duty, duty_high, duty_low);
+
+  /* open them all at once, a slow dongle shouldn't hold up the rest */
+  for (i = 0; i < ndevices; i++)
+    if (pthread_create(&devices[i].thread, NULL, device_thread, &devices[i]))
+      suicide("Failed to start a thread for device %s", devices[i].name);
+
   while ( (!do_exit) || (do_exit == SIGPIPE)) {
     if (do_exit == SIGPIPE) {
       if (gflags_quiet < 3)
           log_line(LOG_DEBUG, "Reader went away, closing FIFO");
+      pthread_mutex_lock(&output_lock);
       fclose(output);
+      output = NULL;
       if (gflags_detach) {
   if (gflags_quiet < 3)
     log_line(LOG_DEBUG, "Waiting for a Reader...");
 	output = fopen(DEFAULT_OUT_FILE,"w");
+	do_exit = 0;
+	pthread_mutex_unlock(&output_lock);
       }
       else {
+	pthread_mutex_unlock(&output_lock);
 	break;
       }
     }
-    r = rtlsdr_read_sync(dev, buffer, out_block_size, &n_read);
-    if (r < 0) {
-      if (gflags_quiet < 3)
-        log_line(LOG_DEBUG, "ERROR: sync read failed: %d", r);
+    check_stalls();
+    if (correlating)
+      check_correlation();
+    periodic();
+    for (live = 0, i = 0; i < ndevices; i++)
+      live += !devices[i].done;
+    if (!live)
       break;
-    }
-    if ((uint32_t)n_read < out_block_size) {
-      if (gflags_quiet < 3)
-        log_line(LOG_DEBUG, "ERROR: Short read, samples lost, exiting!");
-      break;
-    }
-    
-    /* for each byte in the rtl-sdr read buffer
-       pick least significant 6 bits
-       for now:
-       debias, storing useful bits in write buffer, 
-       and discarded bits in hash buffer
-       until the write buffer is full.
-       create a key by SHA512() hashing the hash buffer
-       encrypt write buffer with key
-       output encrypted buffer
-       
-    */
-
-    output_ready = 0;
-
-    /* debias(buffer, bitbuffer, n_read, sizeof(buffer[0])); */
-    for (i=0; i < n_read * sizeof(buffer[0]); i++) {
-      for (j=0; j < 6; j+= 2) {
-	ch = (buffer[i] >> j) & 0x01;
-	ch2 = (buffer[i] >> (j+1)) & 0x01;
-	if (ch != ch2) {
-	  if (ch) {
-	    /* store a 1 in our bitbuffer */
-	    bitbuffer[buffercounter] |= 1 << bitcounter;
-	  } /* else, leave the buffer alone, it's already 0 at this bit */
-	  bitcounter++;
-	} else {
-	  if (ch) {
-	    store_hash_data(1);
-	  } else {
-	    store_hash_data(0);
-	  }
-	}
-	
-	/* is byte full? */
-	if (bitcounter >= sizeof(bitbuffer[0]) * 8) {
-	  buffercounter++;
-	  bitcounter = 0;
-	}
-	
-	/* is buffer full? */
-	if (buffercounter >= BUFFER_SIZE) {
-	  /* We have 2500 bytes of entropy 
-	     Can now send it to FIPS! */
-	  fips_result = fips_run_rng_test(&fipsctx, &bitbuffer);
-	  if (!fips_result) {
-	    if (gflags_encryption != 0) {
-	      if (hash_loop) {
-		/*   /\* Get a key from disacarded bits *\/ */
-		SHA512(hash_data_buffer, sizeof(hash_data_buffer), hash_buffer);
-		/* use key to encrypt output */
-		/* AES_set_encrypt_key(hash_buffer, 128, &wctx); */
-		/* AES_encrypt(bitbuffer, bitbuffer_old, &wctx); */
-		aes_init(hash_buffer, sizeof(hash_buffer), en);
-		aes_len = sizeof(bitbuffer);
-		ciphertext = aes_encrypt(en, bitbuffer, &aes_len);
-		/* yay, send it to the output! */
-		fwrite(ciphertext,sizeof(ciphertext[0]),aes_len,output);
-		/* Clean up */
-		free(ciphertext);
-		EVP_CIPHER_CTX_cleanup(en);
-	      }
-	    } else { 
-	      /* xor with old data */
-	      for (buffercounter = 0; buffercounter < BUFFER_SIZE; buffercounter++) {
-		bitbuffer[buffercounter] = bitbuffer[buffercounter] ^ bitbuffer_old[buffercounter];
-	      }
-	      if (output_ready) {
-		fwrite(&bitbuffer_old,sizeof(bitbuffer_old[0]),BUFFER_SIZE,output);
-	      }
-	      /* swap old data */
-	      memcpy(bitbuffer_old,bitbuffer,BUFFER_SIZE);
-	    }
-	    /* We're ready to write once we've been through the above once */
-	    output_ready = 1;
-	  } else {   /* FIPS test failed */
-	    for (j=0; j< N_FIPS_TESTS; j++) {
-	      if (fips_result & fips_test_mask[j]) {
-		if (!gflags_detach && gflags_quiet < 1)
-		  log_line(LOG_DEBUG, "Failed: %s", fips_test_names[j]);
-	      }
-	    }
-	  }
-	  /* reset buffers, and the counter */
-	  /* memset(bitbuffer_old,0,sizeof(bitbuffer_old)); */
-	  memset(bitbuffer,0,sizeof(bitbuffer));
-	  buffercounter = 0;
-	}
-      }
-    }
+    usleep(100000);
   }
   if (do_exit) {
     if (gflags_quiet < 3)
       log_line(LOG_DEBUG, "\nUser cancel, exiting...");
   }  else {
     if (gflags_quiet < 3)
-      log_line(LOG_DEBUG, "\nLibrary error %d, exiting...", r);
+      log_line(LOG_DEBUG, "\nNo devices left, exiting...");
   }
   
-  rtlsdr_close(dev);
-  free(buffer);
-  fclose(output);
-  return 0;
+  stop_devices = 1;
+  for (i = 0; i < ndevices; i++) {
+    /* a stalled stream has no callbacks to notice stop_devices */
+    pthread_mutex_lock(&devices[i].lock);
+    if (devices[i].streaming)
+      rtlsdr_cancel_async(devices[i].dev);
+    pthread_mutex_unlock(&devices[i].lock);
+  }
+  for (opened = 0, i = 0; i < ndevices; i++) {
+    pthread_join(devices[i].thread, NULL);
+    opened += devices[i].opened;
+  }
+  if (pool_mode >= 0)
+    pool_reader_stop(&pool_reader);
+  if (drbg_type >= 0)
+    drbg_writers_stop(&drbg_writers);
+  if (state_name)
+    save_state();
+  for (i = 0; i < ndevices; i++)
+    device_free(&devices[i]);
+  if (correlating)
+    correlator_free(&correlator);
+  if (metrics_name) {
+    if (pool_mode >= 0)
+      publish_pool();
+    metrics_write(metrics_name);
+    free(metrics_name);
+  }
+  free(device_list);
+  free(standby_list);
+  free(state_name);
+  free(cache_name);
+  if (output)
+    fclose(output);
+  return opened ? 0 : EXIT_FAILURE;
 }
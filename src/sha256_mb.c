@@ -0,0 +1,178 @@
+/*
+ * sha256_mb.c -- multi-buffer SHA-256
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "sha256_mb.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_AVX2_TARGET 1
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+
+static const uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t H0[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define ROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define ADD(a, b) _mm256_add_epi32(a, b)
+#define XOR3(a, b, c) _mm256_xor_si256(_mm256_xor_si256(a, b), c)
+
+/* One 64 byte block of every lane; w holds word i of lane l at w[i][l] */
+__attribute__((target("avx2")))
+static void compress8(__m256i st[8], const uint32_t w[16][SHA256_MB_LANES])
+{
+  __m256i W[16], a, b, c, d, e, f, g, h, t1, t2, s0, s1;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    W[i] = _mm256_loadu_si256((const __m256i *)w[i]);
+  a = st[0]; b = st[1]; c = st[2]; d = st[3];
+  e = st[4]; f = st[5]; g = st[6]; h = st[7];
+  for (i = 0; i < 64; i++) {
+    if (i >= 16) {
+      s0 = XOR3(ROTR(W[(i + 1) & 15], 7), ROTR(W[(i + 1) & 15], 18),
+		_mm256_srli_epi32(W[(i + 1) & 15], 3));
+      s1 = XOR3(ROTR(W[(i + 14) & 15], 17), ROTR(W[(i + 14) & 15], 19),
+		_mm256_srli_epi32(W[(i + 14) & 15], 10));
+      W[i & 15] = ADD(ADD(W[i & 15], s0), ADD(W[(i + 9) & 15], s1));
+    }
+    t1 = ADD(ADD(h, XOR3(ROTR(e, 6), ROTR(e, 11), ROTR(e, 25))),
+	     ADD(_mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)),
+		 ADD(_mm256_set1_epi32((int)K[i]), W[i & 15])));
+    t2 = ADD(XOR3(ROTR(a, 2), ROTR(a, 13), ROTR(a, 22)),
+	     _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b))));
+    h = g; g = f; f = e;
+    e = ADD(d, t1);
+    d = c; c = b; b = a;
+    a = ADD(t1, t2);
+  }
+  st[0] = ADD(st[0], a); st[1] = ADD(st[1], b);
+  st[2] = ADD(st[2], c); st[3] = ADD(st[3], d);
+  st[4] = ADD(st[4], e); st[5] = ADD(st[5], f);
+  st[6] = ADD(st[6], g); st[7] = ADD(st[7], h);
+}
+
+/* Byte j of block blk of a len byte message, after SHA-256 padding */
+static inline unsigned char padded(const unsigned char *m, size_t len, size_t pos,
+				   size_t total)
+{
+  if (pos < len)
+    return m[pos];
+  if (pos == len)
+    return 0x80;
+  if (pos >= total - 8)
+    return (unsigned char)(((uint64_t)len * 8) >> (8 * (total - 1 - pos)));
+  return 0;
+}
+
+__attribute__((target("avx2")))
+static void sha256_mb_avx2(const unsigned char *const in[], size_t len, int n,
+			   unsigned char *out)
+{
+  uint32_t w[16][SHA256_MB_LANES], digest[8][SHA256_MB_LANES];
+  const unsigned char *m[SHA256_MB_LANES], *p;
+  size_t total = (len + 9 + 63) & ~(size_t)63, full = len / 64, blk, pos;
+  __m256i st[8];
+  int i, l, j;
+
+  for (l = 0; l < SHA256_MB_LANES; l++)
+    m[l] = in[l < n ? l : 0];
+  for (i = 0; i < 8; i++)
+    st[i] = _mm256_set1_epi32((int)H0[i]);
+
+  for (blk = 0; blk < total / 64; blk++) {
+    for (l = 0; l < SHA256_MB_LANES; l++) {
+      if (blk < full) {
+	p = m[l] + 64 * blk;
+	for (i = 0; i < 16; i++)
+	  w[i][l] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16) |
+	    ((uint32_t)p[4 * i + 2] << 8) | p[4 * i + 3];
+      } else {
+	for (i = 0; i < 16; i++) {
+	  pos = 64 * blk + 4 * i;
+	  w[i][l] = 0;
+	  for (j = 0; j < 4; j++)
+	    w[i][l] = (w[i][l] << 8) | padded(m[l], len, pos + j, total);
+	}
+      }
+    }
+    compress8(st, (const uint32_t (*)[SHA256_MB_LANES])w);
+  }
+
+  for (i = 0; i < 8; i++)
+    _mm256_storeu_si256((__m256i *)digest[i], st[i]);
+  for (l = 0; l < n; l++) {
+    for (i = 0; i < 8; i++) {
+      out[32 * l + 4 * i] = (unsigned char)(digest[i][l] >> 24);
+      out[32 * l + 4 * i + 1] = (unsigned char)(digest[i][l] >> 16);
+      out[32 * l + 4 * i + 2] = (unsigned char)(digest[i][l] >> 8);
+      out[32 * l + 4 * i + 3] = (unsigned char)digest[i][l];
+    }
+  }
+}
+#endif
+
+int sha256_mb_available(void)
+{
+#ifdef HAVE_AVX2_TARGET
+  return cpu_level() >= CPU_AVX2;
+#else
+  return 0;
+#endif
+}
+
+void sha256_mb(const unsigned char *const in[], size_t len, int n,
+	       unsigned char *out)
+{
+#ifdef HAVE_AVX2_TARGET
+  sha256_mb_avx2(in, len, n, out);
+#else
+  (void)in; (void)len; (void)n; (void)out;
+#endif
+}
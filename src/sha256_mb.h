@@ -0,0 +1,50 @@
+/*
+ * sha256_mb.h -- multi-buffer SHA-256
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef SHA256_MB__H
+#define SHA256_MB__H
+
+#include <stddef.h>
+
+#define SHA256_MB_LANES	8
+
+/* Returns non-zero if the CPU can run sha256_mb() */
+extern int sha256_mb_available(void);
+
+/*
+ * Hashes n (1 to SHA256_MB_LANES) messages of len bytes each, one per
+ * AVX2 lane, writing n 32 byte digests to out.
+ */
+extern void sha256_mb(const unsigned char *const in[], size_t len, int n,
+		      unsigned char *out);
+
+#endif /* SHA256_MB__H */
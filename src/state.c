@@ -0,0 +1,252 @@
+/*
+ * state.c -- warm-start state carried across restarts
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "state.h"
+
+/*
+ * File layout: the magic, then per record a name length byte, the
+ * name, a 4 byte little endian length and the data, then a SHA-256 of
+ * everything before it.
+ */
+
+static int append(struct state *s, const void *data, size_t len)
+{
+  unsigned char *b;
+
+  if (s->len + len > STATE_MAX_BYTES)
+    return -1;
+  b = realloc(s->buf, s->len + len);
+  if (!b)
+    return -1;
+  s->buf = b;
+  memcpy(s->buf + s->len, data, len);
+  s->len += len;
+  return 0;
+}
+
+/* SHA-512 in counter mode over salt, name and value */
+static int expand(const unsigned char salt[32], const char *name, const void *data,
+		  size_t len, unsigned char *out)
+{
+  unsigned char block[SHA512_DIGEST_LENGTH];
+  unsigned char ctr[4];
+  EVP_MD_CTX *ctx;
+  uint32_t i;
+  size_t n;
+  int r = 0;
+
+  ctx = EVP_MD_CTX_new();
+  if (!ctx)
+    return -1;
+  /* every block hashes the whole value, so n counts what is left to fill */
+  for (i = 0, n = len; n > 0 && !r; i++) {
+    ctr[0] = i >> 24; ctr[1] = i >> 16; ctr[2] = i >> 8; ctr[3] = i;
+    if (!EVP_DigestInit_ex(ctx, EVP_sha512(), NULL) ||
+	!EVP_DigestUpdate(ctx, salt, 32) ||
+	!EVP_DigestUpdate(ctx, name, strlen(name) + 1) ||
+	!EVP_DigestUpdate(ctx, ctr, sizeof(ctr)) ||
+	!EVP_DigestUpdate(ctx, data, len) ||
+	!EVP_DigestFinal_ex(ctx, block, NULL)) {
+      r = -1;
+      break;
+    }
+    memcpy(out, block, n < sizeof(block) ? n : sizeof(block));
+    out += sizeof(block);
+    n = n < sizeof(block) ? 0 : n - sizeof(block);
+  }
+  EVP_MD_CTX_free(ctx);
+  memset(block, 0, sizeof(block));
+  return r;
+}
+
+int state_begin(struct state *s)
+{
+  struct {
+    unsigned char random[32];
+    struct timespec ts;
+    pid_t pid;
+  } seed;
+  int fd;
+
+  memset(s, 0, sizeof(*s));
+  /*
+   * The salt keeps the records from being worked out from output that
+   * later carries the same values, so it has to be secret as well as
+   * fresh: the kernel's pool, with the time and pid in case it is
+   * unreadable.
+   */
+  memset(&seed, 0, sizeof(seed));
+  fd = open("/dev/urandom", O_RDONLY);
+  if (fd < 0 || read(fd, seed.random, sizeof(seed.random)) != sizeof(seed.random)) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  close(fd);
+  clock_gettime(CLOCK_REALTIME, &seed.ts);
+  seed.pid = getpid();
+  SHA256((unsigned char *)&seed, sizeof(seed), s->salt);
+  memset(&seed, 0, sizeof(seed));
+  return append(s, STATE_MAGIC, 8);
+}
+
+int state_put(struct state *s, const char *name, const void *data, size_t len)
+{
+  unsigned char hdr[1 + STATE_NAME_LEN + 4];
+  unsigned char *out;
+  size_t n = strlen(name);
+  int r;
+
+  if (n == 0 || n >= STATE_NAME_LEN || len > STATE_MAX_BYTES)
+    return -1;
+  hdr[0] = n;
+  memcpy(hdr + 1, name, n);
+  hdr[n + 1] = len;
+  hdr[n + 2] = len >> 8;
+  hdr[n + 3] = len >> 16;
+  hdr[n + 4] = len >> 24;
+  out = malloc(len);
+  if (!out)
+    return -1;
+  r = expand(s->salt, name, data, len, out);
+  if (!r)
+    r = append(s, hdr, n + 5);
+  if (!r)
+    r = append(s, out, len);
+  memset(out, 0, len);
+  free(out);
+  return r;
+}
+
+int state_commit(struct state *s, const char *path)
+{
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  char tmp[4096];
+  int fd, r = -1;
+
+  SHA256(s->buf, s->len, digest);
+  if (append(s, digest, sizeof(digest)) ||
+      snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    goto out;
+  remove(tmp);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    goto out;
+  if (write(fd, s->buf, s->len) == (ssize_t)s->len && !fsync(fd))
+    r = 0;
+  if (close(fd))
+    r = -1;
+  if (r || rename(tmp, path)) {
+    remove(tmp);
+    r = -1;
+  }
+out:
+  state_free(s);
+  return r;
+}
+
+int state_load(struct state *s, const char *path)
+{
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  struct state_record *rec;
+  size_t pos, end, n;
+  FILE *fh;
+
+  memset(s, 0, sizeof(*s));
+  fh = fopen(path, "rb");
+  if (!fh)
+    return -1;
+  s->buf = malloc(STATE_MAX_BYTES);
+  if (s->buf)
+    s->len = fread(s->buf, 1, STATE_MAX_BYTES, fh);
+  fclose(fh);
+  /* used or not, a state only ever starts one run */
+  remove(path);
+  if (!s->buf || s->len < 8 + sizeof(digest))
+    goto bad;
+  end = s->len - sizeof(digest);
+  SHA256(s->buf, end, digest);
+  if (memcmp(digest, s->buf + end, sizeof(digest)) || memcmp(s->buf, STATE_MAGIC, 8))
+    goto bad;
+  for (pos = 8; pos < end; pos += n) {
+    if (s->nrecords == STATE_MAX_RECORDS)
+      goto bad;
+    rec = &s->records[s->nrecords++];
+    n = s->buf[pos];
+    if (n == 0 || n >= STATE_NAME_LEN || pos + 1 + n + 4 > end)
+      goto bad;
+    memcpy(rec->name, s->buf + pos + 1, n);
+    rec->name[n] = '\0';
+    pos += 1 + n;
+    rec->len = s->buf[pos] | s->buf[pos + 1] << 8 | s->buf[pos + 2] << 16 |
+      (size_t)s->buf[pos + 3] << 24;
+    pos += 4;
+    n = rec->len;
+    if (n > end - pos)
+      goto bad;
+    rec->data = s->buf + pos;
+  }
+  return 0;
+bad:
+  state_free(s);
+  return -1;
+}
+
+const unsigned char *state_get(const struct state *s, const char *name, size_t len)
+{
+  int i;
+
+  for (i = 0; i < s->nrecords; i++)
+    if (!strcmp(s->records[i].name, name))
+      return s->records[i].len == len ? s->records[i].data : NULL;
+  return NULL;
+}
+
+void state_free(struct state *s)
+{
+  if (s->buf) {
+    memset(s->buf, 0, s->len);
+    free(s->buf);
+  }
+  memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,85 @@
+/*
+ * state.h -- warm-start state carried across restarts
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef STATE__H
+#define STATE__H
+
+#include <stddef.h>
+
+/*
+ * A file of named records that lets a restart pick up where the last
+ * run left off (the discard ring, the block being accumulated, the
+ * seed feed) instead of waiting for them to fill again.
+ *
+ * Records are never the live values: each is stored as a SHA-512
+ * expansion of its value, the record name and a per-file salt, so
+ * nothing in the file is output the running process has given, or
+ * will give, out.  The file is written owner-only through a temporary
+ * file and a rename, ends in a SHA-256 of the rest, and is removed as
+ * soon as it is loaded, so one saved state only ever starts one run.
+ */
+#define STATE_MAGIC		"RTLESTA1"
+#define STATE_MAX_RECORDS	64
+#define STATE_MAX_BYTES		(1 << 20)
+#define STATE_NAME_LEN		48
+
+struct state_record {
+	char name[STATE_NAME_LEN];
+	size_t len;
+	const unsigned char *data;	/* into the loaded file */
+};
+
+struct state {
+	unsigned char *buf;
+	size_t len;
+	unsigned char salt[32];
+	int nrecords;
+	struct state_record records[STATE_MAX_RECORDS];
+};
+
+/* Starts an empty state to add records to.  Returns 0 on success. */
+extern int state_begin(struct state *s);
+/* Adds a record, expanded from len bytes of data.  Returns 0 on success. */
+extern int state_put(struct state *s, const char *name, const void *data, size_t len);
+/* Writes the state out, and frees it.  Returns 0 on success. */
+extern int state_commit(struct state *s, const char *path);
+
+/*
+ * Reads, checks and removes the state file.  Returns 0 on success, -1
+ * if there is no usable file.
+ */
+extern int state_load(struct state *s, const char *path);
+/* The record called name if it is exactly len bytes, else NULL */
+extern const unsigned char *state_get(const struct state *s, const char *name, size_t len);
+extern void state_free(struct state *s);
+
+#endif /* STATE__H */
@@ -0,0 +1,279 @@
+/*
+ * toeplitz.c -- Toeplitz hash randomness extractor
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_PCLMUL_TARGET 1
+#include <immintrin.h>
+#endif
+
+#include "cpu.h"
+#include "toeplitz.h"
+
+int toeplitz_parse(const char *spec, size_t *in, size_t *out)
+{
+  char *end;
+  long i, o;
+
+  i = strtol(spec, &end, 0);
+  if (*end != ':')
+    return -1;
+  o = strtol(end + 1, &end, 0);
+  if (*end != '\0')
+    return -1;
+  if (i <= 0 || o <= 0 || o > i || i % 8 || o % 8)
+    return -1;
+  *in = (size_t)i;
+  *out = (size_t)o;
+  return 0;
+}
+
+int toeplitz_init(struct toeplitz *t, size_t in_bytes, size_t out_bytes)
+{
+  memset(t, 0, sizeof(*t));
+  t->in_words = in_bytes / 8;
+  t->out_words = out_bytes / 8;
+  t->seed = calloc(t->in_words + t->out_words, sizeof(uint64_t));
+  t->prod = calloc(t->out_words + 1, sizeof(uint64_t));
+  t->block = calloc(t->in_words + t->out_words, sizeof(uint64_t));
+  if (!t->seed || !t->prod || !t->block) {
+    toeplitz_free(t);
+    return -1;
+  }
+#ifdef HAVE_PCLMUL_TARGET
+  __builtin_cpu_init();
+  t->pclmul = __builtin_cpu_supports("pclmul") && cpu_level() >= CPU_SSE42;
+#endif
+  return 0;
+}
+
+void toeplitz_free(struct toeplitz *t)
+{
+  free(t->seed);
+  free(t->prod);
+  free(t->block);
+  memset(t, 0, sizeof(*t));
+}
+
+static inline uint64_t load64(const unsigned char *p)
+{
+  uint64_t v = 0;
+  int i;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  (void)i;
+  memcpy(&v, p, 8);
+#else
+  for (i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+#endif
+  return v;
+}
+
+static inline void store64(unsigned char *p, uint64_t v)
+{
+  int i;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  (void)i;
+  memcpy(p, &v, 8);
+#else
+  for (i = 0; i < 8; i++, v >>= 8)
+    p[i] = (unsigned char)v;
+#endif
+}
+
+void toeplitz_seed(struct toeplitz *t, const unsigned char *key, size_t len)
+{
+  unsigned char md[SHA512_DIGEST_LENGTH];
+  unsigned char counter[4];
+  size_t words = t->in_words + t->out_words, w = 0;
+  uint32_t n;
+  EVP_MD_CTX *ctx;
+  int i;
+
+  ctx = EVP_MD_CTX_new();
+
+  for (n = 0; w < words; n++) {
+    counter[0] = n >> 24;
+    counter[1] = n >> 16;
+    counter[2] = n >> 8;
+    counter[3] = n;
+    EVP_DigestInit_ex(ctx, EVP_sha512(), NULL);
+    EVP_DigestUpdate(ctx, counter, sizeof(counter));
+    EVP_DigestUpdate(ctx, key, len);
+    EVP_DigestFinal_ex(ctx, md, NULL);
+    for (i = 0; i < SHA512_DIGEST_LENGTH && w < words; i += 8)
+      t->seed[w++] = load64(md + i);
+  }
+  EVP_MD_CTX_free(ctx);
+  memset(md, 0, sizeof(md));
+  t->seeded = 1;
+}
+
+/* 64 x 64 bit carry-less multiply, four bits of b at a time.  The
+ * table only holds the low 60 bits of a, so it can't overflow. */
+static inline void clmul_soft(uint64_t a, uint64_t b, uint64_t *lo, uint64_t *hi)
+{
+  uint64_t tab[16], al = a & 0x0fffffffffffffffULL, l, h, v;
+  int i;
+
+  tab[0] = 0;
+  tab[1] = al;
+  for (i = 2; i < 16; i += 2) {
+    tab[i] = tab[i / 2] << 1;
+    tab[i + 1] = tab[i] ^ al;
+  }
+  l = tab[b & 15];
+  h = 0;
+  for (i = 4; i < 64; i += 4) {
+    v = tab[(b >> i) & 15];
+    l ^= v << i;
+    h ^= v >> (64 - i);
+  }
+  for (i = 60; i < 64; i++) {
+    if ((a >> i) & 1) {
+      l ^= b << i;
+      h ^= b >> (64 - i);
+    }
+  }
+  *lo = l;
+  *hi = h;
+}
+
+static void hash_soft(const struct toeplitz *t, const uint64_t *in, uint64_t *out)
+{
+  size_t N = t->in_words, M = t->out_words, i, j, k;
+  uint64_t *p = t->prod, lo, hi;
+
+  /* product words N-1 .. N+M-1 land in p[0] .. p[M] */
+  memset(p, 0, (M + 1) * sizeof(*p));
+  for (j = 0; j < N; j++) {
+    for (k = N >= 2 ? N - 2 : 0; k <= N + M - 1; k++) {
+      if (k < j)
+	continue;
+      i = k - j;
+      clmul_soft(t->seed[i], in[j], &lo, &hi);
+      if (k >= N - 1)
+	p[k - (N - 1)] ^= lo;
+      if (k + 1 <= N + M - 1)
+	p[k + 1 - (N - 1)] ^= hi;
+    }
+  }
+  for (k = 0; k < M; k++)
+    out[k] = (p[k] >> 63) | (p[k + 1] << 1);
+}
+
+#ifdef HAVE_PCLMUL_TARGET
+__attribute__((target("pclmul,sse2")))
+static void hash_pclmul(const struct toeplitz *t, const uint64_t *in, uint64_t *out)
+{
+  size_t N = t->in_words, M = t->out_words, j, jmax, k;
+  const uint64_t *seed = t->seed;
+  __m128i acc, acc2, s, x;
+  uint64_t *p = t->prod, lo, hi;
+
+  memset(p, 0, (M + 1) * sizeof(*p));
+  /* Product word k gathers seed[k - j] * in[j] over all j, two j at
+   * a time: one load picks up seed[k - j - 1] and seed[k - j], the
+   * other in[j] and in[j + 1]. */
+  for (k = N >= 2 ? N - 2 : 0; k <= N + M - 1; k++) {
+    acc = acc2 = _mm_setzero_si128();
+    jmax = k < N - 1 ? k : N - 1;
+    for (j = 0; j + 1 <= jmax; j += 2) {
+      s = _mm_loadu_si128((const __m128i *)(seed + k - j - 1));
+      x = _mm_loadu_si128((const __m128i *)(in + j));
+      acc = _mm_xor_si128(acc, _mm_clmulepi64_si128(s, x, 0x01));
+      acc2 = _mm_xor_si128(acc2, _mm_clmulepi64_si128(s, x, 0x10));
+    }
+    acc = _mm_xor_si128(acc, acc2);
+    if (j == jmax)
+      acc = _mm_xor_si128(acc, _mm_clmulepi64_si128(
+			    _mm_cvtsi64_si128((long long)seed[k - j]),
+			    _mm_cvtsi64_si128((long long)in[j]), 0x00));
+    lo = (uint64_t)_mm_cvtsi128_si64(acc);
+    hi = (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+    if (k >= N - 1)
+      p[k - (N - 1)] ^= lo;
+    if (k + 1 <= N + M - 1)
+      p[k + 1 - (N - 1)] ^= hi;
+  }
+  for (k = 0; k < M; k++)
+    out[k] = (p[k] >> 63) | (p[k + 1] << 1);
+}
+#endif
+
+void toeplitz_hash(const struct toeplitz *t, const uint64_t *in, uint64_t *out)
+{
+#ifdef HAVE_PCLMUL_TARGET
+  if (t->pclmul) {
+    hash_pclmul(t, in, out);
+    return;
+  }
+#endif
+  hash_soft(t, in, out);
+}
+
+size_t toeplitz_out_max(const struct toeplitz *t, size_t len)
+{
+  return (len / (t->in_words * 8) + 1) * t->out_words * 8;
+}
+
+size_t toeplitz_absorb(struct toeplitz *t, const unsigned char *in, size_t len,
+		       unsigned char *out)
+{
+  size_t block = t->in_words * 8, n, w, written = 0;
+  unsigned char *bytes = (unsigned char *)t->block;
+
+  while (len > 0) {
+    n = block - t->fill;
+    if (n > len)
+      n = len;
+    memcpy(bytes + t->fill, in, n);
+    t->fill += n;
+    in += n;
+    len -= n;
+    if (t->fill == block) {
+      for (w = 0; w < t->in_words; w++)
+	t->block[w] = load64(bytes + 8 * w);
+      toeplitz_hash(t, t->block, t->block + t->in_words);
+      for (w = 0; w < t->out_words; w++, written += 8)
+	store64(out + written, t->block[t->in_words + w]);
+      t->fill = 0;
+    }
+  }
+  return written;
+}
@@ -0,0 +1,79 @@
+/*
+ * toeplitz.h -- Toeplitz hash randomness extractor
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#ifndef TOEPLITZ__H
+#define TOEPLITZ__H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default input and output block sizes, in bytes */
+#define TOEPLITZ_IN	64
+#define TOEPLITZ_OUT	32
+
+/*
+ * Hashes each in_words * 64 bit input block down to out_words * 64
+ * bits, by multiplying with a random Toeplitz matrix over GF(2).  The
+ * matrix is fixed by its first row and column, the seed, which makes
+ * the product a slice of the carry-less product of seed and input.
+ * That goes 64 bits at a time, with PCLMULQDQ where there is one.
+ */
+struct toeplitz {
+	size_t in_words, out_words;
+	uint64_t *seed;			/* in_words + out_words words */
+	uint64_t *prod;			/* out_words + 1 words of scratch */
+	uint64_t *block;		/* input waiting for a full block, then output */
+	size_t fill;			/* bytes in block */
+	int seeded;
+	int pclmul;
+};
+
+/* Parses "in:out" (bytes, multiples of 8, out <= in) into in and
+ * out.  Returns 0 on success. */
+extern int toeplitz_parse(const char *spec, size_t *in, size_t *out);
+/* Returns 0 on success */
+extern int toeplitz_init(struct toeplitz *t, size_t in_bytes, size_t out_bytes);
+extern void toeplitz_free(struct toeplitz *t);
+/* Sets the matrix from len bytes of key, expanded with SHA-512 */
+extern void toeplitz_seed(struct toeplitz *t, const unsigned char *key, size_t len);
+/* Hashes one block of in_words words into out_words words */
+extern void toeplitz_hash(const struct toeplitz *t, const uint64_t *in, uint64_t *out);
+/*
+ * Adds len bytes of input, hashing every full block into out, which
+ * must have room for toeplitz_out_max(t, len) bytes.  Returns the
+ * number of bytes written to out.
+ */
+extern size_t toeplitz_absorb(struct toeplitz *t, const unsigned char *in, size_t len,
+			      unsigned char *out);
+extern size_t toeplitz_out_max(const struct toeplitz *t, size_t len);
+
+#endif /* TOEPLITZ__H */
@@ -132,9 +132,22 @@ double atofs(char* f)
 
 
 
+/* An AES-256-CBC context for aes_init() to key, or NULL */
+EVP_CIPHER_CTX *aes_ctx_new(void)
+{
+  EVP_CIPHER_CTX *e_ctx = EVP_CIPHER_CTX_new();
+
+  /* choosing the cipher allocates, so it is only done the once */
+  if (e_ctx && !EVP_EncryptInit_ex(e_ctx, EVP_aes_256_cbc(), NULL, NULL, NULL)) {
+    EVP_CIPHER_CTX_free(e_ctx);
+    e_ctx = NULL;
+  }
+  return e_ctx;
+}
+
 /**
  * Create an 256 bit key and IV using the supplied key_data. salt can be added for taste.
- * Fills in the encryption and decryption ctx objects and returns 0 on success
+ * Keys a context from aes_ctx_new() and returns 0 on success
  **/
 int aes_init(unsigned char *key_data, int key_data_len, EVP_CIPHER_CTX *e_ctx) 
 {
@@ -142,32 +155,27 @@ int aes_init(unsigned char *key_data, int key_data_len, EVP_CIPHER_CTX *e_ctx)
   unsigned char key[32], iv[32];
   unsigned int salt[] = { 25016, 29592 };
   EVP_BytesToKey(EVP_aes_256_cbc(), EVP_sha1(), (unsigned char *)&salt, key_data, key_data_len, nrounds, key, iv);
-  EVP_CIPHER_CTX_init(e_ctx);
-  EVP_EncryptInit_ex(e_ctx, EVP_aes_256_cbc(), NULL, key, iv);
+  EVP_EncryptInit_ex(e_ctx, NULL, NULL, key, iv);
   return 0;
 }
 
 /*
- * Encrypt *len bytes of data
+ * Encrypt len bytes of data into ciphertext, which has room for
+ * len + AES_BLOCK_SIZE bytes.  Returns the length of the ciphertext.
  * All data going in & out is considered binary (unsigned char[])
  */
-unsigned char *aes_encrypt(EVP_CIPHER_CTX *e, unsigned char *plaintext, int *len)
+int aes_encrypt(EVP_CIPHER_CTX *e, const unsigned char *plaintext, int len,
+		unsigned char *ciphertext)
 {
-  /* max ciphertext len for a n bytes of plaintext is n + AES_BLOCK_SIZE -1 bytes */
-  int c_len = *len + AES_BLOCK_SIZE, f_len = 0;
-  unsigned char *ciphertext = malloc(c_len);
+  int c_len = len + AES_BLOCK_SIZE, f_len = 0;
 
-  /* allows reusing of 'e' for multiple encryption cycles */
-  EVP_EncryptInit_ex(e, NULL, NULL, NULL, NULL);
-  
   /* update ciphertext, c_len is filled with the length of ciphertext generated,
-   *len is the size of plaintext in bytes */
-  EVP_EncryptUpdate(e, ciphertext, &c_len, plaintext, *len);
+     len is the size of plaintext in bytes */
+  EVP_EncryptUpdate(e, ciphertext, &c_len, plaintext, len);
   /* update ciphertext with the final remaining bytes */
   EVP_EncryptFinal_ex(e, ciphertext+c_len, &f_len);
 
-  *len = c_len + f_len;
-  return ciphertext;
+  return c_len + f_len;
 }
 
 
@@ -191,6 +199,32 @@ void store_hash_data(int bit) {
 }
 
 
+/* store_hash_data() for nbits bits, LSB first */
+void store_hash_bits(unsigned int bits, int nbits) {
+  unsigned int take, mask;
+
+  while (nbits) {
+    take = 8 - hash_data_bit_counter;
+    if (take > (unsigned int)nbits)
+      take = nbits;
+    mask = ((1 << take) - 1) << hash_data_bit_counter;
+    hash_data_buffer[hash_data_counter] = (hash_data_buffer[hash_data_counter] & ~mask) |
+      ((bits << hash_data_bit_counter) & mask);
+    bits >>= take;
+    nbits -= take;
+    hash_data_bit_counter += take;
+    if (hash_data_bit_counter == sizeof(hash_data_buffer[0]) * 8) {
+      hash_data_bit_counter = 0;
+      hash_data_counter++;
+    }
+
+    if (hash_data_counter == SHA512_DIGEST_LENGTH) {
+      hash_data_counter = 0;
+      hash_loop=1;
+    }
+  }
+}
+
 int debias(int16_t one, int16_t two, int bit_index) {
   /* Debias the bit pair at bit_index */
   int ch1,ch2;
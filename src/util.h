@@ -41,9 +41,12 @@ int parse_group(char *groupname);
 void write_pidfile(void);
 void daemonize(void);
 double atofs(char* f);
+EVP_CIPHER_CTX *aes_ctx_new(void);
 int aes_init(unsigned char *key_data, int key_data_len, EVP_CIPHER_CTX *e_ctx);
-unsigned char *aes_encrypt(EVP_CIPHER_CTX *e, unsigned char *plaintext, int *len);
+int aes_encrypt(EVP_CIPHER_CTX *e, const unsigned char *plaintext, int len,
+		unsigned char *ciphertext);
 void store_hash_data(int bit);
+void store_hash_bits(unsigned int bits, int nbits);
 int debias(int16_t one, int16_t two, int bit_index);
 
 
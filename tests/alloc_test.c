@@ -0,0 +1,190 @@
+/*
+ * alloc_test.c -- checks the per-block paths stay off the heap
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+/*
+ * Replays a fixed buffer through rtl_entropy's own device_samples(),
+ * and so its extractors, put_bits(), process_block(), conditioners,
+ * DRBG writers and pool, under each configuration that changes the
+ * per-block path.  Once a first few buffers have filled the arena's
+ * free lists and the stdio buffers, nothing may reach the heap: the
+ * test binary is linked with --wrap for malloc, calloc and realloc,
+ * and the wrappers count every call, along with any OpenSSL allocation
+ * the arena couldn't serve.
+ */
+
+/* the program itself, with its main() out of the way */
+#define main rtl_entropy_main
+#include "rtl_entropy.c"
+#undef main
+
+#define WARMUP_BUFFERS	4
+#define COUNTED_BUFFERS	16
+#define REPLAY_BYTES	DEFAULT_BUF_LENGTH
+
+struct scenario {
+	const char *name;
+	int condition, encrypt, extractor, drbg, pool;
+};
+
+static const struct scenario scenarios[] = {
+	{ "xor",			CONDITIONER_XOR,	0, EXTRACTOR_VN,    -1,	-1 },
+	{ "aes",			CONDITIONER_AES,	1, EXTRACTOR_VN,    -1,	-1 },
+	{ "toeplitz",			CONDITIONER_TOEPLITZ,	0, EXTRACTOR_VN,    -1,	-1 },
+	{ "sha256, elias",		CONDITIONER_SHA256,	0, EXTRACTOR_ELIAS, -1,	-1 },
+	{ "sha512, peres",		CONDITIONER_SHA512,	0, EXTRACTOR_PERES, -1,	-1 },
+	{ "blake2b",			CONDITIONER_BLAKE2B,	0, EXTRACTOR_VN,    -1,	-1 },
+	{ "blake3",			CONDITIONER_BLAKE3,	0, EXTRACTOR_VN,    -1,	-1 },
+	{ "xor, ctr drbg",		CONDITIONER_XOR,	0, EXTRACTOR_VN,    DRBG_CTR, -1 },
+	{ "sha256, chacha20 drbg",	CONDITIONER_SHA256,	0, EXTRACTOR_VN,    DRBG_CHACHA20, -1 },
+	{ "xor, pool",			CONDITIONER_XOR,	0, EXTRACTOR_VN,    -1,	POOL_BLOCKING },
+};
+
+static volatile int counting;
+static unsigned long heap_calls;
+
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t nmemb, size_t n);
+void *__real_realloc(void *p, size_t n);
+
+void *__wrap_malloc(size_t n)
+{
+  if (counting)
+    __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+  return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t n)
+{
+  if (counting)
+    __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+  return __real_calloc(nmemb, n);
+}
+
+void *__wrap_realloc(void *p, size_t n)
+{
+  if (counting)
+    __atomic_add_fetch(&heap_calls, 1, __ATOMIC_RELAXED);
+  return __real_realloc(p, n);
+}
+
+/* A fixed xorshift stream, so every run replays the same samples */
+static void make_replay(uint8_t *replay, size_t len)
+{
+  unsigned long long x = 0x9e3779b97f4a7c15ULL;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    replay[i] = (uint8_t)(x >> 32);
+  }
+}
+
+/* Returns the heap calls made by the counted buffers, or -1 if nothing came out */
+static long run(const struct scenario *s, const uint8_t *replay)
+{
+  struct device *d = &devices[0];
+  unsigned long arena_before;
+  double before;
+  int i;
+
+  condition_type = s->condition;
+  gflags_encryption = s->encrypt;
+  extract_method = s->extractor;
+  drbg_type = s->drbg;
+  pool_mode = s->pool;
+  memset(d, 0, sizeof(*d));
+  snprintf(d->name, sizeof(d->name), "0");
+  snprintf(d->labels, sizeof(d->labels), "device=\"0\"");
+  if (drbg_type >= 0) {
+    drbg_feed_init(&drbg_feed);
+    if (drbg_writers_start(&drbg_writers, drbg_type, 2, DRBG_RESEED, &drbg_feed, write_output))
+      return -1;
+  }
+  if (pool_mode >= 0) {
+    pool_init(&pool);
+    if (pool_reader_start(&pool_reader, &pool, pool_mode, deliver_output))
+      return -1;
+  }
+  device_init(d);
+
+  for (i = 0; i < WARMUP_BUFFERS; i++)
+    device_samples(d, replay, REPLAY_BYTES);
+  /* let the writer threads through their first requests too */
+  usleep(200000);
+  before = metrics_get("output_bytes_total", NULL);
+  arena_before = arena_heap_allocs();
+  heap_calls = 0;
+  counting = 1;
+  for (i = 0; i < COUNTED_BUFFERS; i++)
+    device_samples(d, replay, REPLAY_BYTES);
+  usleep(200000);
+  counting = 0;
+  heap_calls += arena_heap_allocs() - arena_before;
+
+  if (pool_mode >= 0)
+    pool_reader_stop(&pool_reader);
+  if (drbg_type >= 0)
+    drbg_writers_stop(&drbg_writers);
+  device_free(d);
+  return metrics_get("output_bytes_total", NULL) > before ? (long)heap_calls : -1;
+}
+
+int main(void)
+{
+  static uint8_t replay[REPLAY_BYTES];
+  unsigned int i;
+  long calls;
+  int failed = 0;
+
+  gflags_quiet = 3;
+  if (arena_init(ARENA_BYTES, ARENA_PAGEABLE) || arena_hook_openssl()) {
+    fprintf(stderr, "alloc_test: couldn't set up the arena\n");
+    return 1;
+  }
+  output = fopen("/dev/null", "w");
+  if (!output)
+    return 1;
+  make_replay(replay, sizeof(replay));
+
+  for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    calls = run(&scenarios[i], replay);
+    if (calls < 0)
+      printf("alloc_test: %s, no output\n", scenarios[i].name);
+    else
+      printf("alloc_test: %s, %ld heap allocations\n", scenarios[i].name, calls);
+    failed |= calls != 0;
+  }
+  fclose(output);
+  return failed;
+}
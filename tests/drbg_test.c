@@ -0,0 +1,82 @@
+/*
+ * drbg_test.c -- checks DRBG output gives nothing away about the next
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "drbg.h"
+
+#define REQUEST	4096
+
+/*
+ * Takes every 16 byte aligned window of a request's output as the
+ * generator's key and iv, and checks none of them predicts the next
+ * request.  Returns the number that did.
+ */
+static int predictable(int type)
+{
+  static unsigned char first[REQUEST], second[REQUEST], guess[REQUEST];
+  unsigned char seed[DRBG_SEED_LEN];
+  struct drbg d, g;
+  size_t off;
+  int hits = 0;
+
+  memset(seed, 0xa5, sizeof(seed));
+  if (drbg_init(&d, type, seed) || drbg_init(&g, type, seed))
+    return -1;
+  drbg_generate(&d, first, sizeof(first));
+  drbg_generate(&d, second, sizeof(second));
+  if (!memcmp(first, second, sizeof(first)))
+    hits++;
+  for (off = 0; off + DRBG_SEED_LEN <= sizeof(first); off += 16) {
+    memcpy(g.key, first + off, sizeof(g.key));
+    memcpy(g.v, first + off + sizeof(g.key), sizeof(g.v));
+    drbg_generate(&g, guess, sizeof(guess));
+    if (!memcmp(guess, second, sizeof(guess)))
+      hits++;
+  }
+  drbg_free(&d);
+  drbg_free(&g);
+  return hits;
+}
+
+int main(void)
+{
+  int i, hits, failed = 0;
+
+  for (i = 0; i < N_DRBGS; i++) {
+    hits = predictable(i);
+    printf("drbg_test: %s, %d predicted requests\n", drbg_names[i], hits);
+    failed |= hits != 0;
+  }
+  return failed;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# failover_test.sh -- rtl_entropy recovering from a failing dongle
+#
+# Runs rtl_entropy, built against mock_rtlsdr.c, on dongle #0 with #1
+# as its standby.  #0 streams for a while and goes quiet, so the stall
+# watchdog has to cancel it; after that it won't open, so the re-opens
+# back off, 1 s then 2 s, until the standby takes over and output
+# carries on from #1.
+#
+# Usage: failover_test.sh path/to/rtl_entropy_faulty
+
+prog=$1
+log=failover_test.log
+out=failover_test.out
+
+fail() {
+  echo "failover_test: $*"
+  kill "$pid" 2>/dev/null
+  wait "$pid" 2>/dev/null
+  cat "$log"
+  exit 1
+}
+
+expect() {
+  grep -q "$1" "$log" || fail "no \"$1\" in the log"
+}
+
+rm -f "$log" "$out"
+MOCK_RTLSDR_FAULTY=0 MOCK_RTLSDR_OPENS=1 MOCK_RTLSDR_STALL_AFTER=8 \
+  "$prog" -d 0 -S 1 -o "$out" 2>"$log" &
+pid=$!
+
+# the stall takes DEVICE_STALL_SECONDS to notice, then 3 s of backoff
+for i in $(seq 30); do
+  grep -q "failing over" "$log" && break
+  kill -0 "$pid" 2>/dev/null || fail "rtl_entropy exited"
+  sleep 1
+done
+expect "Device 0 (#0) stall"
+expect "Re-opening device 0 in 1 s"
+expect "Device 0 (#0) open"
+expect "Re-opening device 0 in 2 s"
+expect "failing over from #0 to standby #1"
+
+before=$(wc -c < "$out")
+sleep 3
+after=$(wc -c < "$out")
+[ "$after" -gt "$before" ] || fail "no output from the standby"
+
+kill -TERM "$pid"
+wait "$pid" || fail "rtl_entropy didn't exit cleanly"
+echo "failover_test: took over after $i s, $((after - before)) bytes in 3 s from the standby"
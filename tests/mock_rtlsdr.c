@@ -0,0 +1,234 @@
+/*
+ * mock_rtlsdr.c -- a librtlsdr stand-in that fails on cue
+ *
+ * Copyright (C) 2013 Paul Warren <pwarren@pwarren.id.au>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+
+/*
+ * Enough of librtlsdr for rtl_entropy, streaming random samples in
+ * real time, with faults for the acquisition threads to recover from.
+ * The faults hit one dongle, and are set in the environment:
+ *
+ *  MOCK_RTLSDR_DEVICES      dongles plugged in (default: 2)
+ *  MOCK_RTLSDR_FAULTY       index of the one that misbehaves (default: 0)
+ *  MOCK_RTLSDR_OPENS        opens that succeed, after which it won't open
+ *  MOCK_RTLSDR_STALL_AFTER  buffers before its stream goes quiet, until cancelled
+ *  MOCK_RTLSDR_ERROR_AFTER  buffers before its stream ends in an error
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <rtl-sdr.h>
+
+#define MOCK_MAX_DEVICES	16
+#define MOCK_BUF_LENGTH		(16 * 16384)
+
+struct rtlsdr_dev {
+  uint32_t index, rate, freq;
+  int gain;
+  unsigned long buffers;	/* delivered since the stream started */
+  unsigned long long x;		/* xorshift state */
+  volatile int cancel;
+};
+
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static int opens[MOCK_MAX_DEVICES];
+static const int gains[] = { 0, 9, 14, 27, 37, 77, 87, 125, 144, 157, 166, 197, 207, 229,
+			     254, 280, 297, 328, 338, 364, 372, 386, 402, 421, 434, 439,
+			     445, 480, 496 };
+
+/* An environment setting, or def if it isn't set */
+static long mock_env(const char *name, long def)
+{
+  char *v = getenv(name);
+
+  return v ? atol(v) : def;
+}
+
+static int mock_faulty(const rtlsdr_dev_t *dev)
+{
+  return dev->index == (uint32_t)mock_env("MOCK_RTLSDR_FAULTY", 0);
+}
+
+static void mock_fill(rtlsdr_dev_t *dev, unsigned char *buf, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    dev->x ^= dev->x << 13;
+    dev->x ^= dev->x >> 7;
+    dev->x ^= dev->x << 17;
+    buf[i] = (unsigned char)(dev->x >> 32);
+  }
+}
+
+uint32_t rtlsdr_get_device_count(void)
+{
+  return (uint32_t)mock_env("MOCK_RTLSDR_DEVICES", 2);
+}
+
+const char *rtlsdr_get_device_name(uint32_t index)
+{
+  return "Mock RTL2832U";
+}
+
+int rtlsdr_get_device_usb_strings(uint32_t index, char *manufact, char *product, char *serial)
+{
+  if (index >= rtlsdr_get_device_count())
+    return -1;
+  strcpy(manufact, "Mock");
+  strcpy(product, "RTL2838UHIDIR");
+  sprintf(serial, "%08u", index + 1);
+  return 0;
+}
+
+int rtlsdr_get_index_by_serial(const char *serial)
+{
+  int index = atoi(serial) - 1;
+
+  return index >= 0 && (uint32_t)index < rtlsdr_get_device_count() ? index : -3;
+}
+
+int rtlsdr_open(rtlsdr_dev_t **out_dev, uint32_t index)
+{
+  rtlsdr_dev_t *dev;
+  long allowed = mock_env("MOCK_RTLSDR_OPENS", -1);
+  int refused = 0;
+
+  if (index >= rtlsdr_get_device_count() || index >= MOCK_MAX_DEVICES)
+    return -1;
+  pthread_mutex_lock(&mock_lock);
+  if (index == (uint32_t)mock_env("MOCK_RTLSDR_FAULTY", 0) && allowed >= 0)
+    refused = opens[index] >= allowed;
+  if (!refused)
+    opens[index]++;
+  pthread_mutex_unlock(&mock_lock);
+  if (refused)
+    return -1;
+  dev = calloc(1, sizeof(*dev));
+  if (!dev)
+    return -1;
+  dev->index = index;
+  dev->rate = 2048000;
+  dev->x = 0x9e3779b97f4a7c15ULL + index;
+  *out_dev = dev;
+  return 0;
+}
+
+int rtlsdr_close(rtlsdr_dev_t *dev)
+{
+  free(dev);
+  return 0;
+}
+
+int rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq)
+{
+  dev->freq = freq;
+  return 0;
+}
+
+int rtlsdr_get_tuner_gains(rtlsdr_dev_t *dev, int *out_gains)
+{
+  if (out_gains)
+    memcpy(out_gains, gains, sizeof(gains));
+  return sizeof(gains) / sizeof(gains[0]);
+}
+
+int rtlsdr_set_tuner_gain(rtlsdr_dev_t *dev, int gain)
+{
+  dev->gain = gain;
+  return 0;
+}
+
+int rtlsdr_set_tuner_gain_mode(rtlsdr_dev_t *dev, int manual)
+{
+  return 0;
+}
+
+int rtlsdr_set_sample_rate(rtlsdr_dev_t *dev, uint32_t rate)
+{
+  dev->rate = rate;
+  return 0;
+}
+
+int rtlsdr_reset_buffer(rtlsdr_dev_t *dev)
+{
+  return 0;
+}
+
+int rtlsdr_read_sync(rtlsdr_dev_t *dev, void *buf, int len, int *n_read)
+{
+  mock_fill(dev, buf, len);
+  *n_read = len;
+  return 0;
+}
+
+int rtlsdr_read_async(rtlsdr_dev_t *dev, rtlsdr_read_async_cb_t cb, void *ctx,
+		      uint32_t buf_num, uint32_t buf_len)
+{
+  long stall = mock_faulty(dev) ? mock_env("MOCK_RTLSDR_STALL_AFTER", -1) : -1;
+  long error = mock_faulty(dev) ? mock_env("MOCK_RTLSDR_ERROR_AFTER", -1) : -1;
+  unsigned char *buf;
+
+  if (!buf_len)
+    buf_len = MOCK_BUF_LENGTH;
+  buf = malloc(buf_len);
+  if (!buf)
+    return -1;
+  dev->cancel = 0;
+  dev->buffers = 0;
+  while (!dev->cancel) {
+    if (error >= 0 && dev->buffers >= (unsigned long)error) {
+      free(buf);
+      return -5;
+    }
+    /* like a wedged dongle: no callbacks, no error, until cancelled */
+    if (stall >= 0 && dev->buffers >= (unsigned long)stall) {
+      while (!dev->cancel)
+	usleep(10000);
+      break;
+    }
+    mock_fill(dev, buf, buf_len);
+    cb(buf, buf_len, ctx);
+    dev->buffers++;
+    /* I and Q are a byte each */
+    usleep((useconds_t)(buf_len / 2 * 1e6 / dev->rate));
+  }
+  free(buf);
+  return 0;
+}
+
+int rtlsdr_cancel_async(rtlsdr_dev_t *dev)
+{
+  dev->cancel = 1;
+  return 0;
+}